@@ -4,7 +4,9 @@ See the included LICENSE file
 */
 
 #include "Anim.h"
+#include "../utils/ThreadPool.h"
 #include "NifUtil.hpp"
+#include "VertexRemap.h"
 #include <unordered_set>
 #include <wx/log.h>
 #include <wx/msgdlg.h>
@@ -97,25 +99,23 @@ void AnimInfo::DeleteVertsForShape(const std::string& shape, const std::vector<u
 	if (indices.empty())
 		return;
 
-	int highestRemoved = indices.back();
-	std::vector<int> indexCollapse = GenerateIndexCollapseMap(indices, highestRemoved + 1);
-
-	auto& skin = shapeSkinning[shape];
-	for (auto& w : skin.boneWeights) {
-		ApplyIndexMapToMapKeys(w.second.weights, indexCollapse, -static_cast<int>(indices.size()));
-	}
+	shapeSkinning[shape].RemapVerts(VertexRemap::Deletion(indices));
 }
 
 void AnimSkin::InsertVertexIndices(const std::vector<uint16_t>& indices) {
-	if (indices.empty())
+	RemapVerts(VertexRemap::Insertion(indices));
+}
+
+void AnimSkin::RemapVerts(const VertexRemap& remap) {
+	if (remap.empty())
 		return;
 
-	int highestAdded = indices.back();
-	std::vector<int> indexExpand = GenerateIndexExpandMap(indices, highestAdded + 1);
+	std::vector<AnimWeight*> weights;
+	weights.reserve(boneWeights.size());
+	for (auto& w : boneWeights)
+		weights.push_back(&w.second);
 
-	for (auto& w : boneWeights) {
-		ApplyIndexMapToMapKeys(w.second.weights, indexExpand, static_cast<int>(indices.size()));
-	}
+	ThreadPool::Get().ParallelFor(weights.size(), [&](size_t i) { remap.ApplyToMapKeys(weights[i]->weights); });
 }
 
 void AnimWeight::LoadFromNif(NifFile* loadFromFile, NiShape* shape, const int& index) {
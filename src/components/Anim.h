@@ -10,6 +10,8 @@ See the included LICENSE file
 
 #include <map>
 
+class VertexRemap;
+
 struct VertexBoneWeights {
 	std::vector<uint8_t> boneIds;
 	std::vector<float> weights;
@@ -119,6 +121,8 @@ public:
 	}
 
 	void InsertVertexIndices(const std::vector<uint16_t>& indices);
+	// Moves the weights of all bones to their new vertex indices, processing the bones in parallel
+	void RemapVerts(const VertexRemap& remap);
 };
 
 class AnimPartition {
@@ -4,10 +4,46 @@ See the included LICENSE file
 */
 
 #include "Automorph.h"
+#include "../LZ4F/xxhash.h"
+#include "../utils/PlatformUtil.h"
+#include "../utils/StringStuff.h"
+#include "../utils/ThreadPool.h"
 #include "Anim.h"
+#include "VertexRemap.h"
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
 
 using namespace nifly;
 
+namespace {
+constexpr uint32_t ProximityCacheVersion = 1;
+constexpr size_t ProximityCacheFileLimit = 64; // Least recently used files beyond this count are removed
+
+std::string ProximityCacheFileName(const std::string& dir, uint64_t key) {
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.prox", (unsigned long long)key);
+	return dir + PathSepStr + name;
+}
+
+void PruneProximityCacheFiles(const std::string& dir) {
+	std::error_code ec;
+	std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::path>> files;
+	for (auto& entry : std::filesystem::directory_iterator(std::filesystem::u8path(dir), ec)) {
+		if (entry.path().extension() == ".prox")
+			files.emplace_back(entry.last_write_time(ec), entry.path());
+	}
+
+	if (files.size() <= ProximityCacheFileLimit)
+		return;
+
+	std::sort(files.begin(), files.end());
+	for (size_t i = 0; i < files.size() - ProximityCacheFileLimit; i++)
+		std::filesystem::remove(files[i].second, ec);
+}
+} // namespace
+
 Automorph::Automorph() {}
 
 Automorph::~Automorph() {
@@ -97,7 +133,7 @@ void Automorph::SetRef(NifFile& ref, NiShape* refShape, const AnimInfo* workAnim
 	morphRef = std::make_unique<Mesh>();
 	MeshFromNifShape(morphRef.get(), ref, refShape, workAnim);
 
-	refTree = std::make_unique<kd_tree<uint16_t>>(morphRef->verts.get(), static_cast<uint16_t>(morphRef->nVerts));
+	refTree.reset();
 }
 
 void Automorph::LinkRefDiffData(DiffDataSets* diffData) {
@@ -192,39 +228,233 @@ void Automorph::InsertVertexIndices(const std::string& target, const std::vector
 	resultDiffData.InsertVertexIndices(target, indices);
 }
 
+void Automorph::RemapVerts(const std::string& target, const VertexRemap& remap) {
+	resultDiffData.RemapVerts(target, remap);
+}
+
 void Automorph::ClearProximityCache() {
-	prox_cache.clear();
+	proxCache.clear();
+	proxCacheKey = 0;
 }
 
-void Automorph::BuildProximityCache(const std::string& shapeName, float proximityRadius, const std::set<uint16_t>* maskIndices) {
+void Automorph::BuildProximityCache(const std::string& shapeName, float proximityRadius, const std::set<uint16_t>* maskIndices, int maxResults) {
 	if (sourceShapes.find(shapeName) == sourceShapes.end())
 		return;
 
 	Mesh* m = sourceShapes[shapeName];
-	uint16_t maxCount = 0;
-	uint16_t minCount = std::numeric_limits<uint16_t>::max();
-
-	for (int i = 0; i < m->nVerts; i++) {
-		uint16_t resultCount = refTree->kd_nn(&m->verts[i], proximityRadius);
-		if (resultCount < minCount)
-			minCount = resultCount;
-		if (resultCount > maxCount)
-			maxCount = resultCount;
-
-		std::vector<kd_query_result<uint16_t>> indexResults;
-		for (uint16_t id = 0; id < resultCount; id++) {
-			auto& result = refTree->queryResult[id];
-
-			if (maskIndices) {
-				if (maskIndices->find(result.vertex_index) != maskIndices->end())
+
+	const uint64_t key = GetProximityCacheKey(m, proximityRadius, maskIndices, maxResults);
+	if (key == proxCacheKey && proxCache.RowCount() == static_cast<size_t>(m->nVerts))
+		return;
+
+	std::string cacheFileName;
+	if (!proxCacheDir.empty()) {
+		cacheFileName = ProximityCacheFileName(proxCacheDir, key);
+		if (LoadProximityCache(cacheFileName, key, m->nVerts)) {
+			proxCacheKey = key;
+			return;
+		}
+	}
+
+	// The tree is only needed when searching, so it's built on first use after changing the reference
+	if (!refTree)
+		refTree = std::make_unique<KDTree<uint16_t>>(morphRef->verts.get(), static_cast<uint16_t>(morphRef->nVerts));
+
+	// Reference vertices excluded by the mask
+	std::vector<bool> masked;
+	if (maskIndices) {
+		masked.resize(morphRef->nVerts, false);
+		for (uint16_t index : *maskIndices)
+			if (index < masked.size())
+				masked[index] = true;
+	}
+
+	ClearProximityCache();
+
+	// Queries don't modify the tree, so vertices are looked up in parallel.
+	// Each block collects its rows separately, they're concatenated in order afterwards.
+	struct BlockRows {
+		std::vector<uint32_t> counts;
+		std::vector<uint16_t> refIndices;
+		std::vector<float> weights;
+	};
+
+	constexpr int blockSize = 256;
+	const size_t blockCount = (m->nVerts + blockSize - 1) / blockSize;
+	std::vector<BlockRows> blockRows(blockCount);
+
+	ThreadPool::Get().ParallelFor(blockCount, [&](size_t block) {
+		BlockRows& rows = blockRows[block];
+		std::vector<kd_query_result<uint16_t>> queryResults;
+		std::vector<uint32_t> queryStack;
+
+		const int blockBegin = static_cast<int>(block) * blockSize;
+		const int blockEnd = std::min(m->nVerts, blockBegin + blockSize);
+		rows.counts.reserve(blockEnd - blockBegin);
+
+		for (int i = blockBegin; i < blockEnd; i++) {
+			refTree->Query(m->verts[i], proximityRadius, queryResults, queryStack);
+
+			uint32_t count = 0;
+			for (auto& result : queryResults) {
+				if (!masked.empty() && masked[result.vertex_index])
 					continue;
+
+				if (maxResults > 0 && count >= static_cast<uint32_t>(maxResults))
+					break;
+
+				rows.refIndices.push_back(result.vertex_index);
+				// Exact match, choose big nearness weight.
+				rows.weights.push_back(result.distance == 0.0f ? 1000.0f : 1.0f / result.distance);
+				count++;
 			}
 
-			indexResults.push_back(std::move(result));
+			rows.counts.push_back(count);
 		}
+	});
+
+	proxCache.offsets.resize(static_cast<size_t>(m->nVerts) + 1);
+	proxCache.offsets[0] = 0;
 
-		prox_cache[i] = std::move(indexResults);
+	size_t row = 0;
+	for (auto& rows : blockRows) {
+		for (uint32_t count : rows.counts) {
+			proxCache.offsets[row + 1] = proxCache.offsets[row] + count;
+			row++;
+		}
 	}
+
+	proxCache.refIndices.resize(proxCache.offsets.back());
+	proxCache.weights.resize(proxCache.offsets.back());
+
+	ThreadPool::Get().ParallelFor(blockCount, [&](size_t block) {
+		const BlockRows& rows = blockRows[block];
+		const uint32_t begin = proxCache.offsets[block * blockSize];
+		std::copy(rows.refIndices.begin(), rows.refIndices.end(), proxCache.refIndices.begin() + begin);
+		std::copy(rows.weights.begin(), rows.weights.end(), proxCache.weights.begin() + begin);
+	});
+
+	proxCacheKey = key;
+	if (!cacheFileName.empty())
+		SaveProximityCache(cacheFileName, key);
+}
+
+uint64_t Automorph::GetProximityCacheKey(Mesh* m, float proximityRadius, const std::set<uint16_t>* maskIndices, int maxResults) const {
+	XXH64_state_t* state = XXH64_createState();
+	XXH64_reset(state, ProximityCacheVersion);
+
+	auto addMesh = [&](const Mesh* mesh) {
+		const uint32_t count = static_cast<uint32_t>(mesh->nVerts);
+		XXH64_update(state, &count, sizeof(count));
+		XXH64_update(state, mesh->verts.get(), sizeof(Vector3) * count);
+	};
+
+	addMesh(morphRef.get());
+	addMesh(m);
+	XXH64_update(state, &proximityRadius, sizeof(proximityRadius));
+	XXH64_update(state, &maxResults, sizeof(maxResults));
+
+	std::vector<uint16_t> maskList;
+	if (maskIndices)
+		maskList.assign(maskIndices->begin(), maskIndices->end());
+
+	const uint32_t maskCount = static_cast<uint32_t>(maskList.size());
+	XXH64_update(state, &maskCount, sizeof(maskCount));
+	XXH64_update(state, maskList.data(), sizeof(uint16_t) * maskList.size());
+
+	uint64_t key = XXH64_digest(state);
+	XXH64_freeState(state);
+
+	// 0 stands for no cache
+	return key != 0 ? key : 1;
+}
+
+bool Automorph::LoadProximityCache(const std::string& fileName, uint64_t key, size_t rowCount) {
+	int64_t fileSize = 0;
+	int64_t fileTime = 0;
+	if (!PlatformUtil::GetFileStamp(fileName, fileSize, fileTime))
+		return false;
+
+	std::fstream file;
+	PlatformUtil::OpenFileStream(file, fileName, std::ios::in | std::ios::binary);
+	if (!file)
+		return false;
+
+	uint32_t header = 0;
+	uint32_t version = 0;
+	uint64_t fileKey = 0;
+	uint32_t fileRowCount = 0;
+	uint32_t entryCount = 0;
+	file.read(reinterpret_cast<char*>(&header), sizeof(header));
+	file.read(reinterpret_cast<char*>(&version), sizeof(version));
+	file.read(reinterpret_cast<char*>(&fileKey), sizeof(fileKey));
+	file.read(reinterpret_cast<char*>(&fileRowCount), sizeof(fileRowCount));
+	file.read(reinterpret_cast<char*>(&entryCount), sizeof(entryCount));
+
+	if (!file || header != "BSPC"_mci || version != ProximityCacheVersion || fileKey != key || fileRowCount != rowCount)
+		return false;
+
+	// Checked before allocating, so a damaged count can't ask for more than the file holds
+	const int64_t dataSize = static_cast<int64_t>(rowCount + 1) * sizeof(uint32_t) + static_cast<int64_t>(entryCount) * (sizeof(uint16_t) + sizeof(float));
+	if (fileSize - static_cast<int64_t>(file.tellg()) != dataSize)
+		return false;
+
+	ProximityCache cache;
+	cache.offsets.resize(rowCount + 1);
+	cache.refIndices.resize(entryCount);
+	cache.weights.resize(entryCount);
+	file.read(reinterpret_cast<char*>(cache.offsets.data()), sizeof(uint32_t) * cache.offsets.size());
+	file.read(reinterpret_cast<char*>(cache.refIndices.data()), sizeof(uint16_t) * cache.refIndices.size());
+	file.read(reinterpret_cast<char*>(cache.weights.data()), sizeof(float) * cache.weights.size());
+	if (!file)
+		return false;
+
+	if (cache.offsets.front() != 0 || cache.offsets.back() != entryCount)
+		return false;
+
+	for (size_t i = 0; i < rowCount; i++)
+		if (cache.offsets[i] > cache.offsets[i + 1])
+			return false;
+
+	for (uint16_t refIndex : cache.refIndices)
+		if (refIndex >= morphRef->nVerts)
+			return false;
+
+	proxCache = std::move(cache);
+
+	// Marks the file as recently used for pruning
+	std::error_code ec;
+	std::filesystem::last_write_time(std::filesystem::u8path(fileName), std::filesystem::file_time_type::clock::now(), ec);
+	return true;
+}
+
+bool Automorph::SaveProximityCache(const std::string& fileName, uint64_t key) const {
+	std::error_code ec;
+	std::filesystem::create_directories(std::filesystem::u8path(proxCacheDir), ec);
+
+	std::fstream file;
+	PlatformUtil::OpenFileStream(file, fileName, std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!file)
+		return false;
+
+	const uint32_t header = "BSPC"_mci;
+	const uint32_t version = ProximityCacheVersion;
+	const uint32_t rowCount = static_cast<uint32_t>(proxCache.RowCount());
+	const uint32_t entryCount = static_cast<uint32_t>(proxCache.refIndices.size());
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(&version), sizeof(version));
+	file.write(reinterpret_cast<const char*>(&key), sizeof(key));
+	file.write(reinterpret_cast<const char*>(&rowCount), sizeof(rowCount));
+	file.write(reinterpret_cast<const char*>(&entryCount), sizeof(entryCount));
+	file.write(reinterpret_cast<const char*>(proxCache.offsets.data()), sizeof(uint32_t) * proxCache.offsets.size());
+	file.write(reinterpret_cast<const char*>(proxCache.refIndices.data()), sizeof(uint16_t) * proxCache.refIndices.size());
+	file.write(reinterpret_cast<const char*>(proxCache.weights.data()), sizeof(float) * proxCache.weights.size());
+	if (!file)
+		return false;
+
+	file.close();
+	PruneProximityCacheFiles(proxCacheDir);
+	return true;
 }
 
 void Automorph::GetRawResultDiff(const std::string& shapeName, const std::string& sliderName, std::unordered_map<uint16_t, Vector3>& outDiff) {
@@ -329,6 +559,68 @@ void Automorph::ZeroVertDiff(const std::string& shapeName, const std::string& sl
 	resultDiffData.ZeroVertDiff(setName, shapeName, vertSet, mask);
 }
 
+void Automorph::InterpolateValues(const std::string& shapeName,
+								  const std::vector<const std::unordered_map<uint16_t, float>*>& refValues,
+								  int maxResults,
+								  std::vector<std::unordered_map<uint16_t, float>>& outValues) {
+	outValues.clear();
+	outValues.resize(refValues.size());
+
+	if (sourceShapes.find(shapeName) == sourceShapes.end())
+		return;
+
+	Mesh* m = sourceShapes[shapeName];
+	const size_t rowCount = std::min(proxCache.RowCount(), static_cast<size_t>(m->nVerts));
+
+	// Each value set is expanded to a dense array and streamed through all rows of the proximity cache
+	ThreadPool::Get().ParallelFor(refValues.size(), [&](size_t set) {
+		if (!refValues[set])
+			return;
+
+		std::vector<float> values(morphRef->nVerts, 0.0f);
+		std::vector<uint8_t> hasValue(morphRef->nVerts, 0);
+		for (auto& value : *refValues[set]) {
+			if (value.first < values.size()) {
+				values[value.first] = value.second;
+				hasValue[value.first] = 1;
+			}
+		}
+
+		std::unordered_map<uint16_t, float>& out = outValues[set];
+
+		for (size_t i = 0; i < rowCount; i++) {
+			const uint32_t rowBegin = proxCache.offsets[i];
+			const uint32_t rowEnd = proxCache.RowEnd(i, maxResults);
+
+			// Closest proximity vert has no value
+			if (rowBegin == rowEnd || !hasValue[proxCache.refIndices[rowBegin]])
+				continue;
+
+			float weightTotal = 0.0f;
+			float total = 0.0f;
+
+			for (uint32_t j = rowBegin; j < rowEnd; j++) {
+				const uint16_t vi = proxCache.refIndices[j];
+				if (!hasValue[vi])
+					continue;
+
+				total += values[vi] * proxCache.weights[j];
+				weightTotal += proxCache.weights[j];
+			}
+
+			total /= weightTotal;
+
+			if (m->mask && bEnableMask)
+				total *= (1.0f - m->mask[i]);
+
+			if (std::fabs(total) < EPSILON)
+				continue;
+
+			out[static_cast<uint16_t>(i)] = total;
+		}
+	});
+}
+
 void Automorph::SetResultDataName(const std::string& shapeName, const std::string& sliderName, const std::string& dataName) {
 	targetSliderDataNames[shapeName + sliderName] = dataName;
 }
@@ -344,15 +636,18 @@ std::string Automorph::ResultDataName(const std::string& shapeName, const std::s
 
 void Automorph::GenerateResultDiff(
 	const std::string& shapeName, const std::string& sliderName, const std::string& refDataName, bool transformResults, int maxResults, bool noSqueeze, bool solidMode, bool axisX, bool axisY, bool axisZ) {
-	if (sourceShapes.find(shapeName) == sourceShapes.end())
-		return;
+	std::vector<ResultDiffSource> sliders(1);
+	sliders[0].sliderName = sliderName;
+	sliders[0].refDataName = refDataName;
+	GenerateResultDiffs(shapeName, sliders, transformResults, maxResults, noSqueeze, solidMode, axisX, axisY, axisZ);
+}
 
-	std::unordered_map<uint16_t, Vector3>* diffData = srcDiffData->GetDiffSet(refDataName);
-	if (!diffData)
+void Automorph::GenerateResultDiffs(
+	const std::string& shapeName, const std::vector<ResultDiffSource>& sliders, bool transformResults, int maxResults, bool noSqueeze, bool solidMode, bool axisX, bool axisY, bool axisZ) {
+	if (sourceShapes.find(shapeName) == sourceShapes.end())
 		return;
 
 	Mesh* m = sourceShapes[shapeName];
-	std::string dataName = shapeName + sliderName;
 
 	MatTransform transform;
 	if (transformResults) {
@@ -360,140 +655,197 @@ void Automorph::GenerateResultDiff(
 		transformResults = !transform.IsNearlyEqualTo(MatTransform());
 	}
 
-	if (resultDiffData.TargetMatch(dataName, shapeName)) {
-		if (m->mask)
-			resultDiffData.ZeroVertDiff(dataName, m->nVerts, m->mask.get());
-		else
-			resultDiffData.ClearSet(dataName);
-	}
+	// Sliders without reference data are skipped
+	std::vector<std::unordered_map<uint16_t, Vector3>*> refDiffs;
+	std::vector<std::string> dataNames;
 
-	resultDiffData.AddEmptySet(dataName, shapeName);
-	auto resultDiffSet = resultDiffData.GetDiffSet(dataName);
-
-	std::vector<Vector3> totalMoveList;
-	std::vector<float> invDist;
-	std::vector<Vector3> effectVector;
-
-	for (int i = 0; i < m->nVerts; i++) {
-		std::vector<kd_query_result<uint16_t>>* vertProx = &prox_cache[i];
-		int nValues = vertProx->size();
-		if (nValues > maxResults)
-			nValues = maxResults;
-
-		int nearMoves = 0;
-		float invDistTotal = 0.0;
-
-		float weight;
-		Vector3 totalMove;
-
-		invDist.assign(nValues, 0.0f);
-		effectVector.assign(nValues, Vector3());
-
-		for (int j = 0; j < nValues; j++) {
-			uint16_t vi = (*vertProx)[j].vertex_index;
-			const Vector3* v = (*vertProx)[j].v;
-			auto diffItem = diffData->find(vi);
-			if (diffItem != diffData->end()) {
-				weight = (*vertProx)[j].distance; // "weight" is just a placeholder here...
-				if (weight == 0.0f)
-					invDist[nearMoves] = 1000.0f; // Exact match, choose big nearness weight.
-				else
-					invDist[nearMoves] = 1.0f / weight;
-
-				invDistTotal += invDist[nearMoves];
-
-				auto& effect = effectVector[nearMoves];
-				if (axisX) {
-					if (!noSqueeze || (noSqueeze && ((diffItem->second.x > 0.0f && v->x > 0.0f) || (diffItem->second.x < 0.0f && v->x < 0.0f))))
-						effect.x = diffItem->second.x;
-				}
-				if (axisY)
-					effect.y = diffItem->second.y;
-				if (axisZ)
-					effect.z = diffItem->second.z;
+	for (auto& slider : sliders) {
+		std::unordered_map<uint16_t, Vector3>* diffData = srcDiffData->GetDiffSet(slider.refDataName);
+		if (!diffData)
+			continue;
 
-				nearMoves++;
-			}
-			else if (j == 0) {
-				// Closest proximity vert has zero movement
-				nearMoves = 0;
-				break;
-			}
+		std::string dataName = shapeName + slider.sliderName;
+		if (resultDiffData.TargetMatch(dataName, shapeName)) {
+			if (m->mask)
+				resultDiffData.ZeroVertDiff(dataName, m->nVerts, m->mask.get());
+			else
+				resultDiffData.ClearSet(dataName);
 		}
 
-		if (nearMoves == 0)
-			continue;
+		resultDiffData.AddEmptySet(dataName, shapeName);
+		refDiffs.push_back(diffData);
+		dataNames.push_back(dataName);
+	}
+
+	if (refDiffs.empty())
+		return;
 
-		totalMove.Zero();
-		for (int j = 0; j < nearMoves; j++) {
-			weight = invDist[j] / invDistTotal;
-			totalMove += (effectVector[j] * weight);
+	std::vector<std::unordered_map<uint16_t, Vector3>*> resultDiffSets(dataNames.size());
+	for (size_t s = 0; s < dataNames.size(); s++)
+		resultDiffSets[s] = resultDiffData.GetDiffSet(dataNames[s]);
+
+	// Vertices are interpolated in parallel blocks, the moves of each block are kept separately and added in order afterwards.
+	// Solid mode only needs the largest positive and negative move per axis, reduced per block first.
+	struct BlockResult {
+		std::vector<std::pair<uint16_t, Vector3>> moves;
+		Vector3 solidMove;
+		Vector3 solidMoveNeg;
+		bool anyMove = false;
+	};
+
+	constexpr int blockSize = 1024;
+	const size_t blockCount = (m->nVerts + blockSize - 1) / blockSize;
+	const size_t rowCount = std::min(proxCache.RowCount(), static_cast<size_t>(m->nVerts));
+
+	// Each row of the proximity cache is read once for a tile of sliders, the tile's reference diffs are interleaved per reference vertex.
+	// Weights are only normalized per slider, since only neighbors with a diff in that slider count.
+	constexpr size_t tileSize = 16;
+	const size_t refCount = morphRef->nVerts;
+
+	std::vector<Vector3> refMoves;
+	std::vector<uint8_t> refHasMove;
+	std::vector<BlockResult> blockResults;
+
+	for (size_t tileBegin = 0; tileBegin < refDiffs.size(); tileBegin += tileSize) {
+		const size_t tileCount = std::min(tileSize, refDiffs.size() - tileBegin);
+
+		refMoves.assign(refCount * tileCount, Vector3());
+		refHasMove.assign(refCount * tileCount, 0);
+		for (size_t t = 0; t < tileCount; t++) {
+			for (auto& diff : *refDiffs[tileBegin + t]) {
+				if (diff.first < refCount) {
+					refMoves[diff.first * tileCount + t] = diff.second;
+					refHasMove[diff.first * tileCount + t] = 1;
+				}
+			}
 		}
 
-		if (m->mask && bEnableMask)
-			totalMove *= (1.0f - m->mask[i]);
+		blockResults.clear();
+		blockResults.resize(blockCount * tileCount);
 
-		if (totalMove.IsZero(true))
-			continue;
+		ThreadPool::Get().ParallelFor(blockCount, [&](size_t block) {
+			std::vector<Vector3> totalMoves(tileCount);
+			std::vector<float> weightTotals(tileCount);
 
-		if (!solidMode) {
-			if (transformResults)
-				totalMove = transform.ApplyTransformToDiff(totalMove);
-			(*resultDiffSet)[i] += totalMove;
-		}
-		else {
-			totalMoveList.reserve(m->nVerts);
-			totalMoveList.push_back(totalMove);
-		}
-	}
+			const int blockEnd = std::min(static_cast<int>(rowCount), static_cast<int>(block + 1) * blockSize);
+			for (int i = static_cast<int>(block) * blockSize; i < blockEnd; i++) {
+				const uint32_t rowBegin = proxCache.offsets[i];
+				const uint32_t rowEnd = proxCache.RowEnd(i, maxResults);
+				if (rowBegin == rowEnd)
+					continue;
 
-	if (solidMode && !totalMoveList.empty()) {
-		Vector3 totalSolidMove;
-		Vector3 totalSolidMoveNeg;
+				std::fill(totalMoves.begin(), totalMoves.end(), Vector3());
+				std::fill(weightTotals.begin(), weightTotals.end(), 0.0f);
+
+				for (uint32_t j = rowBegin; j < rowEnd; j++) {
+					const uint16_t vi = proxCache.refIndices[j];
+					const float weight = proxCache.weights[j];
+					const float refX = morphRef->verts[vi].x;
+					const Vector3* moves = &refMoves[vi * tileCount];
+					const uint8_t* hasMove = &refHasMove[vi * tileCount];
+
+					for (size_t t = 0; t < tileCount; t++) {
+						if (!hasMove[t])
+							continue;
+
+						const Vector3& diff = moves[t];
+						Vector3 effect;
+						if (axisX) {
+							if (!noSqueeze || (diff.x > 0.0f && refX > 0.0f) || (diff.x < 0.0f && refX < 0.0f))
+								effect.x = diff.x;
+						}
+						if (axisY)
+							effect.y = diff.y;
+						if (axisZ)
+							effect.z = diff.z;
+
+						totalMoves[t] += effect * weight;
+						weightTotals[t] += weight;
+					}
+				}
 
-		for (const auto& mv : totalMoveList) {
-			if (mv.x >= 0.0f) {
-				if (mv.x > totalSolidMove.x)
-					totalSolidMove.x = mv.x;
-			}
-			else {
-				if (mv.x < totalSolidMoveNeg.x)
-					totalSolidMoveNeg.x = mv.x;
+				const uint8_t* nearestHasMove = &refHasMove[proxCache.refIndices[rowBegin] * tileCount];
+
+				for (size_t t = 0; t < tileCount; t++) {
+					// Closest proximity vert has zero movement
+					if (!nearestHasMove[t])
+						continue;
+
+					Vector3 totalMove = totalMoves[t] * (1.0f / weightTotals[t]);
+
+					if (m->mask && bEnableMask)
+						totalMove *= (1.0f - m->mask[i]);
+
+					if (totalMove.IsZero(true))
+						continue;
+
+					BlockResult& result = blockResults[t * blockCount + block];
+					if (!solidMode) {
+						if (transformResults)
+							totalMove = transform.ApplyTransformToDiff(totalMove);
+						result.moves.emplace_back(static_cast<uint16_t>(i), totalMove);
+					}
+					else {
+						result.anyMove = true;
+						result.solidMove.x = std::max(result.solidMove.x, totalMove.x);
+						result.solidMove.y = std::max(result.solidMove.y, totalMove.y);
+						result.solidMove.z = std::max(result.solidMove.z, totalMove.z);
+						result.solidMoveNeg.x = std::min(result.solidMoveNeg.x, totalMove.x);
+						result.solidMoveNeg.y = std::min(result.solidMoveNeg.y, totalMove.y);
+						result.solidMoveNeg.z = std::min(result.solidMoveNeg.z, totalMove.z);
+					}
+				}
 			}
+		});
 
-			if (mv.y >= 0.0f) {
-				if (mv.y > totalSolidMove.y)
-					totalSolidMove.y = mv.y;
-			}
-			else {
-				if (mv.y < totalSolidMoveNeg.y)
-					totalSolidMoveNeg.y = mv.y;
-			}
+		for (size_t t = 0; t < tileCount; t++) {
+			auto resultDiffSet = resultDiffSets[tileBegin + t];
+			const BlockResult* sliderResults = &blockResults[t * blockCount];
 
-			if (mv.z >= 0.0f) {
-				if (mv.z > totalSolidMove.z)
-					totalSolidMove.z = mv.z;
-			}
-			else {
-				if (mv.z < totalSolidMoveNeg.z)
-					totalSolidMoveNeg.z = mv.z;
+			if (!solidMode) {
+				for (size_t block = 0; block < blockCount; block++)
+					for (auto& move : sliderResults[block].moves)
+						(*resultDiffSet)[move.first] += move.second;
+
+				continue;
 			}
-		}
 
-		totalSolidMove += totalSolidMoveNeg;
+			Vector3 totalSolidMove;
+			Vector3 totalSolidMoveNeg;
+			bool anyMove = false;
 
-		for (int i = 0; i < m->nVerts; i++) {
-			Vector3 totalMove = totalSolidMove;
+			for (size_t block = 0; block < blockCount; block++) {
+				const BlockResult& result = sliderResults[block];
+				if (!result.anyMove)
+					continue;
 
-			if (m->mask && bEnableMask)
-				totalMove *= (1.0f - m->mask[i]);
+				anyMove = true;
+				totalSolidMove.x = std::max(totalSolidMove.x, result.solidMove.x);
+				totalSolidMove.y = std::max(totalSolidMove.y, result.solidMove.y);
+				totalSolidMove.z = std::max(totalSolidMove.z, result.solidMove.z);
+				totalSolidMoveNeg.x = std::min(totalSolidMoveNeg.x, result.solidMoveNeg.x);
+				totalSolidMoveNeg.y = std::min(totalSolidMoveNeg.y, result.solidMoveNeg.y);
+				totalSolidMoveNeg.z = std::min(totalSolidMoveNeg.z, result.solidMoveNeg.z);
+			}
 
-			if (totalMove.IsZero(true))
+			if (!anyMove)
 				continue;
 
-			if (transformResults)
-				totalMove = transform.ApplyTransformToDiff(totalMove);
-			(*resultDiffSet)[i] += totalMove;
+			totalSolidMove += totalSolidMoveNeg;
+
+			for (int i = 0; i < m->nVerts; i++) {
+				Vector3 totalMove = totalSolidMove;
+
+				if (m->mask && bEnableMask)
+					totalMove *= (1.0f - m->mask[i]);
+
+				if (totalMove.IsZero(true))
+					continue;
+
+				if (transformResults)
+					totalMove = transform.ApplyTransformToDiff(totalMove);
+				(*resultDiffSet)[i] += totalMove;
+			}
 		}
 	}
 }
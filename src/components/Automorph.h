@@ -5,30 +5,63 @@ See the included LICENSE file
 
 #pragma once
 
+#include "../utils/KDTree.h"
 #include "KDMatcher.hpp"
 #include "Mesh.h"
 #include "NifFile.hpp"
 #include "SliderSet.h"
 
 class AnimInfo;
+class VertexRemap;
 
 class Automorph {
-	std::unique_ptr<nifly::kd_tree<uint16_t>> refTree;
+	// Reference vertices near each source vertex as compressed sparse rows, nearest first.
+	// Row i is [offsets[i], offsets[i + 1]) of the packed arrays. The weights are the inverse distances before normalizing.
+	struct ProximityCache {
+		std::vector<uint32_t> offsets;
+		std::vector<uint16_t> refIndices;
+		std::vector<float> weights;
+
+		size_t RowCount() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+		// End of row i when using at most maxResults entries
+		uint32_t RowEnd(size_t i, int maxResults) const { return std::min(offsets[i + 1], offsets[i] + static_cast<uint32_t>(std::max(maxResults, 0))); }
+
+		void clear() {
+			offsets.clear();
+			refIndices.clear();
+			weights.clear();
+		}
+	};
+
+	std::unique_ptr<KDTree<uint16_t>> refTree;
 	std::map<std::string, Mesh*> sourceShapes;
 	// Class - to prevent AutoMorph from deleting it. Golly, smart pointers would be nice.
-	std::map<int, std::vector<nifly::kd_query_result<uint16_t>>> prox_cache;
+	ProximityCache proxCache;
+	uint64_t proxCacheKey = 0;	// Key of the current proximity cache, 0 if there's none
+	std::string proxCacheDir;	// Folder of proximity cache files, empty if they're disabled
 	DiffDataSets __srcDiffData;			 // Unternally loaded and stored diff data.diffs loaded from existing reference .bsd files.
 	DiffDataSets* srcDiffData = nullptr; // Either __srcDiffData or an external linked data set.
 	DiffDataSets resultDiffData;		 // Diffs calculated by AutoMorph.
 
 	bool bEnableMask = true; // Use red component of mesh vertex color as a mask for morphing.
 
+	// Hash of everything the proximity cache of a shape depends on
+	uint64_t GetProximityCacheKey(Mesh* m, float proximityRadius, const std::set<uint16_t>* maskIndices, int maxResults) const;
+	bool LoadProximityCache(const std::string& fileName, uint64_t key, size_t rowCount);
+	bool SaveProximityCache(const std::string& fileName, uint64_t key) const;
+
 	// A translation between shapetarget + slidername and the data name for the result diff data set.
 	// This only has values when a sliderset is loaded from disk and a slider's data name for a target
 	// doesn't match the format targetname + slidername.
 	std::unordered_map<std::string, std::string> targetSliderDataNames;
 
 public:
+	// Slider for GenerateResultDiffs
+	struct ResultDiffSource {
+		std::string sliderName;
+		std::string refDataName;
+	};
+
 	std::unique_ptr<Mesh> morphRef;
 
 	Automorph();
@@ -61,9 +94,14 @@ public:
 	void DeleteVerts(const std::string& shapeName, const std::vector<uint16_t>& indices);
 	// indices must be in ascending order.
 	void InsertVertexIndices(const std::string& target, const std::vector<uint16_t>& indices);
+	void RemapVerts(const std::string& target, const VertexRemap& remap);
 
 	void ClearProximityCache();
-	void BuildProximityCache(const std::string& shapeName, float proximityRadius = 10.0f, const std::set<uint16_t>* maskIndices = nullptr);
+	// Stores proximity caches in this folder and reuses them in later sessions, empty to disable
+	void SetProximityCacheDir(const std::string& dir) { proxCacheDir = dir; }
+	// maxResults limits the cached reference vertices per source vertex, 0 keeps all within the radius.
+	// Nothing is searched if the current cache or a cache file was built from the same meshes and parameters.
+	void BuildProximityCache(const std::string& shapeName, float proximityRadius = 10.0f, const std::set<uint16_t>* maskIndices = nullptr, int maxResults = 0);
 
 	// shapeName = name of the mesh to morph (eg "IronArmor") also known as target name.
 	// sliderName = name of the morph to apply (eg "BreastsSH").
@@ -78,6 +116,25 @@ public:
 							bool axisY = true,
 							bool axisZ = true);
 
+	// Same as GenerateResultDiff for several sliders with the same options.
+	// The proximity cache is read once per vertex for all sliders instead of once per slider.
+	void GenerateResultDiffs(const std::string& shapeName,
+							 const std::vector<ResultDiffSource>& sliders,
+							 bool transformResults,
+							 int maxResults = 10,
+							 bool noSqueeze = false,
+							 bool solidMode = false,
+							 bool axisX = true,
+							 bool axisY = true,
+							 bool axisZ = true);
+
+	// Interpolates per-vertex values of the reference shape, such as bone weights, for the source shape the same way as GenerateResultDiff.
+	// Null entries of refValues have no values. outValues gets the nonzero results of each entry.
+	void InterpolateValues(const std::string& shapeName,
+						   const std::vector<const std::unordered_map<uint16_t, float>*>& refValues,
+						   int maxResults,
+						   std::vector<std::unordered_map<uint16_t, float>>& outValues);
+
 	void SetResultDataName(const std::string& shapeName, const std::string& sliderName, const std::string& dataName);
 	std::string ResultDataName(const std::string& shapeName, const std::string& sliderName);
 
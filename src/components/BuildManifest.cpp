@@ -0,0 +1,259 @@
+/*
+BodySlide and Outfit Studio
+See the included LICENSE file
+*/
+
+#include "BuildManifest.h"
+#include "../LZ4F/xxhash.h"
+#include "../utils/PlatformUtil.h"
+
+#include <tinyxml2.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+using namespace tinyxml2;
+
+namespace {
+std::string HashToString(uint64_t hash) {
+	char buf[17];
+	snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)hash);
+	return buf;
+}
+
+uint64_t HashFromString(const char* str) {
+	if (!str)
+		return 0;
+
+	return std::strtoull(str, nullptr, 16);
+}
+} // namespace
+
+BuildHash::BuildHash() {
+	state = XXH64_createState();
+	XXH64_reset(state, 0);
+}
+
+BuildHash::~BuildHash() {
+	XXH64_freeState(state);
+}
+
+void BuildHash::Add(const void* data, size_t size) {
+	XXH64_update(state, data, size);
+}
+
+void BuildHash::Add(const std::string& str) {
+	// Length prefix keeps consecutive strings from running into each other
+	Add((uint64_t)str.size());
+	Add(str.data(), str.size());
+}
+
+uint64_t BuildHash::Get() const {
+	return XXH64_digest(state);
+}
+
+
+bool BuildManifest::GetFileStamp(const std::string& filePath, FileStamp& outStamp) {
+	return PlatformUtil::GetFileStamp(filePath, outStamp.size, outStamp.time);
+}
+
+bool BuildManifest::Load(const std::string& srcFileName) {
+	std::lock_guard<std::mutex> lock(manifestMutex);
+
+	fileName = srcFileName;
+	inputFiles.clear();
+	outfits.clear();
+	changed = false;
+
+	FILE* fp = nullptr;
+
+#ifdef _WINDOWS
+	std::wstring winFileName = PlatformUtil::MultiByteToWideUTF8(srcFileName);
+	if (_wfopen_s(&fp, winFileName.c_str(), L"rb") || !fp)
+		return false;
+#else
+	fp = fopen(srcFileName.c_str(), "rb");
+	if (!fp)
+		return false;
+#endif
+
+	XMLDocument doc;
+	int error = doc.LoadFile(fp);
+	fclose(fp);
+
+	if (error)
+		return false;
+
+	XMLElement* root = doc.FirstChildElement("BuildManifest");
+	if (!root)
+		return false;
+
+	XMLElement* fileElem = root->FirstChildElement("Input");
+	while (fileElem) {
+		const char* path = fileElem->Attribute("path");
+		if (path) {
+			InputFile& file = inputFiles[path];
+			file.stamp.size = fileElem->Int64Attribute("size", -1);
+			file.stamp.time = fileElem->Int64Attribute("time");
+			file.hash = HashFromString(fileElem->Attribute("hash"));
+		}
+
+		fileElem = fileElem->NextSiblingElement("Input");
+	}
+
+	XMLElement* outfitElem = root->FirstChildElement("Outfit");
+	while (outfitElem) {
+		const char* name = outfitElem->Attribute("name");
+		const char* target = outfitElem->Attribute("target");
+		if (name && target) {
+			OutfitEntry& outfit = outfits[{name, target}];
+			outfit.hash = HashFromString(outfitElem->Attribute("hash"));
+
+			XMLElement* outputElem = outfitElem->FirstChildElement("Output");
+			while (outputElem) {
+				const char* path = outputElem->Attribute("path");
+				if (path) {
+					FileStamp& stamp = outfit.outputs[path];
+					stamp.size = outputElem->Int64Attribute("size", -1);
+					stamp.time = outputElem->Int64Attribute("time");
+				}
+
+				outputElem = outputElem->NextSiblingElement("Output");
+			}
+		}
+
+		outfitElem = outfitElem->NextSiblingElement("Outfit");
+	}
+
+	return true;
+}
+
+bool BuildManifest::Save() {
+	std::lock_guard<std::mutex> lock(manifestMutex);
+
+	if (!changed)
+		return true;
+
+	XMLDocument doc;
+	doc.InsertFirstChild(doc.NewDeclaration());
+
+	XMLElement* root = doc.InsertEndChild(doc.NewElement("BuildManifest"))->ToElement();
+
+	for (auto& file : inputFiles) {
+		XMLElement* fileElem = root->InsertEndChild(doc.NewElement("Input"))->ToElement();
+		fileElem->SetAttribute("path", file.first.c_str());
+		fileElem->SetAttribute("size", file.second.stamp.size);
+		fileElem->SetAttribute("time", file.second.stamp.time);
+		fileElem->SetAttribute("hash", HashToString(file.second.hash).c_str());
+	}
+
+	for (auto& outfit : outfits) {
+		XMLElement* outfitElem = root->InsertEndChild(doc.NewElement("Outfit"))->ToElement();
+		outfitElem->SetAttribute("name", outfit.first.first.c_str());
+		outfitElem->SetAttribute("target", outfit.first.second.c_str());
+		outfitElem->SetAttribute("hash", HashToString(outfit.second.hash).c_str());
+
+		for (auto& output : outfit.second.outputs) {
+			XMLElement* outputElem = outfitElem->InsertEndChild(doc.NewElement("Output"))->ToElement();
+			outputElem->SetAttribute("path", output.first.c_str());
+			outputElem->SetAttribute("size", output.second.size);
+			outputElem->SetAttribute("time", output.second.time);
+		}
+	}
+
+	FILE* fp = nullptr;
+
+#ifdef _WINDOWS
+	std::wstring winFileName = PlatformUtil::MultiByteToWideUTF8(fileName);
+	if (_wfopen_s(&fp, winFileName.c_str(), L"w") || !fp)
+		return false;
+#else
+	fp = fopen(fileName.c_str(), "w");
+	if (!fp)
+		return false;
+#endif
+
+	doc.SetBOM(true);
+
+	int error = doc.SaveFile(fp);
+	fclose(fp);
+	if (error)
+		return false;
+
+	changed = false;
+	return true;
+}
+
+bool BuildManifest::HashFile(const std::string& filePath, uint64_t& outHash) {
+	FileStamp stamp;
+	if (!GetFileStamp(filePath, stamp))
+		return false;
+
+	{
+		std::lock_guard<std::mutex> lock(manifestMutex);
+		auto it = inputFiles.find(filePath);
+		if (it != inputFiles.end() && it->second.stamp == stamp) {
+			outHash = it->second.hash;
+			return true;
+		}
+	}
+
+	std::fstream file;
+	PlatformUtil::OpenFileStream(file, filePath, std::ios::in | std::ios::binary);
+	if (!file.is_open())
+		return false;
+
+	BuildHash hash;
+	std::vector<char> buffer(1024 * 1024);
+	while (file) {
+		file.read(buffer.data(), buffer.size());
+		hash.Add(buffer.data(), (size_t)file.gcount());
+	}
+
+	outHash = hash.Get();
+
+	std::lock_guard<std::mutex> lock(manifestMutex);
+	InputFile& inputFile = inputFiles[filePath];
+	inputFile.stamp = stamp;
+	inputFile.hash = outHash;
+	changed = true;
+	return true;
+}
+
+bool BuildManifest::IsUpToDate(const std::string& outfit, const std::string& dataPath, uint64_t hash) {
+	std::lock_guard<std::mutex> lock(manifestMutex);
+
+	auto it = outfits.find({outfit, dataPath});
+	if (it == outfits.end() || it->second.hash != hash || it->second.outputs.empty())
+		return false;
+
+	// Outputs must still exist and must not have been overwritten by another build
+	for (auto& output : it->second.outputs) {
+		FileStamp stamp;
+		if (!GetFileStamp(output.first, stamp) || stamp != output.second)
+			return false;
+	}
+
+	return true;
+}
+
+void BuildManifest::SetBuilt(const std::string& outfit, const std::string& dataPath, uint64_t hash, const std::vector<std::string>& outputFiles) {
+	OutfitEntry entry;
+	entry.hash = hash;
+
+	for (auto& outputFile : outputFiles) {
+		FileStamp stamp;
+		if (GetFileStamp(outputFile, stamp))
+			entry.outputs[outputFile] = stamp;
+	}
+
+	std::lock_guard<std::mutex> lock(manifestMutex);
+	outfits[{outfit, dataPath}] = std::move(entry);
+	changed = true;
+}
+
+void BuildManifest::Remove(const std::string& outfit, const std::string& dataPath) {
+	std::lock_guard<std::mutex> lock(manifestMutex);
+	if (outfits.erase({outfit, dataPath}) > 0)
+		changed = true;
+}
@@ -0,0 +1,84 @@
+/*
+BodySlide and Outfit Studio
+See the included LICENSE file
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct XXH64_state_s;
+
+// Streaming 64-bit content hash (xxHash) of build inputs
+class BuildHash {
+	XXH64_state_s* state = nullptr;
+
+public:
+	BuildHash();
+	~BuildHash();
+
+	BuildHash(const BuildHash&) = delete;
+	BuildHash& operator=(const BuildHash&) = delete;
+
+	void Add(const void* data, size_t size);
+	void Add(const std::string& str);
+	void Add(uint64_t value) { Add(&value, sizeof(value)); }
+	void Add(float value) { Add(&value, sizeof(value)); }
+	void Add(bool value) { Add(&value, sizeof(value)); }
+
+	uint64_t Get() const;
+};
+
+// Records the input hash and output files of every built outfit.
+// Batch builds skip outfits whose inputs haven't changed and whose outputs weren't touched since.
+// The manifest is stored as "BuildManifest.xml" next to "BuildSelection.xml".
+class BuildManifest {
+public:
+	struct FileStamp {
+		int64_t size = -1;
+		int64_t time = 0;
+
+		bool operator==(const FileStamp& other) const { return size == other.size && time == other.time; }
+		bool operator!=(const FileStamp& other) const { return !(*this == other); }
+	};
+
+private:
+	struct InputFile {
+		FileStamp stamp;
+		uint64_t hash = 0;
+	};
+
+	struct OutfitEntry {
+		uint64_t hash = 0;
+		std::map<std::string, FileStamp> outputs;
+	};
+
+	typedef std::pair<std::string, std::string> OutfitKey; // Outfit name, output data path
+
+	std::string fileName;
+	std::map<std::string, InputFile> inputFiles;
+	std::map<OutfitKey, OutfitEntry> outfits;
+	std::mutex manifestMutex;
+	bool changed = false;
+
+public:
+	// Size and modification time of a file. Returns false if the file doesn't exist.
+	static bool GetFileStamp(const std::string& filePath, FileStamp& outStamp);
+
+	bool Load(const std::string& srcFileName);
+	bool Save();
+
+	// Content hash of a file. The hash of a file with unchanged size and modification time is reused.
+	// Returns false if the file can't be read.
+	bool HashFile(const std::string& filePath, uint64_t& outHash);
+
+	// True if the outfit was built with the same input hash and all of its outputs are unchanged.
+	bool IsUpToDate(const std::string& outfit, const std::string& dataPath, uint64_t hash);
+
+	void SetBuilt(const std::string& outfit, const std::string& dataPath, uint64_t hash, const std::vector<std::string>& outputFiles);
+	void Remove(const std::string& outfit, const std::string& dataPath);
+};
@@ -0,0 +1,196 @@
+/*
+BodySlide and Outfit Studio
+See the included LICENSE file
+*/
+
+#include "BuildStats.h"
+#include "../utils/PlatformUtil.h"
+#include "../utils/StringStuff.h"
+
+#include <algorithm>
+#include <fstream>
+#include <wx/log.h>
+
+namespace {
+std::string CsvString(const std::string& str) {
+	std::string out = "\"";
+	for (char c : str) {
+		if (c == '"')
+			out += '"';
+
+		out += c;
+	}
+
+	out += '"';
+	return out;
+}
+} // namespace
+
+void BuildStats::Add(const BuildStats& other, size_t shareCount, size_t shareIndex) {
+	for (size_t i = 0; i < (size_t)BuildStage::Count; i++)
+		stageSeconds[i] += other.stageSeconds[i] / shareCount;
+
+	auto share = [&](uint64_t total) {
+		uint64_t value = total / shareCount;
+		if (shareIndex == 0)
+			value += total % shareCount;
+
+		return value;
+	};
+
+	vertices += share(other.vertices);
+	sliders += share(other.sliders);
+	bytesRead += share(other.bytesRead);
+	bytesWritten += share(other.bytesWritten);
+}
+
+double BuildStats::TotalSeconds() const {
+	double seconds = 0.0;
+	for (size_t i = 0; i < (size_t)BuildStage::Count; i++)
+		seconds += stageSeconds[i];
+
+	return seconds;
+}
+
+const char* BuildStats::StageName(BuildStage stage) {
+	switch (stage) {
+		case BuildStage::ParseSet: return "ParseSet";
+		case BuildStage::LoadNif: return "LoadNif";
+		case BuildStage::LoadDiffs: return "LoadDiffs";
+		case BuildStage::ApplyMorphs: return "ApplyMorphs";
+		case BuildStage::CalcNormals: return "CalcNormals";
+		case BuildStage::RefNormals: return "RefNormals";
+		case BuildStage::CalcTangents: return "CalcTangents";
+		case BuildStage::DeleteZaps: return "DeleteZaps";
+		case BuildStage::MorphTRI: return "MorphTRI";
+		case BuildStage::SaveNif: return "SaveNif";
+		default: return "";
+	}
+}
+
+
+void BuildStatsReport::Add(const std::string& outfit, const std::string& preset, double seconds, const BuildStats& stats) {
+	std::lock_guard<std::mutex> lock(reportMutex);
+
+	Entry entry;
+	entry.outfit = outfit;
+	entry.preset = preset;
+	entry.seconds = seconds;
+	entry.stats = stats;
+	entries.push_back(std::move(entry));
+}
+
+void BuildStatsReport::LogSummary(size_t slowestCount) {
+	std::lock_guard<std::mutex> lock(reportMutex);
+
+	if (entries.empty())
+		return;
+
+	BuildStats total;
+	double totalSeconds = 0.0;
+	for (auto& entry : entries) {
+		total.Add(entry.stats);
+		totalSeconds += entry.seconds;
+	}
+
+	// Stage times are summed over all threads, so they exceed the wall clock time of parallel builds
+	double stageTotal = total.TotalSeconds();
+
+	wxLogMessage("Build statistics of %zu sets (%.2f s of build time):", entries.size(), totalSeconds);
+	wxLogMessage("  %-14s %10s %7s", "Stage", "Seconds", "Share");
+
+	for (size_t i = 0; i < (size_t)BuildStage::Count; i++) {
+		double seconds = total.stageSeconds[i];
+		double share = stageTotal > 0.0 ? seconds / stageTotal * 100.0 : 0.0;
+		wxLogMessage("  %-14s %10.3f %6.1f%%", BuildStats::StageName((BuildStage)i), seconds, share);
+	}
+
+	wxLogMessage("  Vertices: %llu, sliders: %llu, read: %.1f MB, written: %.1f MB",
+				 (unsigned long long)total.vertices,
+				 (unsigned long long)total.sliders,
+				 total.bytesRead / (1024.0 * 1024.0),
+				 total.bytesWritten / (1024.0 * 1024.0));
+
+	std::vector<const Entry*> slowest;
+	for (auto& entry : entries)
+		slowest.push_back(&entry);
+
+	std::sort(slowest.begin(), slowest.end(), [](const Entry* a, const Entry* b) { return a->seconds > b->seconds; });
+	if (slowest.size() > slowestCount)
+		slowest.resize(slowestCount);
+
+	wxLogMessage("  Slowest sets:");
+	for (auto entry : slowest) {
+		// Name the stage that took the most time
+		size_t maxStage = 0;
+		for (size_t i = 1; i < (size_t)BuildStage::Count; i++)
+			if (entry->stats.stageSeconds[i] > entry->stats.stageSeconds[maxStage])
+				maxStage = i;
+
+		wxLogMessage("    %.3f s '%s' (%s), mostly %s",
+					 entry->seconds,
+					 entry->outfit,
+					 entry->preset,
+					 BuildStats::StageName((BuildStage)maxStage));
+	}
+}
+
+bool BuildStatsReport::WriteCSV(std::ostream& out) {
+	out << "outfit,preset,seconds";
+	for (size_t i = 0; i < (size_t)BuildStage::Count; i++)
+		out << "," << BuildStats::StageName((BuildStage)i);
+
+	out << ",vertices,sliders,bytesRead,bytesWritten\n";
+
+	for (auto& entry : entries) {
+		out << CsvString(entry.outfit) << "," << CsvString(entry.preset) << "," << entry.seconds;
+		for (size_t i = 0; i < (size_t)BuildStage::Count; i++)
+			out << "," << entry.stats.stageSeconds[i];
+
+		out << "," << entry.stats.vertices << "," << entry.stats.sliders << "," << entry.stats.bytesRead << "," << entry.stats.bytesWritten << "\n";
+	}
+
+	return !out.fail();
+}
+
+bool BuildStatsReport::WriteJSON(std::ostream& out) {
+	out << "[";
+
+	for (size_t e = 0; e < entries.size(); e++) {
+		auto& entry = entries[e];
+		out << (e > 0 ? ",\n" : "\n");
+		out << "\t{\n";
+		out << "\t\t\"outfit\": " << JsonString(entry.outfit) << ",\n";
+		out << "\t\t\"preset\": " << JsonString(entry.preset) << ",\n";
+		out << "\t\t\"seconds\": " << entry.seconds << ",\n";
+		out << "\t\t\"stages\": {";
+
+		for (size_t i = 0; i < (size_t)BuildStage::Count; i++)
+			out << (i > 0 ? ", " : "") << JsonString(BuildStats::StageName((BuildStage)i)) << ": " << entry.stats.stageSeconds[i];
+
+		out << "},\n";
+		out << "\t\t\"vertices\": " << entry.stats.vertices << ",\n";
+		out << "\t\t\"sliders\": " << entry.stats.sliders << ",\n";
+		out << "\t\t\"bytesRead\": " << entry.stats.bytesRead << ",\n";
+		out << "\t\t\"bytesWritten\": " << entry.stats.bytesWritten << "\n";
+		out << "\t}";
+	}
+
+	out << (entries.empty() ? "]\n" : "\n]\n");
+	return !out.fail();
+}
+
+bool BuildStatsReport::Write(const std::string& fileName) {
+	std::lock_guard<std::mutex> lock(reportMutex);
+
+	std::fstream file;
+	PlatformUtil::OpenFileStream(file, fileName, std::ios::out | std::ios::trunc);
+	if (!file.is_open())
+		return false;
+
+	std::string ext = fileName.size() >= 5 ? fileName.substr(fileName.size() - 5) : "";
+	if (StringsEqualInsens(ext.c_str(), ".json"))
+		return WriteJSON(file);
+
+	return WriteCSV(file);
+}
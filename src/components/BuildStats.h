@@ -0,0 +1,73 @@
+/*
+BodySlide and Outfit Studio
+See the included LICENSE file
+*/
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Measured stages of an outfit build
+enum class BuildStage { ParseSet, LoadNif, LoadDiffs, ApplyMorphs, CalcNormals, RefNormals, CalcTangents, DeleteZaps, MorphTRI, SaveNif, Count };
+
+// Time spent in each stage and counters of a single outfit build
+struct BuildStats {
+	double stageSeconds[(size_t)BuildStage::Count] = {};
+	uint64_t vertices = 0;
+	uint64_t sliders = 0;
+	uint64_t bytesRead = 0;
+	uint64_t bytesWritten = 0;
+
+	// Adds share shareIndex of shareCount equal shares of other, used to split work done once for several targets.
+	// The first share gets the remainder of the counters, so the shares add up to other.
+	void Add(const BuildStats& other, size_t shareCount = 1, size_t shareIndex = 0);
+	double TotalSeconds() const;
+
+	static const char* StageName(BuildStage stage);
+};
+
+// Adds the time from construction to destruction to a stage
+class ScopedStageTimer {
+	BuildStats& stats;
+	BuildStage stage;
+	std::chrono::steady_clock::time_point startTime;
+
+public:
+	ScopedStageTimer(BuildStats& stats, BuildStage stage)
+		: stats(stats)
+		, stage(stage)
+		, startTime(std::chrono::steady_clock::now()) {}
+
+	~ScopedStageTimer() { stats.stageSeconds[(size_t)stage] += std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count(); }
+};
+
+// Collects the statistics of all outfits of a batch build
+class BuildStatsReport {
+	struct Entry {
+		std::string outfit;
+		std::string preset;
+		double seconds = 0.0;
+		BuildStats stats;
+	};
+
+	std::vector<Entry> entries;
+	std::mutex reportMutex;
+
+	bool WriteCSV(std::ostream& out);
+	bool WriteJSON(std::ostream& out);
+
+public:
+	// May be called from multiple threads at once
+	void Add(const std::string& outfit, const std::string& preset, double seconds, const BuildStats& stats);
+
+	// Logs the total time of each stage, the counters and the slowest outfits
+	void LogSummary(size_t slowestCount = 5);
+
+	// Writes all entries as JSON if the file name ends with ".json", as CSV otherwise
+	bool Write(const std::string& fileName);
+};
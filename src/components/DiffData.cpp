@@ -4,125 +4,539 @@ See the included LICENSE file
 */
 
 #include "DiffData.h"
+#include "DiffDataCache.h"
+#include "MorphCache.h"
+#include "../LZ4F/lz4.h"
+#include "../LZ4F/xxhash.h"
+#include "../utils/MappedFile.h"
 #include "../utils/PlatformUtil.h"
+#include "../utils/ThreadPool.h"
 #include "NifUtil.hpp"
 #include "UndoState.h"
+#include "VertexRemap.h"
 
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
 #include <fstream>
-
-#ifdef WIN64
-#include <concurrent_unordered_map.h>
-#include <ppl.h>
-#else
-#undef _PPL_H
-#endif
+#include <limits>
+#include <type_traits>
 
 using namespace nifly;
 
-OSDataFile::OSDataFile() {
-	header = "OSD\0"_mci;
-	version = 1;
-	dataCount = 0;
-}
-
-OSDataFile::~OSDataFile() {}
-
 #pragma pack(push, 1)
+template<typename FileIndex>
 struct DiffStruct {
-	uint16_t index = 0;
+	FileIndex index = 0;
 	Vector3 diff;
 };
 #pragma pack(pop)
 
-bool OSDataFile::Read(const std::string& fileName) {
-	std::fstream file;
-	PlatformUtil::OpenFileStream(file, fileName, std::ios::in | std::ios::binary);
+namespace {
+// Table of contents entry of a version 3 file
+struct OSDBlockInfo {
+	std::string name;
+	uint64_t offset = 0;
+	uint32_t storedSize = 0; // Size in the file
+	uint32_t rawSize = 0;	 // Uncompressed size
+	uint32_t count = 0;
+	uint8_t compression = 0; // 0 = none, 1 = LZ4
+};
 
-	if (!file)
-		return false;
+// Location of a set within the file contents
+struct OSDSetLocation {
+	std::string name;
+	const char* data = nullptr;
+	uint32_t count = 0;
+	uint32_t storedSize = 0;
+	uint32_t rawSize = 0;	 // Version 3 only
+	uint8_t compression = 0; // Version 3 only
+};
+
+// Reads from a buffer, reading past the end sets the fail state and returns empty values
+class DataReader {
+	const char* data;
+	size_t size;
+	size_t pos = 0;
+	bool failed = false;
+
+	bool Check(size_t bytes) {
+		if (failed || size - pos < bytes)
+			failed = true;
+
+		return !failed;
+	}
+
+public:
+	DataReader(const char* inData, size_t inSize)
+		: data(inData)
+		, size(inSize) {}
+
+	bool fail() const { return failed; }
+
+	template<typename T>
+	void Read(T& value) {
+		if (!Check(sizeof(T))) {
+			value = T();
+			return;
+		}
+
+		std::memcpy(&value, data + pos, sizeof(T));
+		pos += sizeof(T);
+	}
+
+	void Read(std::string& str, size_t length) {
+		if (!Check(length)) {
+			str.clear();
+			return;
+		}
+
+		str.assign(data + pos, length);
+		pos += length;
+	}
 
-	file.read((char*)&header, 4);
-	if (header != "OSD\0"_mci)
+	// Returns a pointer to the next bytes and skips them, null if there aren't enough
+	const char* Skip(size_t bytes) {
+		if (!Check(bytes))
+			return nullptr;
+
+		const char* skipped = data + pos;
+		pos += bytes;
+		return skipped;
+	}
+
+	void Seek(size_t newPos) {
+		if (newPos > size)
+			failed = true;
+		else
+			pos = newPos;
+	}
+};
+
+bool IsWantedSet(const std::string& dataName, const std::vector<std::string>* dataNames) {
+	return !dataNames || std::find(dataNames->begin(), dataNames->end(), dataName) != dataNames->end();
+}
+
+constexpr size_t BlockDiffSize = sizeof(uint32_t) + sizeof(float) * 3;
+
+// Finds the requested sets in the contents of an .osd file, all sets if dataNames is null.
+// Only the header and the names are read, returns false if the file is invalid.
+bool FindOSDSets(const char* data, size_t size, const std::vector<std::string>* dataNames, uint32_t& outVersion, std::vector<OSDSetLocation>& outSets) {
+	DataReader reader(data, size);
+
+	uint32_t header = 0;
+	uint32_t dataCount = 0;
+	reader.Read(header);
+	reader.Read(outVersion);
+	reader.Read(dataCount);
+
+	if (reader.fail() || header != "OSD\0"_mci || outVersion < 1 || outVersion > 3)
 		return false;
 
-	file.read((char*)&version, 4);
-	file.read((char*)&dataCount, 4);
-	dataDiffs.reserve(dataCount);
+	outSets.reserve(dataNames ? dataNames->size() : dataCount);
+
+	if (outVersion == 3) {
+		if (size < sizeof(uint64_t))
+			return false;
+
+		uint64_t tocOffset = 0;
+		reader.Seek(size - sizeof(uint64_t));
+		reader.Read(tocOffset);
+		if (tocOffset > size)
+			return false;
+
+		reader.Seek(static_cast<size_t>(tocOffset));
+
+		for (uint32_t i = 0; i < dataCount; ++i) {
+			OSDBlockInfo block;
+			uint8_t nameLength = 0;
+			reader.Read(nameLength);
+			reader.Read(block.name, nameLength);
+			reader.Read(block.offset);
+			reader.Read(block.storedSize);
+			reader.Read(block.rawSize);
+			reader.Read(block.count);
+			reader.Read(block.compression);
+
+			if (reader.fail() || block.offset > size || size - block.offset < block.storedSize)
+				return false;
+
+			if (!IsWantedSet(block.name, dataNames))
+				continue;
+
+			OSDSetLocation set;
+			set.name = std::move(block.name);
+			set.data = data + block.offset;
+			set.count = block.count;
+			set.storedSize = block.storedSize;
+			set.rawSize = block.rawSize;
+			set.compression = block.compression;
+			outSets.push_back(std::move(set));
+		}
+
+		// Read in file order
+		std::sort(outSets.begin(), outSets.end(), [](const OSDSetLocation& a, const OSDSetLocation& b) { return a.data < b.data; });
+		return true;
+	}
+
+	const size_t diffStructSize = outVersion == 1 ? sizeof(DiffStruct<uint16_t>) : sizeof(DiffStruct<uint32_t>);
 
-	uint8_t nameLength;
 	std::string dataName;
-	uint16_t diffSize;
 	for (uint32_t i = 0; i < dataCount; ++i) {
-		file.read((char*)&nameLength, 1);
-		dataName.resize(nameLength, ' ');
-		file.read((char*)&dataName.front(), nameLength);
+		uint8_t nameLength = 0;
+		reader.Read(nameLength);
+		reader.Read(dataName, nameLength);
+
+		uint32_t diffSize = 0;
+		if (outVersion == 1) {
+			uint16_t diffSize16 = 0;
+			reader.Read(diffSize16);
+			diffSize = diffSize16;
+		}
+		else
+			reader.Read(diffSize);
+
+		// Sets that weren't requested are skipped without reading them
+		const char* diffData = reader.Skip(diffSize * diffStructSize);
+		if (reader.fail())
+			return false;
+
+		if (!IsWantedSet(dataName, dataNames))
+			continue;
+
+		OSDSetLocation set;
+		set.name = dataName;
+		set.data = diffData;
+		set.count = diffSize;
+		set.storedSize = static_cast<uint32_t>(diffSize * diffStructSize);
+		outSets.push_back(std::move(set));
+
+		if (dataNames && outSets.size() == dataNames->size())
+			break;
+	}
+
+	return true;
+}
+
+// Returns the uncompressed data of a version 3 block, decompressing it into buffer if necessary. Returns null if the block is invalid.
+const char* GetBlockData(const OSDSetLocation& set, std::vector<char>& buffer) {
+	if (set.rawSize != static_cast<uint64_t>(set.count) * BlockDiffSize)
+		return nullptr;
+
+	if (set.compression == 0)
+		return set.storedSize == set.rawSize ? set.data : nullptr;
+
+	if (set.compression != 1)
+		return nullptr;
+
+	// LZ4 expands data by at most 255 times, larger sizes come from damaged files and mustn't be allocated
+	if (static_cast<uint64_t>(set.rawSize) > static_cast<uint64_t>(set.storedSize) * 255 || set.rawSize > static_cast<uint32_t>(std::numeric_limits<int>::max()))
+		return nullptr;
+
+	buffer.resize(set.rawSize);
+	int size = LZ4_decompress_safe(set.data, buffer.data(), static_cast<int>(set.storedSize), static_cast<int>(set.rawSize));
+	if (size != static_cast<int>(set.rawSize))
+		return nullptr;
+
+	return buffer.data();
+}
+
+template<typename Index, typename FileIndex>
+void ReadDiffs(const char* data, uint32_t diffSize, std::unordered_map<Index, Vector3>& diffs, uint32_t& droppedCount) {
+	diffs.reserve(diffSize);
+
+	DiffStruct<FileIndex> diffEntry;
+	for (uint32_t i = 0; i < diffSize; i++) {
+		std::memcpy(&diffEntry, data + i * sizeof(DiffStruct<FileIndex>), sizeof(DiffStruct<FileIndex>));
+
+		if constexpr (sizeof(FileIndex) > sizeof(Index)) {
+			if (diffEntry.index > std::numeric_limits<Index>::max()) {
+				droppedCount++;
+				continue;
+			}
+		}
+
+		diffEntry.diff.clampEpsilon();
+		diffs.emplace(static_cast<Index>(diffEntry.index), diffEntry.diff);
+	}
+}
 
-		std::unordered_map<uint16_t, Vector3> diffs;
-		file.read((char*)&diffSize, 2);
-		diffs.reserve(diffSize);
+template<typename Index, typename FileIndex>
+void WriteDiffs(std::fstream& file, const std::unordered_map<Index, Vector3>& diffs) {
+	FileIndex diffSize = static_cast<FileIndex>(diffs.size());
 
-		std::vector<DiffStruct> diffData(diffSize);
-		file.read((char*)diffData.data(), diffSize * sizeof(DiffStruct));
+	std::vector<DiffStruct<FileIndex>> diffData(diffSize);
 
-		for (int j = 0; j < diffSize; ++j) {
-			auto& diffEntry = diffData[j];
-			diffEntry.diff.clampEpsilon();
-			diffs.emplace(diffEntry.index, std::move(diffEntry.diff));
+	size_t i = 0;
+	for (auto& diff : diffs) {
+		diffData[i].index = static_cast<FileIndex>(diff.first);
+		diffData[i].diff = diff.second;
+		++i;
+	}
+
+	file.write((char*)&diffSize, sizeof(FileIndex));
+	file.write((char*)diffData.data(), diffSize * sizeof(DiffStruct<FileIndex>));
+}
+
+// Version 3 block: sorted 32-bit indices followed by the x, y and z arrays
+template<typename Index>
+void PackBlock(const std::unordered_map<Index, Vector3>& diffs, std::vector<char>& outBlock) {
+	std::vector<uint32_t> indices;
+	indices.reserve(diffs.size());
+	for (auto& diff : diffs)
+		indices.push_back(diff.first);
+
+	std::sort(indices.begin(), indices.end());
+
+	const size_t count = indices.size();
+	outBlock.resize(count * BlockDiffSize);
+
+	char* out = outBlock.data();
+	std::memcpy(out, indices.data(), count * sizeof(uint32_t));
+
+	float* x = reinterpret_cast<float*>(out + count * sizeof(uint32_t));
+	float* y = x + count;
+	float* z = y + count;
+	for (size_t i = 0; i < count; i++) {
+		// Stored clamped, as uncompressed blocks may be used without reading them
+		Vector3 v = diffs.at(static_cast<Index>(indices[i]));
+		v.clampEpsilon();
+		std::memcpy(x + i, &v.x, sizeof(float));
+		std::memcpy(y + i, &v.y, sizeof(float));
+		std::memcpy(z + i, &v.z, sizeof(float));
+	}
+}
+
+template<typename Index>
+void UnpackBlock(const char* block, uint32_t count, std::unordered_map<Index, Vector3>& diffs, uint32_t& droppedCount) {
+	const char* x = block + count * sizeof(uint32_t);
+	const char* y = x + count * sizeof(float);
+	const char* z = y + count * sizeof(float);
+
+	diffs.reserve(count);
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t index;
+		Vector3 v;
+		std::memcpy(&index, block + i * sizeof(uint32_t), sizeof(uint32_t));
+		std::memcpy(&v.x, x + i * sizeof(float), sizeof(float));
+		std::memcpy(&v.y, y + i * sizeof(float), sizeof(float));
+		std::memcpy(&v.z, z + i * sizeof(float), sizeof(float));
+
+		if constexpr (sizeof(Index) < sizeof(uint32_t)) {
+			if (index > std::numeric_limits<Index>::max()) {
+				droppedCount++;
+				continue;
+			}
 		}
 
-		dataDiffs.emplace(dataName, std::move(diffs));
+		v.clampEpsilon();
+		diffs.emplace(static_cast<Index>(index), v);
+	}
+}
+
+// Reads a set found by FindOSDSets, returns false if it's invalid
+template<typename Index>
+bool ReadOSDSet(uint32_t version, const OSDSetLocation& set, std::unordered_map<Index, Vector3>& diffs, uint32_t& droppedCount, std::vector<char>& buffer) {
+	if (version == 1)
+		ReadDiffs<Index, uint16_t>(set.data, set.count, diffs, droppedCount);
+	else if (version == 2)
+		ReadDiffs<Index, uint32_t>(set.data, set.count, diffs, droppedCount);
+	else {
+		const char* data = GetBlockData(set, buffer);
+		if (!data)
+			return false;
+
+		UnpackBlock(data, set.count, diffs, droppedCount);
 	}
 
 	return true;
 }
 
-bool OSDataFile::Write(const std::string& fileName) {
+// View of a version 3 block that can be used without copying: 4-byte aligned, with unique indices in ascending order
+bool GetBlockView(const char* block, uint32_t count, PackedDiffView<uint32_t>& outView) {
+	if (reinterpret_cast<uintptr_t>(block) % alignof(uint32_t) != 0)
+		return false;
+
+	const uint32_t* indices = reinterpret_cast<const uint32_t*>(block);
+	for (uint32_t i = 1; i < count; i++)
+		if (indices[i] <= indices[i - 1])
+			return false;
+
+	const float* x = reinterpret_cast<const float*>(block + count * sizeof(uint32_t));
+	outView.indices = indices;
+	outView.x = x;
+	outView.y = x + count;
+	outView.z = x + count * 2;
+	outView.count = count;
+	return true;
+}
+} // namespace
+
+template<typename Index>
+BasicOSDataFile<Index>::BasicOSDataFile() {
+	header = "OSD\0"_mci;
+	version = 1;
+	dataCount = 0;
+}
+
+template<typename Index>
+BasicOSDataFile<Index>::~BasicOSDataFile() {}
+
+template<typename Index>
+bool BasicOSDataFile<Index>::Read(const std::string& fileName) {
+	return ReadSets(fileName, nullptr);
+}
+
+template<typename Index>
+bool BasicOSDataFile<Index>::Read(const std::string& fileName, const std::vector<std::string>& dataNames) {
+	return ReadSets(fileName, &dataNames);
+}
+
+template<typename Index>
+bool BasicOSDataFile<Index>::ReadSets(const std::string& fileName, const std::vector<std::string>* dataNames) {
+	MappedFile file;
+	if (!file.Open(fileName))
+		return false;
+
+	std::vector<OSDSetLocation> sets;
+	if (!FindOSDSets(file.GetData(), file.GetSize(), dataNames, version, sets))
+		return false;
+
+	droppedCount = 0;
+
+	dataDiffs.reserve(sets.size());
+
+	std::vector<char> buffer;
+	for (auto& set : sets) {
+		std::unordered_map<Index, Vector3> diffs;
+		if (!ReadOSDSet(version, set, diffs, droppedCount, buffer))
+			return false;
+
+		dataDiffs.emplace(set.name, std::move(diffs));
+	}
+
+	// Only the requested sets were read, the header count of the file would no longer match them
+	dataCount = static_cast<uint32_t>(dataDiffs.size());
+	return true;
+}
+
+template<typename Index>
+bool BasicOSDataFile<Index>::Write(const std::string& fileName, bool indexed) {
 	std::fstream file;
 	PlatformUtil::OpenFileStream(file, fileName, std::ios::out | std::ios::binary);
 
 	if (!file)
 		return false;
 
+	if (indexed)
+		return WriteIndexed(file);
+
+	// Version 2 is only needed for indices or diff counts that don't fit into 16 bits
+	version = 1;
+	for (auto& diffs : dataDiffs) {
+		if (diffs.second.size() > UINT16_MAX)
+			version = 2;
+
+		if constexpr (sizeof(Index) > sizeof(uint16_t)) {
+			for (auto& diff : diffs.second)
+				if (diff.first > UINT16_MAX)
+					version = 2;
+		}
+	}
+
+	dataCount = static_cast<uint32_t>(dataDiffs.size());
+
 	file.write((char*)&header, 4);
 	file.write((char*)&version, 4);
 	file.write((char*)&dataCount, 4);
 
 	uint8_t nameLength;
-	uint16_t diffSize;
 	for (auto& diffs : dataDiffs) {
 		nameLength = static_cast<uint8_t>(diffs.first.length());
 		file.write((char*)&nameLength, 1);
 		file.write(diffs.first.c_str(), nameLength);
 
-		diffSize = static_cast<uint16_t>(diffs.second.size());
+		if (version == 1)
+			WriteDiffs<Index, uint16_t>(file, diffs.second);
+		else
+			WriteDiffs<Index, uint32_t>(file, diffs.second);
+	}
 
-		std::vector<DiffStruct> diffData(diffSize);
-		diffData.resize(diffSize);
+	return true;
+}
 
-		size_t i = 0;
+template<typename Index>
+bool BasicOSDataFile<Index>::WriteIndexed(std::fstream& file) {
+	version = 3;
+	dataCount = static_cast<uint32_t>(dataDiffs.size());
 
-		for (auto& diff : diffs.second) {
-			if (i >= diffSize)
-				break;
+	file.write((char*)&header, 4);
+	file.write((char*)&version, 4);
+	file.write((char*)&dataCount, 4);
+
+	std::vector<OSDBlockInfo> blocks;
+	blocks.reserve(dataDiffs.size());
 
-			diffData[i].index = diff.first;
-			diffData[i].diff = diff.second;
-			++i;
+	const char padding[alignof(uint32_t)] = {};
+	std::vector<char> raw;
+	std::vector<char> compressed;
+	for (auto& diffs : dataDiffs) {
+		// Blocks start 4-byte aligned, so uncompressed ones can be used directly from a memory-mapped file
+		uint64_t offset = static_cast<uint64_t>(file.tellp());
+		if (offset % alignof(uint32_t) != 0) {
+			size_t padSize = alignof(uint32_t) - offset % alignof(uint32_t);
+			file.write(padding, padSize);
+			offset += padSize;
 		}
 
-		file.write((char*)&diffSize, 2);
-		file.write((char*)diffData.data(), diffSize * sizeof(DiffStruct));
+		OSDBlockInfo block;
+		block.name = diffs.first.substr(0, UINT8_MAX);
+		block.offset = offset;
+		block.count = static_cast<uint32_t>(diffs.second.size());
+
+		PackBlock(diffs.second, raw);
+		block.rawSize = static_cast<uint32_t>(raw.size());
+
+		// Blocks are only stored compressed if that makes them smaller
+		compressed.resize(LZ4_compressBound(static_cast<int>(raw.size())));
+		int compressedSize = LZ4_compress_default(raw.data(), compressed.data(), static_cast<int>(raw.size()), static_cast<int>(compressed.size()));
+		if (compressedSize > 0 && static_cast<uint32_t>(compressedSize) < block.rawSize) {
+			block.compression = 1;
+			block.storedSize = static_cast<uint32_t>(compressedSize);
+			file.write(compressed.data(), compressedSize);
+		}
+		else {
+			block.storedSize = block.rawSize;
+			file.write(raw.data(), raw.size());
+		}
+
+		blocks.push_back(std::move(block));
 	}
 
-	return true;
+	uint64_t tocOffset = static_cast<uint64_t>(file.tellp());
+	for (auto& block : blocks) {
+		uint8_t nameLength = static_cast<uint8_t>(block.name.length());
+		file.write((char*)&nameLength, 1);
+		file.write(block.name.c_str(), nameLength);
+		file.write((char*)&block.offset, sizeof(uint64_t));
+		file.write((char*)&block.storedSize, 4);
+		file.write((char*)&block.rawSize, 4);
+		file.write((char*)&block.count, 4);
+		file.write((char*)&block.compression, 1);
+	}
+
+	file.write((char*)&tocOffset, sizeof(uint64_t));
+	return !file.fail();
 }
 
-std::unordered_map<std::string, std::unordered_map<uint16_t, Vector3>> OSDataFile::GetDataDiffs() {
+template<typename Index>
+std::unordered_map<std::string, std::unordered_map<Index, Vector3>> BasicOSDataFile<Index>::GetDataDiffs() {
 	return dataDiffs;
 }
 
-std::unordered_map<uint16_t, Vector3>* OSDataFile::GetDataDiff(const std::string& dataName) {
+template<typename Index>
+std::unordered_map<Index, Vector3>* BasicOSDataFile<Index>::GetDataDiff(const std::string& dataName) {
 	auto it = dataDiffs.find(dataName);
 	if (it != dataDiffs.end())
 		return &it->second;
@@ -130,84 +544,383 @@ std::unordered_map<uint16_t, Vector3>* OSDataFile::GetDataDiff(const std::string
 	return nullptr;
 }
 
-void OSDataFile::SetDataDiff(const std::string& dataName, std::unordered_map<uint16_t, Vector3>& inDataDiff) {
+template<typename Index>
+void BasicOSDataFile<Index>::SetDataDiff(const std::string& dataName, const std::unordered_map<Index, Vector3>& inDataDiff) {
 	dataDiffs[dataName] = inDataDiff;
 	dataCount++;
 }
 
+template class BasicOSDataFile<uint16_t>;
+template class BasicOSDataFile<uint32_t>;
+
+template<typename Index>
+bool ReadBSDFile(const std::string& fileName, std::unordered_map<Index, Vector3>& outDiffs) {
+	MappedFile file;
+	if (!file.Open(fileName))
+		return false;
+
+	DataReader reader(file.GetData(), file.GetSize());
+
+	uint32_t sz = 0;
+	reader.Read(sz);
+
+	outDiffs.clear();
+	outDiffs.reserve(sz);
+
+	uint32_t idx;
+	Vector3 v;
+	for (uint32_t i = 0; i < sz; i++) {
+		reader.Read(idx);
+		reader.Read(v);
+		if (reader.fail())
+			break;
+
+		if constexpr (sizeof(Index) < sizeof(uint32_t)) {
+			if (idx > std::numeric_limits<Index>::max())
+				continue;
+		}
+
+		v.clampEpsilon();
+		outDiffs.emplace(static_cast<Index>(idx), v);
+	}
+
+	return true;
+}
+
+template bool ReadBSDFile(const std::string& fileName, std::unordered_map<uint16_t, Vector3>& outDiffs);
+template bool ReadBSDFile(const std::string& fileName, std::unordered_map<uint32_t, Vector3>& outDiffs);
+
+bool ReadSharedOSDSets(const std::string& fileName, const std::vector<std::string>& dataNames, std::map<std::string, SharedDiffSet>& outSets, bool keepMapped, bool halfPrecision) {
+	auto file = std::make_shared<MappedFile>();
+	if (!file->Open(fileName))
+		return false;
+
+	uint32_t version = 0;
+	std::vector<OSDSetLocation> sets;
+	if (!FindOSDSets(file->GetData(), file->GetSize(), &dataNames, version, sets))
+		return false;
+
+	for (auto& set : sets) {
+		if (version == 3) {
+			PackedDiffView<uint32_t> view;
+
+			// Uncompressed blocks are used in place for as long as the data is referenced
+			if (keepMapped && set.compression == 0 && set.storedSize == set.count * BlockDiffSize && set.rawSize == set.storedSize
+				&& GetBlockView(set.data, set.count, view)) {
+				outSets[set.name] = std::make_shared<const SharedDiffData>(file, view);
+				continue;
+			}
+
+			// Compressed blocks are used in their decompressed buffer unless packed in half precision
+			if (set.compression == 1 && !halfPrecision) {
+				auto buffer = std::make_shared<std::vector<char>>();
+				const char* data = GetBlockData(set, *buffer);
+				if (data && GetBlockView(data, set.count, view)) {
+					outSets[set.name] = std::make_shared<const SharedDiffData>(buffer, view);
+					continue;
+				}
+			}
+		}
+
+		std::unordered_map<uint32_t, Vector3> diffs;
+		std::vector<char> buffer;
+		uint32_t droppedCount = 0;
+		if (!ReadOSDSet(version, set, diffs, droppedCount, buffer))
+			return false;
+
+		outSets[set.name] = std::make_shared<const SharedDiffData>(diffs, halfPrecision);
+	}
+
+	return true;
+}
+
+uint64_t NextDiffDataVersion() {
+	static std::atomic<uint64_t> nextVersion{1};
+	return nextVersion++;
+}
+
+namespace {
+// Largest difference between packed diffs and their original values, infinite if any isn't finite
+template<typename PackedSet, typename MapIndex>
+float GetPackingError(const PackedSet& packed, const std::unordered_map<MapIndex, Vector3>& diff) {
+	float maxError = 0.0f;
+	auto& indices = packed.GetIndices();
+	for (size_t i = 0; i < indices.size(); i++) {
+		const Vector3 stored = packed.GetDiff(i);
+		const Vector3& original = diff.at(static_cast<MapIndex>(indices[i]));
+		const float error = std::max({std::fabs(stored.x - original.x), std::fabs(stored.y - original.y), std::fabs(stored.z - original.z)});
+		if (!std::isfinite(error))
+			return std::numeric_limits<float>::infinity();
+
+		maxError = std::max(maxError, error);
+	}
+
+	return maxError;
+}
+} // namespace
+
+SharedDiffData::SharedDiffData(const std::unordered_map<uint16_t, Vector3>& diff, bool halfPrecision) {
+	Pack(diff, halfPrecision);
+}
+
+SharedDiffData::SharedDiffData(const std::unordered_map<uint32_t, Vector3>& diff, bool halfPrecision) {
+	Pack(diff, halfPrecision);
+}
+
+SharedDiffData::SharedDiffData(const std::shared_ptr<const void>& storage, const PackedDiffView<uint32_t>& view)
+	: storage(storage)
+	, viewWide(view)
+	, wide(true) {}
+
+template<typename MapIndex>
+void SharedDiffData::Pack(const std::unordered_map<MapIndex, Vector3>& diff, bool halfPrecision) {
+	if constexpr (sizeof(MapIndex) > sizeof(uint16_t)) {
+		for (auto& d : diff) {
+			if (d.first > UINT16_MAX) {
+				wide = true;
+				break;
+			}
+		}
+	}
+
+	if (halfPrecision) {
+		float error = 0.0f;
+		if (wide) {
+			packedHalfWide = PackedHalfDiffSet32(diff);
+			error = GetPackingError(packedHalfWide, diff);
+		}
+		else {
+			packedHalf = PackedHalfDiffSet(diff);
+			error = GetPackingError(packedHalf, diff);
+		}
+
+		if (error <= HalfPrecisionMaxError) {
+			half = true;
+			halfError = error;
+			viewHalfWide = packedHalfWide.View();
+			viewHalf = packedHalf.View();
+			return;
+		}
+
+		// Kept in single precision
+		packedHalfWide = PackedHalfDiffSet32();
+		packedHalf = PackedHalfDiffSet();
+	}
+
+	if (wide) {
+		packedWide = PackedDiffSet32(diff);
+		viewWide = packedWide.View();
+	}
+	else {
+		packed = PackedDiffSet(diff);
+		view = packed.View();
+	}
+}
+
+size_t SharedDiffData::GetMemorySize() const {
+	if (storage)
+		return viewWide.count * (sizeof(uint32_t) + sizeof(float) * 3);
+
+	if (half)
+		return wide ? packedHalfWide.GetMemorySize() : packedHalf.GetMemorySize();
+
+	return wide ? packedWide.GetMemorySize() : packed.GetMemorySize();
+}
+
+uint64_t SharedDiffData::GetContentHash() const {
+	uint64_t hash = (half ? 2 : 0) | (wide ? 1 : 0);
+	Visit([&](auto& v) {
+		hash = XXH64(v.indices, v.count * sizeof(*v.indices), hash);
+		hash = XXH64(v.x, v.count * sizeof(*v.x), hash);
+		hash = XXH64(v.y, v.count * sizeof(*v.y), hash);
+		hash = XXH64(v.z, v.count * sizeof(*v.z), hash);
+	});
+	return hash;
+}
+
+bool SharedDiffData::HasSameContent(const SharedDiffData& other) const {
+	if (half != other.half || wide != other.wide)
+		return false;
+
+	bool same = false;
+	Visit([&](auto& v) {
+		other.Visit([&](auto& o) {
+			if constexpr (std::is_same_v<decltype(v), decltype(o)>) {
+				if (v.count != o.count)
+					return;
+
+				same = v.count == 0
+					   || (std::memcmp(v.indices, o.indices, v.count * sizeof(*v.indices)) == 0 && std::memcmp(v.x, o.x, v.count * sizeof(*v.x)) == 0
+						   && std::memcmp(v.y, o.y, v.count * sizeof(*v.y)) == 0 && std::memcmp(v.z, o.z, v.count * sizeof(*v.z)) == 0);
+			}
+		});
+	});
+	return same;
+}
+
+std::unordered_map<uint16_t, Vector3> SharedDiffData::ToMap() const {
+	std::unordered_map<uint16_t, Vector3> diff;
+
+	Visit([&](auto& v) {
+		const size_t count = v.CountBelow(static_cast<size_t>(UINT16_MAX) + 1);
+		diff.reserve(count);
+		for (size_t i = 0; i < count; i++)
+			diff.emplace(static_cast<uint16_t>(v.indices[i]), v.GetDiff(i));
+	});
+
+	return diff;
+}
+
+const std::unordered_map<uint16_t, Vector3>& DiffDataSets::GetSet(const std::string& name) const {
+	static const std::unordered_map<uint16_t, Vector3> emptySet;
+
+	auto it = namedSet.find(name);
+	if (it != namedSet.end())
+		return it->second;
+
+	auto shared = sharedSet.find(name);
+	if (shared != sharedSet.end())
+		return shared->second->Map();
+
+	return emptySet;
+}
+
+std::unordered_map<uint16_t, Vector3>& DiffDataSets::OwnSet(const std::string& name) {
+	auto shared = sharedSet.find(name);
+	if (shared != sharedSet.end()) {
+		namedSet[name] = shared->second->ToMap();
+		precisionLoss = std::max(precisionLoss, shared->second->GetHalfError());
+		sharedSet.erase(shared);
+		SetsChanged();
+	}
+
+	auto it = namedSet.find(name);
+	if (it == namedSet.end()) {
+		it = namedSet.emplace(name, std::unordered_map<uint16_t, Vector3>()).first;
+		SetsChanged();
+	}
+
+	// The caller may modify the data
+	version = NextDiffDataVersion();
+	return it->second;
+}
+
+void DiffDataSets::OwnTargetSets(const std::string& target) {
+	std::vector<std::string> names;
+	for (auto& shared : sharedSet)
+		if (TargetMatch(shared.first, target))
+			names.push_back(shared.first);
+
+	for (auto& name : names)
+		OwnSet(name);
+}
 
 void DiffDataSets::MoveToSet(const std::string& name, const std::string& target, std::unordered_map<uint16_t, Vector3>& inDiffData) {
+	sharedSet.erase(name);
 	namedSet[name] = std::move(inDiffData);
 	dataTargets[name] = target;
+	SetsChanged();
 }
 
 void DiffDataSets::LoadSet(const std::string& name, const std::string& target, const std::unordered_map<uint16_t, Vector3>& inDiffData) {
+	sharedSet.erase(name);
 	namedSet[name] = inDiffData;
 	dataTargets[name] = target;
+	SetsChanged();
 }
 
-int DiffDataSets::LoadSet(const std::string& name, const std::string& target, const std::string& fromFile) {
-	std::fstream inFile;
-	PlatformUtil::OpenFileStream(inFile, fromFile, std::ios::in | std::ios::binary);
-
-	if (!inFile)
-		return 1;
-
-	uint32_t sz;
-	inFile.read((char*)&sz, 4);
+void DiffDataSets::ShareSet(const std::string& name, const std::string& target, const SharedDiffSet& inDiffData) {
+	namedSet.erase(name);
+	sharedSet[name] = inDiffData;
+	dataTargets[name] = target;
+	SetsChanged();
+}
 
+int DiffDataSets::LoadSet(const std::string& name, const std::string& target, const std::string& fromFile) {
 	std::unordered_map<uint16_t, Vector3> data;
-	data.reserve(sz);
-
-	uint32_t idx;
-	Vector3 v;
-	for (uint32_t i = 0; i < sz; i++) {
-		inFile.read((char*)&idx, sizeof(uint32_t));
-		inFile.read((char*)&v, sizeof(Vector3));
-		v.clampEpsilon();
-		data.emplace(static_cast<uint16_t>(idx), v);
-	}
+	if (!ReadBSDFile(fromFile, data))
+		return 1;
 
-	inFile.close();
+	ShareSet(name, target, DiffDataCache::Get().Share(std::make_shared<const SharedDiffData>(data, halfPrecision)));
+	return 0;
+}
 
-	namedSet[name] = std::move(data);
-	dataTargets[name] = target;
+int DiffDataSets::LoadSharedSet(const std::string& name, const std::string& target, const std::string& fromFile) {
+	SharedDiffSet data = DiffDataCache::Get().GetBSDSet(fromFile);
+	if (!data)
+		return 1;
 
+	ShareSet(name, target, data);
 	return 0;
 }
 
 bool DiffDataSets::LoadData(const std::map<std::string, std::map<std::string, std::string>>& osdNames) {
-#ifdef _PPL_H
-	Concurrency::concurrent_unordered_map<std::string, OSDataFile> loaded;
-	Concurrency::parallel_for_each(osdNames.begin(), osdNames.end(), [&](auto& osd) {
+	std::vector<const std::pair<const std::string, std::map<std::string, std::string>>*> osdList;
+	osdList.reserve(osdNames.size());
+	for (auto& osd : osdNames)
+		osdList.push_back(&osd);
+
+	// Read and pack files in parallel, then add the sets in order.
+	// Sets with the same content as already loaded ones share their data, modifying one copies it first.
+	std::vector<std::map<std::string, SharedDiffSet>> osdSets(osdList.size());
+	ThreadPool::Get().ParallelFor(osdList.size(), [&](size_t i) {
+		std::vector<std::string> dataNames;
+		for (auto& dataName : osdList[i]->second)
+			dataNames.push_back(dataName.first);
+
 		OSDataFile osdFile;
-		if (!osdFile.Read(osd.first))
+		if (!osdFile.Read(osdList[i]->first, dataNames))
 			return;
-		loaded[osd.first] = std::move(osdFile);
+
+		for (auto& diff : osdFile.GetDataDiffsRef())
+			osdSets[i][diff.first] = DiffDataCache::Get().Share(std::make_shared<const SharedDiffData>(diff.second, halfPrecision));
 	});
-#endif
-	for (auto& osd : osdNames) {
-#ifdef _PPL_H
-		auto kvp = loaded.find(osd.first);
-		if (kvp == loaded.end())
-			continue;
-		auto& osdFile = kvp->second;
-#else
-		OSDataFile osdFile;
-		if (!osdFile.Read(osd.first))
-			continue;
-#endif
-		for (auto& dataNames : osd.second) {
-			auto diff = osdFile.GetDataDiff(dataNames.first);
-			if (diff)
-				MoveToSet(dataNames.first, dataNames.second, *diff);
+
+	for (size_t i = 0; i < osdList.size(); i++) {
+		for (auto& dataNames : osdList[i]->second) {
+			auto diff = osdSets[i].find(dataNames.first);
+			if (diff != osdSets[i].end())
+				ShareSet(dataNames.first, dataNames.second, diff->second);
 		}
 	}
 	return true;
 }
 
+bool DiffDataSets::LoadSharedData(const std::map<std::string, std::map<std::string, std::string>>& osdNames) {
+	std::vector<const std::pair<const std::string, std::map<std::string, std::string>>*> osdList;
+	osdList.reserve(osdNames.size());
+	for (auto& osd : osdNames)
+		osdList.push_back(&osd);
+
+	std::vector<std::map<std::string, SharedDiffSet>> osdSets(osdList.size());
+	ThreadPool::Get().ParallelFor(osdList.size(), [&](size_t i) {
+		std::vector<std::string> dataNames;
+		for (auto& dataName : osdList[i]->second)
+			dataNames.push_back(dataName.first);
+
+		DiffDataCache::Get().GetOSDSets(osdList[i]->first, dataNames, osdSets[i]);
+	});
+
+	for (size_t i = 0; i < osdList.size(); i++) {
+		for (auto& dataNames : osdList[i]->second) {
+			auto diff = osdSets[i].find(dataNames.first);
+			if (diff != osdSets[i].end())
+				ShareSet(dataNames.first, dataNames.second, diff->second);
+		}
+	}
+	return true;
+}
+
+float DiffDataSets::GetPrecisionLoss() const {
+	float loss = precisionLoss;
+	for (auto& shared : sharedSet)
+		loss = std::max(loss, shared.second->GetHalfError());
+
+	return loss;
+}
+
 int DiffDataSets::SaveSet(const std::string& name, const std::string& target, const std::string& toFile) {
-	std::unordered_map<uint16_t, Vector3>* data = &namedSet[name];
+	const std::unordered_map<uint16_t, Vector3>* data = &GetSet(name);
 	if (!TargetMatch(name, target))
 		return 2;
 
@@ -229,18 +942,17 @@ int DiffDataSets::SaveSet(const std::string& name, const std::string& target, co
 	return 0;
 }
 
-bool DiffDataSets::SaveData(const std::map<std::string, std::map<std::string, std::string>>& osdNames) {
+bool DiffDataSets::SaveData(const std::map<std::string, std::map<std::string, std::string>>& osdNames, bool indexed) {
 	for (auto& osd : osdNames) {
 		OSDataFile osdFile;
 		for (auto& dataNames : osd.second) {
-			auto& data = namedSet[dataNames.first];
 			if (!TargetMatch(dataNames.first, dataNames.second))
 				continue;
 
-			osdFile.SetDataDiff(dataNames.first, data);
+			osdFile.SetDataDiff(dataNames.first, GetSet(dataNames.first));
 		}
 
-		if (!osdFile.Write(osd.first))
+		if (!osdFile.Write(osd.first, indexed))
 			return false;
 	}
 
@@ -248,12 +960,21 @@ bool DiffDataSets::SaveData(const std::map<std::string, std::map<std::string, st
 }
 
 void DiffDataSets::RenameSet(const std::string& oldName, const std::string& newName) {
-	if (namedSet.find(oldName) != namedSet.end()) {
+	auto shared = sharedSet.find(oldName);
+	if (shared != sharedSet.end()) {
+		sharedSet.emplace(newName, shared->second);
+		sharedSet.erase(oldName);
+		dataTargets[newName] = dataTargets[oldName];
+		dataTargets.erase(oldName);
+	}
+	else if (namedSet.find(oldName) != namedSet.end()) {
 		namedSet.emplace(newName, namedSet[oldName]);
 		namedSet.erase(oldName);
 		dataTargets[newName] = dataTargets[oldName];
 		dataTargets.erase(oldName);
 	}
+
+	SetsChanged();
 }
 
 void DiffDataSets::DeepRename(const std::string& oldName, const std::string& newName) {
@@ -280,7 +1001,13 @@ void DiffDataSets::DeepRename(const std::string& oldName, const std::string& new
 			namedSet[nt] = std::move(namedSet[ot]);
 			namedSet.erase(ot);
 		}
+		if (sharedSet.find(ot) != sharedSet.end()) {
+			sharedSet[nt] = std::move(sharedSet[ot]);
+			sharedSet.erase(ot);
+		}
 	}
+
+	SetsChanged();
 }
 
 void DiffDataSets::DeepCopy(const std::string& srcName, const std::string& destName) {
@@ -304,19 +1031,24 @@ void DiffDataSets::DeepCopy(const std::string& srcName, const std::string& destN
 
 		if (namedSet.find(ot) != namedSet.end())
 			namedSet[nt] = namedSet[ot];
+		else if (sharedSet.find(ot) != sharedSet.end())
+			sharedSet[nt] = sharedSet[ot];
 	}
+
+	SetsChanged();
 }
 
 void DiffDataSets::AddEmptySet(const std::string& name, const std::string& target) {
-	if (namedSet.find(name) == namedSet.end()) {
+	if (namedSet.find(name) == namedSet.end() && sharedSet.find(name) == sharedSet.end()) {
 		std::unordered_map<uint16_t, Vector3> data;
 		namedSet[name] = data;
 		dataTargets[name] = target;
+		SetsChanged();
 	}
 }
 
 void DiffDataSets::UpdateDiff(const std::string& name, const std::string& target, uint16_t index, Vector3& newdiff) {
-	std::unordered_map<uint16_t, Vector3>* data = &namedSet[name];
+	std::unordered_map<uint16_t, Vector3>* data = &OwnSet(name);
 	if (!TargetMatch(name, target))
 		return;
 
@@ -324,7 +1056,7 @@ void DiffDataSets::UpdateDiff(const std::string& name, const std::string& target
 }
 
 void DiffDataSets::SumDiff(const std::string& name, const std::string& target, uint16_t index, Vector3& newdiff) {
-	std::unordered_map<uint16_t, Vector3>* data = &namedSet[name];
+	std::unordered_map<uint16_t, Vector3>* data = &OwnSet(name);
 	if (!TargetMatch(name, target))
 		return;
 
@@ -338,7 +1070,7 @@ void DiffDataSets::SumDiff(const std::string& name, const std::string& target, u
 }
 
 void DiffDataSets::ScaleDiff(const std::string& name, const std::string& target, float scalevalue) {
-	std::unordered_map<uint16_t, Vector3>* data = &namedSet[name];
+	std::unordered_map<uint16_t, Vector3>* data = &OwnSet(name);
 
 	if (!TargetMatch(name, target))
 		return;
@@ -348,7 +1080,7 @@ void DiffDataSets::ScaleDiff(const std::string& name, const std::string& target,
 }
 
 void DiffDataSets::OffsetDiff(const std::string& name, const std::string& target, Vector3& offset) {
-	std::unordered_map<uint16_t, Vector3>* data = &namedSet[name];
+	std::unordered_map<uint16_t, Vector3>* data = &OwnSet(name);
 	if (!TargetMatch(name, target))
 		return;
 
@@ -356,15 +1088,86 @@ void DiffDataSets::OffsetDiff(const std::string& name, const std::string& target
 		resultIt->second += offset;
 }
 
-bool DiffDataSets::ApplyUVDiff(const std::string& set, const std::string& target, float percent, std::vector<Vector2>* inOutResult) {
+std::unordered_map<uint16_t, Vector3>* DiffDataSets::GetDiffSet(const std::string& targetDataName) {
+	if (namedSet.find(targetDataName) == namedSet.end() && sharedSet.find(targetDataName) == sharedSet.end())
+		return nullptr;
+
+	return &OwnSet(targetDataName);
+}
+
+DiffDataSets::SetRef DiffDataSets::FindSet(const std::string& set, const std::string& target) const {
+	SetRef ref;
+	auto dt = dataTargets.find(set);
+	if (dt == dataTargets.end() || dt->second != target)
+		return ref;
+
+	ref.match = true;
+
+	auto it = namedSet.find(set);
+	if (it != namedSet.end()) {
+		ref.owned = &it->second;
+		return ref;
+	}
+
+	auto shared = sharedSet.find(set);
+	if (shared != sharedSet.end())
+		ref.shared = shared->second.get();
+
+	return ref;
+}
+
+const DiffDataSets::SetRef& DiffDataSets::GetHandleSet(DiffHandle handle) {
+	static const SetRef invalidRef;
+	if (handle >= handles.size())
+		return invalidRef;
+
+	HandleEntry& entry = handles[handle];
+	if (entry.generation != generation) {
+		entry.ref = FindSet(entry.set, entry.target);
+		entry.generation = generation;
+	}
+
+	return entry.ref;
+}
+
+DiffHandle DiffDataSets::Resolve(const std::string& set, const std::string& target) {
+	auto key = std::make_pair(set, target);
+	auto it = handleIndex.find(key);
+	if (it != handleIndex.end()) {
+		GetHandleSet(it->second);
+		return it->second;
+	}
+
+	DiffHandle handle = static_cast<DiffHandle>(handles.size());
+
+	HandleEntry entry;
+	entry.set = set;
+	entry.target = target;
+	entry.generation = generation;
+	entry.ref = FindSet(set, target);
+	handles.push_back(std::move(entry));
+
+	handleIndex.emplace(std::move(key), handle);
+	return handle;
+}
+
+bool DiffDataSets::ApplyUVDiff(const SetRef& ref, float percent, std::vector<Vector2>* inOutResult) {
 	if (percent == 0.0f)
 		return false;
 
-	if (!TargetMatch(set, target))
+	if (!ref.match)
 		return false;
 
+	if (ref.shared) {
+		ref.shared->ApplyUV(percent, inOutResult->data(), inOutResult->size());
+		return true;
+	}
+
+	if (!ref.owned)
+		return true;
+
 	uint16_t maxidx = static_cast<uint16_t>(inOutResult->size());
-	std::unordered_map<uint16_t, Vector3>* data = &namedSet[set];
+	const std::unordered_map<uint16_t, Vector3>* data = ref.owned;
 
 	for (auto resultIt = data->begin(); resultIt != data->end(); ++resultIt) {
 		if (resultIt->first >= maxidx)
@@ -377,15 +1180,23 @@ bool DiffDataSets::ApplyUVDiff(const std::string& set, const std::string& target
 	return true;
 }
 
-bool DiffDataSets::ApplyDiff(const std::string& set, const std::string& target, float percent, std::vector<Vector3>* inOutResult) {
+bool DiffDataSets::ApplyDiff(const SetRef& ref, float percent, std::vector<Vector3>* inOutResult) {
 	if (percent == 0.0f)
 		return false;
 
-	if (!TargetMatch(set, target))
+	if (!ref.match)
 		return false;
 
+	if (ref.shared) {
+		ref.shared->Apply(percent, inOutResult->data(), inOutResult->size());
+		return true;
+	}
+
+	if (!ref.owned)
+		return true;
+
 	uint16_t maxidx = static_cast<uint16_t>(inOutResult->size());
-	std::unordered_map<uint16_t, Vector3>* data = &namedSet[set];
+	const std::unordered_map<uint16_t, Vector3>* data = ref.owned;
 
 	for (auto resultIt = data->begin(); resultIt != data->end(); ++resultIt) {
 		if (resultIt->first >= maxidx)
@@ -399,12 +1210,20 @@ bool DiffDataSets::ApplyDiff(const std::string& set, const std::string& target,
 	return true;
 }
 
-bool DiffDataSets::ApplyClamp(const std::string& set, const std::string& target, std::vector<Vector3>* inOutResult) {
-	if (!TargetMatch(set, target))
+bool DiffDataSets::ApplyClamp(const SetRef& ref, std::vector<Vector3>* inOutResult) {
+	if (!ref.match)
 		return false;
 
+	if (ref.shared) {
+		ref.shared->Clamp(inOutResult->data(), inOutResult->size());
+		return true;
+	}
+
+	if (!ref.owned)
+		return true;
+
 	uint16_t maxidx = static_cast<uint16_t>(inOutResult->size());
-	std::unordered_map<uint16_t, Vector3>* data = &namedSet[set];
+	const std::unordered_map<uint16_t, Vector3>* data = ref.owned;
 
 	for (auto resultIt = data->begin(); resultIt != data->end(); ++resultIt) {
 		if (resultIt->first >= maxidx)
@@ -418,57 +1237,410 @@ bool DiffDataSets::ApplyClamp(const std::string& set, const std::string& target,
 	return true;
 }
 
-std::unordered_map<uint16_t, Vector3>* DiffDataSets::GetDiffSet(const std::string& targetDataName) {
-	if (namedSet.find(targetDataName) == namedSet.end())
-		return nullptr;
+void DiffDataSets::GetDiffIndices(const SetRef& ref, std::vector<uint16_t>& outIndices, float threshold) {
+	if (!ref.match)
+		return;
+
+	if (ref.shared) {
+		ref.shared->GetIndices(outIndices, threshold);
+	}
+	else if (ref.owned) {
+		const std::unordered_map<uint16_t, Vector3>* data = ref.owned;
+		for (auto resultIt = data->begin(); resultIt != data->end(); ++resultIt) {
+			if (fabs(resultIt->second.x) > threshold || fabs(resultIt->second.y) > threshold || fabs(resultIt->second.z) > threshold) {
+				outIndices.push_back(resultIt->first);
+			}
+		}
+	}
+
+	std::sort(outIndices.begin(), outIndices.end());
+	outIndices.erase(std::unique(outIndices.begin(), outIndices.end()), outIndices.end());
+}
+
+bool DiffDataSets::ApplyUVDiff(const std::string& set, const std::string& target, float percent, std::vector<Vector2>* inOutResult) {
+	return ApplyUVDiff(FindSet(set, target), percent, inOutResult);
+}
 
-	return &namedSet[targetDataName];
+bool DiffDataSets::ApplyDiff(const std::string& set, const std::string& target, float percent, std::vector<Vector3>* inOutResult) {
+	return ApplyDiff(FindSet(set, target), percent, inOutResult);
+}
+
+bool DiffDataSets::ApplyClamp(const std::string& set, const std::string& target, std::vector<Vector3>* inOutResult) {
+	return ApplyClamp(FindSet(set, target), inOutResult);
 }
 
 void DiffDataSets::GetDiffIndices(const std::string& set, const std::string& target, std::vector<uint16_t>& outIndices, float threshold) {
-	if (!TargetMatch(set, target))
-		return;
+	GetDiffIndices(FindSet(set, target), outIndices, threshold);
+}
 
-	std::unordered_map<uint16_t, Vector3>* data = &namedSet[set];
-	for (auto resultIt = data->begin(); resultIt != data->end(); ++resultIt) {
-		if (fabs(resultIt->second.x) > threshold || fabs(resultIt->second.y) > threshold || fabs(resultIt->second.z) > threshold) {
-			outIndices.push_back(resultIt->first);
+bool DiffDataSets::ApplyUVDiff(DiffHandle handle, float percent, std::vector<Vector2>* inOutResult) {
+	return ApplyUVDiff(GetHandleSet(handle), percent, inOutResult);
+}
+
+bool DiffDataSets::ApplyDiff(DiffHandle handle, float percent, std::vector<Vector3>* inOutResult) {
+	return ApplyDiff(GetHandleSet(handle), percent, inOutResult);
+}
+
+bool DiffDataSets::ApplyClamp(DiffHandle handle, std::vector<Vector3>* inOutResult) {
+	return ApplyClamp(GetHandleSet(handle), inOutResult);
+}
+
+void DiffDataSets::GetDiffIndices(DiffHandle handle, std::vector<uint16_t>& outIndices, float threshold) {
+	GetDiffIndices(GetHandleSet(handle), outIndices, threshold);
+}
+
+void DiffDataSets::Evaluate(const std::vector<DiffTerm>& terms, const DiffEvalOutput& high, const DiffEvalOutput& low, std::vector<bool>* zapMask) {
+	// Vertices of a block stay in cache while all terms are added to them
+	constexpr size_t blockSize = 4096;
+
+	std::vector<SetRef> refs(terms.size());
+	for (size_t t = 0; t < terms.size(); t++)
+		refs[t] = GetHandleSet(terms[t].handle);
+
+	// Adds a set to an output pair, to both in one traversal if their sizes match
+	auto applySet = [](auto& data, size_t begin, size_t end, float weight, auto* result, float weightLow, auto* resultLow, auto applyRange) {
+		const float highWeight = result ? weight : 0.0f;
+		const float lowWeight = resultLow ? weightLow : 0.0f;
+		const size_t endHigh = result ? std::min(end, result->size()) : 0;
+		const size_t endLow = resultLow ? std::min(end, resultLow->size()) : 0;
+
+		if (highWeight != 0.0f && lowWeight != 0.0f && endHigh == endLow) {
+			if (begin < endHigh)
+				applyRange(data, begin, endHigh, highWeight, result->data(), lowWeight, resultLow->data());
+			return;
 		}
+
+		if (highWeight != 0.0f && begin < endHigh)
+			applyRange(data, begin, endHigh, highWeight, result->data(), 0.0f, nullptr);
+		if (lowWeight != 0.0f && begin < endLow)
+			applyRange(data, begin, endLow, lowWeight, resultLow->data(), 0.0f, nullptr);
+	};
+
+	auto applyVerts = [](auto& view, size_t begin, size_t end, float percent, Vector3* result, float percentLow, Vector3* resultLow) {
+		view.ApplyRange(begin, end, percent, result, percentLow, resultLow);
+	};
+	auto applyUVs = [](auto& view, size_t begin, size_t end, float percent, Vector2* result, float percentLow, Vector2* resultLow) {
+		view.ApplyUVRange(begin, end, percent, result, percentLow, resultLow);
+	};
+	auto applyOwnedVerts = [](auto& data, size_t begin, size_t end, float percent, Vector3* result, float percentLow, Vector3* resultLow) {
+		for (auto& diff : *data) {
+			if (diff.first < begin || diff.first >= end)
+				continue;
+
+			result[diff.first] += diff.second * percent;
+			if (resultLow)
+				resultLow[diff.first] += diff.second * percentLow;
+		}
+	};
+	auto applyOwnedUVs = [](auto& data, size_t begin, size_t end, float percent, Vector2* result, float percentLow, Vector2* resultLow) {
+		for (auto& diff : *data) {
+			if (diff.first < begin || diff.first >= end)
+				continue;
+
+			result[diff.first].u += diff.second.x * percent;
+			result[diff.first].v += diff.second.y * percent;
+			if (resultLow) {
+				resultLow[diff.first].u += diff.second.x * percentLow;
+				resultLow[diff.first].v += diff.second.y * percentLow;
+			}
+		}
+	};
+
+	size_t vertexCount = 0;
+	for (auto* verts : {high.verts, low.verts})
+		if (verts)
+			vertexCount = std::max(vertexCount, verts->size());
+	for (auto* uvs : {high.uvs, low.uvs})
+		if (uvs)
+			vertexCount = std::max(vertexCount, uvs->size());
+
+	// Owned sets are unordered and added in a single pass each
+	for (size_t t = 0; t < terms.size(); t++) {
+		const SetRef& ref = refs[t];
+		if (!ref.match || ref.shared || !ref.owned)
+			continue;
+
+		const DiffTerm& term = terms[t];
+		if (term.kind == DiffTermKind::Vertex)
+			applySet(ref.owned, 0, vertexCount, term.weight, high.verts, term.weightLow, low.verts, applyOwnedVerts);
+		else if (term.kind == DiffTermKind::UV)
+			applySet(ref.owned, 0, vertexCount, term.weight, high.uvs, term.weightLow, low.uvs, applyOwnedUVs);
 	}
 
-	std::sort(outIndices.begin(), outIndices.end());
-	outIndices.erase(std::unique(outIndices.begin(), outIndices.end()), outIndices.end());
+	// Shared sets are sorted and added block by block
+	for (size_t begin = 0; begin < vertexCount; begin += blockSize) {
+		const size_t end = std::min(begin + blockSize, vertexCount);
+
+		for (size_t t = 0; t < terms.size(); t++) {
+			const SetRef& ref = refs[t];
+			if (!ref.match || !ref.shared)
+				continue;
+
+			const DiffTerm& term = terms[t];
+			if (term.kind == DiffTermKind::Vertex)
+				ref.shared->Visit([&](auto& view) { applySet(view, begin, end, term.weight, high.verts, term.weightLow, low.verts, applyVerts); });
+			else if (term.kind == DiffTermKind::UV)
+				ref.shared->Visit([&](auto& view) { applySet(view, begin, end, term.weight, high.uvs, term.weightLow, low.uvs, applyUVs); });
+		}
+	}
+
+	for (size_t t = 0; t < terms.size(); t++) {
+		const SetRef& ref = refs[t];
+		const DiffTerm& term = terms[t];
+
+		if (term.kind == DiffTermKind::Clamp) {
+			if (term.weight > 0.0f && high.verts)
+				ApplyClamp(ref, high.verts);
+			if (term.weightLow > 0.0f && low.verts)
+				ApplyClamp(ref, low.verts);
+		}
+		else if (term.kind == DiffTermKind::Zap && zapMask && ref.match && (term.weight > 0.0f || term.weightLow > 0.0f)) {
+			if (ref.shared)
+				ref.shared->Visit([&](auto& view) { view.MarkIndices(*zapMask, 0.0f); });
+			else if (ref.owned)
+				for (auto& diff : *ref.owned)
+					if (diff.first < zapMask->size() && (diff.second.x != 0.0f || diff.second.y != 0.0f || diff.second.z != 0.0f))
+						(*zapMask)[diff.first] = true;
+		}
+	}
 }
 
-void DiffDataSets::DeleteVerts(const std::string& target, const std::vector<uint16_t>& indices) {
-	if (indices.empty())
+namespace {
+// Adds the sparse values to the result
+template<typename T>
+void AddSparse(const BakedMorph::SparseValues<T>& sparse, std::vector<T>* inOutResult) {
+	if (!inOutResult)
 		return;
 
-	uint16_t highestRemoved = indices.back();
-	std::vector<int> indexCollapse = GenerateIndexCollapseMap(indices, highestRemoved + 1);
+	for (size_t i = 0; i < sparse.indices.size(); i++)
+		(*inOutResult)[sparse.indices[i]] += sparse.values[i];
+}
 
-	for (auto& data : namedSet) {
-		if (TargetMatch(data.first, target))
-			ApplyIndexMapToMapKeys(data.second, indexCollapse, -static_cast<int>(indices.size()));
+// Replaces the result elements with the sparse values
+template<typename T>
+void ReplaceSparse(const BakedMorph::SparseValues<T>& sparse, std::vector<T>* inOutResult) {
+	if (!inOutResult)
+		return;
+
+	for (size_t i = 0; i < sparse.indices.size(); i++)
+		(*inOutResult)[sparse.indices[i]] = sparse.values[i];
+}
+
+// Collects the elements of a dense array for which keep returns true
+template<typename T, typename Pred>
+void GatherSparse(const std::vector<T>& dense, BakedMorph::SparseValues<T>& outSparse, Pred keep) {
+	for (size_t i = 0; i < dense.size(); i++) {
+		if (!keep(dense[i]))
+			continue;
+
+		outSparse.indices.push_back(static_cast<uint32_t>(i));
+		outSparse.values.push_back(dense[i]);
+	}
+
+	outSparse.indices.shrink_to_fit();
+	outSparse.values.shrink_to_fit();
+}
+
+template<typename T>
+size_t SparseMemorySize(const BakedMorph::SparseValues<T>& sparse) {
+	return sparse.indices.capacity() * sizeof(uint32_t) + sparse.values.capacity() * sizeof(T);
+}
+
+uint64_t OutputSizeKey(size_t size, bool present) {
+	return present ? static_cast<uint64_t>(size) + 1 : 0;
+}
+} // namespace
+
+void BakedMorph::Apply(const DiffEvalOutput& high, const DiffEvalOutput& low, std::vector<bool>* zapMask) const {
+	AddSparse(offsets, high.verts);
+	AddSparse(offsetsLow, low.verts);
+	AddSparse(uvOffsets, high.uvs);
+	AddSparse(uvOffsetsLow, low.uvs);
+	ReplaceSparse(clamps, high.verts);
+	ReplaceSparse(clampsLow, low.verts);
+
+	if (zapMask)
+		for (uint32_t index : zaps)
+			(*zapMask)[index] = true;
+}
+
+size_t BakedMorph::GetMemorySize() const {
+	return sizeof(BakedMorph) + SparseMemorySize(offsets) + SparseMemorySize(offsetsLow) + SparseMemorySize(uvOffsets) + SparseMemorySize(uvOffsetsLow)
+		+ SparseMemorySize(clamps) + SparseMemorySize(clampsLow) + zaps.capacity() * sizeof(uint32_t);
+}
+
+std::shared_ptr<const BakedMorph> DiffDataSets::Bake(const std::vector<DiffTerm>& terms, const DiffEvalOutput& high, const DiffEvalOutput& low, size_t zapCount) {
+	std::vector<DiffTerm> offsetTerms;
+	std::vector<DiffTerm> clampTerms;
+	std::vector<DiffTerm> zapTerms;
+	for (auto& term : terms) {
+		if (term.kind == DiffTermKind::Clamp)
+			clampTerms.push_back(term);
+		else if (term.kind == DiffTermKind::Zap)
+			zapTerms.push_back(term);
+		else
+			offsetTerms.push_back(term);
+	}
+
+	auto morph = std::make_shared<BakedMorph>();
+
+	// Offsets are evaluated on zeroed outputs of the same sizes
+	std::vector<Vector3> verts(high.verts ? high.verts->size() : 0);
+	std::vector<Vector3> vertsLow(low.verts ? low.verts->size() : 0);
+	std::vector<Vector2> uvs(high.uvs ? high.uvs->size() : 0);
+	std::vector<Vector2> uvsLow(low.uvs ? low.uvs->size() : 0);
+
+	DiffEvalOutput bakeHigh;
+	bakeHigh.verts = high.verts ? &verts : nullptr;
+	bakeHigh.uvs = high.uvs ? &uvs : nullptr;
+
+	DiffEvalOutput bakeLow;
+	bakeLow.verts = low.verts ? &vertsLow : nullptr;
+	bakeLow.uvs = low.uvs ? &uvsLow : nullptr;
+
+	if (!offsetTerms.empty()) {
+		Evaluate(offsetTerms, bakeHigh, bakeLow);
+
+		auto nonZero3 = [](const Vector3& v) { return v.x != 0.0f || v.y != 0.0f || v.z != 0.0f; };
+		auto nonZero2 = [](const Vector2& v) { return v.u != 0.0f || v.v != 0.0f; };
+		GatherSparse(verts, morph->offsets, nonZero3);
+		GatherSparse(vertsLow, morph->offsetsLow, nonZero3);
+		GatherSparse(uvs, morph->uvOffsets, nonZero2);
+		GatherSparse(uvsLow, morph->uvOffsetsLow, nonZero2);
+	}
+
+	// Clamped vertices are the ones no longer NaN, diffs themselves are finite
+	if (!clampTerms.empty()) {
+		const Vector3 unset(std::numeric_limits<float>::quiet_NaN(), 0.0f, 0.0f);
+		std::fill(verts.begin(), verts.end(), unset);
+		std::fill(vertsLow.begin(), vertsLow.end(), unset);
+		bakeHigh.uvs = nullptr;
+		bakeLow.uvs = nullptr;
+
+		Evaluate(clampTerms, bakeHigh, bakeLow);
+
+		auto clamped = [](const Vector3& v) { return !std::isnan(v.x); };
+		GatherSparse(verts, morph->clamps, clamped);
+		GatherSparse(vertsLow, morph->clampsLow, clamped);
 	}
+
+	if (!zapTerms.empty() && zapCount > 0) {
+		std::vector<bool> zapMask(zapCount, false);
+		Evaluate(zapTerms, DiffEvalOutput(), DiffEvalOutput(), &zapMask);
+
+		for (size_t i = 0; i < zapMask.size(); i++)
+			if (zapMask[i])
+				morph->zaps.push_back(static_cast<uint32_t>(i));
+	}
+
+	return morph;
+}
+
+void DiffDataSets::EvaluateCached(const std::vector<DiffTerm>& terms, const DiffEvalOutput& high, const DiffEvalOutput& low, std::vector<bool>* zapMask) {
+	MorphCache& cache = MorphCache::Get();
+	if (cache.GetMemoryLimit() == 0) {
+		Evaluate(terms, high, low, zapMask);
+		return;
+	}
+
+	// Key of the output sizes and of each term with an effect: kind, data version, owned data address and quantized weights.
+	// Shared data versions are unique per data, owned data versions change with any modification of the sets.
+	MorphCache::Key key;
+	key.reserve(5 + terms.size() * 5);
+	key.push_back(OutputSizeKey(high.verts ? high.verts->size() : 0, high.verts != nullptr));
+	key.push_back(OutputSizeKey(high.uvs ? high.uvs->size() : 0, high.uvs != nullptr));
+	key.push_back(OutputSizeKey(low.verts ? low.verts->size() : 0, low.verts != nullptr));
+	key.push_back(OutputSizeKey(low.uvs ? low.uvs->size() : 0, low.uvs != nullptr));
+	key.push_back(OutputSizeKey(zapMask ? zapMask->size() : 0, zapMask != nullptr));
+
+	std::vector<DiffTerm> bakeTerms;
+	bakeTerms.reserve(terms.size());
+	for (auto& term : terms) {
+		const SetRef& ref = GetHandleSet(term.handle);
+		if (!ref.match || (!ref.shared && !ref.owned))
+			continue;
+
+		const int64_t weight = std::llround(term.weight / WeightQuantum);
+		const int64_t weightLow = std::llround(term.weightLow / WeightQuantum);
+		if (weight == 0 && weightLow == 0)
+			continue;
+
+		DiffTerm bakeTerm = term;
+		bakeTerm.weight = weight * WeightQuantum;
+		bakeTerm.weightLow = weightLow * WeightQuantum;
+		bakeTerms.push_back(bakeTerm);
+
+		key.push_back(static_cast<uint64_t>(term.kind));
+		key.push_back(ref.shared ? ref.shared->GetVersion() : version);
+		key.push_back(ref.shared ? 0 : reinterpret_cast<uintptr_t>(ref.owned));
+		key.push_back(static_cast<uint64_t>(weight));
+		key.push_back(static_cast<uint64_t>(weightLow));
+	}
+
+	std::shared_ptr<const BakedMorph> morph = cache.Find(key);
+	if (!morph)
+		morph = cache.Insert(key, Bake(bakeTerms, high, low, zapMask ? zapMask->size() : 0));
+
+	morph->Apply(high, low, zapMask);
+}
+
+void DiffDataSets::DeleteVerts(const std::string& target, const std::vector<uint16_t>& indices) {
+	RemapVerts(target, VertexRemap::Deletion(indices));
 }
 
 void DiffDataSets::InsertVertexIndices(const std::string& target, const std::vector<uint16_t>& indices) {
-	if (indices.empty())
+	RemapVerts(target, VertexRemap::Insertion(indices));
+}
+
+void DiffDataSets::RemapVerts(const std::string& target, const VertexRemap& remap) {
+	if (remap.empty())
 		return;
 
-	int highestAdded = indices.back();
-	std::vector<int> indexExpand = GenerateIndexExpandMap(indices, highestAdded + 1);
+	std::vector<std::unordered_map<uint16_t, Vector3>*> ownedSets;
+	for (auto& data : namedSet)
+		if (TargetMatch(data.first, target))
+			ownedSets.push_back(&data.second);
 
-	for (auto& data : namedSet) {
-		if (!TargetMatch(data.first, target))
+	// Shared sets are copied to owned data with the new indices directly instead of being copied first and remapped afterwards
+	std::vector<std::pair<std::unordered_map<uint16_t, Vector3>*, SharedDiffSet>> sharedSets;
+	for (auto it = sharedSet.begin(); it != sharedSet.end();) {
+		if (!TargetMatch(it->first, target)) {
+			++it;
 			continue;
+		}
 
-		ApplyIndexMapToMapKeys(data.second, indexExpand, static_cast<int>(indices.size()));
+		precisionLoss = std::max(precisionLoss, it->second->GetHalfError());
+		sharedSets.emplace_back(&namedSet[it->first], it->second);
+		it = sharedSet.erase(it);
 	}
+
+	if (!sharedSets.empty())
+		SetsChanged();
+	else
+		version = NextDiffDataVersion();
+
+	ThreadPool::Get().ParallelFor(ownedSets.size() + sharedSets.size(), [&](size_t i) {
+		if (i < ownedSets.size()) {
+			remap.ApplyToMapKeys(*ownedSets[i]);
+			return;
+		}
+
+		auto& shared = sharedSets[i - ownedSets.size()];
+		std::unordered_map<uint16_t, Vector3>& diff = *shared.first;
+		shared.second->Visit([&](auto& view) {
+			diff.reserve(view.count);
+			for (size_t j = 0; j < view.count; j++) {
+				int newIndex = remap.Map(view.indices[j]);
+				if (newIndex >= 0)
+					diff.emplace(static_cast<uint16_t>(newIndex), view.GetDiff(j));
+			}
+		});
+	});
 }
 
 void DiffDataSets::ClearSet(const std::string& name) {
 	namedSet.erase(name);
+	sharedSet.erase(name);
 	dataTargets.erase(name);
+	SetsChanged();
 }
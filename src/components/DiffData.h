@@ -6,43 +6,275 @@ See the included LICENSE file
 #pragma once
 
 #include "Object3d.hpp"
+#include "PackedDiffSet.h"
 
+#include <iosfwd>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
+class VertexRemap;
 struct UndoStateVertexSliderDiff;
 
-class OSDataFile {
+// Returns a new version for diff data, unique across all sets and instances. Used by caches to notice changed data.
+uint64_t NextDiffDataVersion();
+
+// Immutable diff data that can be referenced by several DiffDataSets at once (see DiffDataCache).
+// Stored packed for applying, with 32-bit indices only if necessary. The data is either owned or references memory kept alive
+// by the storage pointer, such as a memory-mapped file. The map is only created when requested.
+// Owned data can optionally be stored in half precision, unless that would change any diff by more than HalfPrecisionMaxError.
+class SharedDiffData {
+	PackedDiffSet packed;
+	PackedDiffSet32 packedWide;
+	PackedHalfDiffSet packedHalf;
+	PackedHalfDiffSet32 packedHalfWide;
+	std::shared_ptr<const void> storage;
+
+	PackedDiffView<uint16_t> view;
+	PackedDiffView<uint32_t> viewWide;
+	PackedDiffView<uint16_t, half_float::half> viewHalf;
+	PackedDiffView<uint32_t, half_float::half> viewHalfWide;
+	bool wide = false;
+	bool half = false;
+	float halfError = 0.0f;
+	const uint64_t version = NextDiffDataVersion();
+
+	mutable std::unordered_map<uint16_t, nifly::Vector3> map;
+	mutable std::once_flag mapCreated;
+
+	template<typename MapIndex>
+	void Pack(const std::unordered_map<MapIndex, nifly::Vector3>& diff, bool halfPrecision);
+
+public:
+	// Largest change of a diff accepted for storing it in half precision, in game units
+	static constexpr float HalfPrecisionMaxError = 0.005f;
+
+	explicit SharedDiffData(const std::unordered_map<uint16_t, nifly::Vector3>& diff, bool halfPrecision = false);
+	explicit SharedDiffData(const std::unordered_map<uint32_t, nifly::Vector3>& diff, bool halfPrecision = false);
+	// References data owned by storage without copying it. Indices of the view have to be in ascending order.
+	SharedDiffData(const std::shared_ptr<const void>& storage, const PackedDiffView<uint32_t>& view);
+
+	SharedDiffData(const SharedDiffData&) = delete;
+	SharedDiffData& operator=(const SharedDiffData&) = delete;
+
+	// Data is stored with 32-bit indices
+	bool IsWide() const { return wide; }
+	// Data is stored in half precision
+	bool IsHalf() const { return half; }
+	// Largest difference between the stored and the original diffs, 0 unless stored in half precision
+	float GetHalfError() const { return halfError; }
+	// Memory used by the data, including referenced memory
+	size_t GetMemorySize() const;
+	// Unique version of this data, which never changes
+	uint64_t GetVersion() const { return version; }
+
+	// Hash of the stored data, equal for data with the same content and storage (see HasSameContent)
+	uint64_t GetContentHash() const;
+	// Data has the same indices and diffs, stored the same way
+	bool HasSameContent(const SharedDiffData& other) const;
+
+	// Calls func with the PackedDiffView of the data
+	template<typename Func>
+	void Visit(Func&& func) const {
+		if (half)
+			wide ? func(viewHalfWide) : func(viewHalf);
+		else
+			wide ? func(viewWide) : func(view);
+	}
+
+	void Apply(float percent, nifly::Vector3* inOutResult, size_t count) const {
+		Visit([&](auto& v) { v.Apply(percent, inOutResult, count); });
+	}
+	void ApplyUV(float percent, nifly::Vector2* inOutResult, size_t count) const {
+		Visit([&](auto& v) { v.ApplyUV(percent, inOutResult, count); });
+	}
+	void Clamp(nifly::Vector3* inOutResult, size_t count) const {
+		Visit([&](auto& v) { v.Clamp(inOutResult, count); });
+	}
+	void GetIndices(std::vector<uint16_t>& outIndices, float threshold) const {
+		Visit([&](auto& v) { v.GetIndices(outIndices, threshold); });
+	}
+
+	// Copy of the data as a map, indices above 65535 are left out
+	std::unordered_map<uint16_t, nifly::Vector3> ToMap() const;
+	const std::unordered_map<uint16_t, nifly::Vector3>& Map() const {
+		std::call_once(mapCreated, [this] { map = ToMap(); });
+		return map;
+	}
+};
+
+typedef std::shared_ptr<const SharedDiffData> SharedDiffSet;
+
+// Integer handle of a (set, target) pair of a DiffDataSets, see DiffDataSets::Resolve
+typedef uint32_t DiffHandle;
+constexpr DiffHandle InvalidDiffHandle = UINT32_MAX;
+
+// How DiffDataSets::Evaluate uses the data of a term
+enum class DiffTermKind : uint8_t {
+	Vertex, // Adds the weighted diffs to the vertices
+	UV,		// Adds the weighted diffs to the UVs
+	Clamp,	// Replaces the vertices with the diffs after all other terms if the weight is above zero
+	Zap		// Marks the vertices of the diffs as zapped if either weight is above zero
+};
+
+// Weighted diff data of an evaluation, see DiffDataSets::Evaluate
+struct DiffTerm {
+	DiffHandle handle = InvalidDiffHandle;
+	DiffTermKind kind = DiffTermKind::Vertex;
+	float weight = 0.0f;	// Weight for the high (or only) output
+	float weightLow = 0.0f; // Weight for the low output
+};
+
+// Result arrays of DiffDataSets::Evaluate, null ones are skipped
+struct DiffEvalOutput {
+	std::vector<nifly::Vector3>* verts = nullptr;
+	std::vector<nifly::Vector2>* uvs = nullptr;
+};
+
+// Combined result of all terms of an evaluation relative to unmorphed outputs, see DiffDataSets::EvaluateCached.
+// Offsets are added first, then clamped vertices are replaced and zapped vertices marked. Only affected vertices are stored.
+struct BakedMorph {
+	template<typename T>
+	struct SparseValues {
+		std::vector<uint32_t> indices;
+		std::vector<T> values;
+	};
+
+	SparseValues<nifly::Vector3> offsets;
+	SparseValues<nifly::Vector3> offsetsLow;
+	SparseValues<nifly::Vector2> uvOffsets;
+	SparseValues<nifly::Vector2> uvOffsetsLow;
+	SparseValues<nifly::Vector3> clamps;
+	SparseValues<nifly::Vector3> clampsLow;
+	std::vector<uint32_t> zaps;
+
+	// Outputs and the mask have to have the sizes the morph was baked for
+	void Apply(const DiffEvalOutput& high, const DiffEvalOutput& low, std::vector<bool>* zapMask) const;
+	size_t GetMemorySize() const;
+};
+
+// Reads a .bsd file. Diffs with indices that don't fit into Index are left out.
+template<typename Index>
+bool ReadBSDFile(const std::string& fileName, std::unordered_map<Index, nifly::Vector3>& outDiffs);
+
+// Reads the requested sets of an .osd file through a memory mapping for sharing. Data names missing in the file are left out.
+// With keepMapped, uncompressed sets of indexed files reference the mapped file without copying, keeping it mapped while referenced.
+// Other sets are copied from the mapping once, compressed sets are used in their decompressed buffer.
+// With halfPrecision, copied sets are stored in half precision where possible, see SharedDiffData.
+bool ReadSharedOSDSets(const std::string& fileName,
+					   const std::vector<std::string>& dataNames,
+					   std::map<std::string, SharedDiffSet>& outSets,
+					   bool keepMapped = false,
+					   bool halfPrecision = false);
+
+// Version 1 stores 16-bit indices and diff counts, version 2 stores 32-bit ones.
+// Version 3 is indexed: each set is a block of sorted indices and x/y/z arrays, LZ4 compressed if that makes it smaller,
+// followed by a table of contents with the offset of each block, so single sets are read without parsing the whole file.
+// Files are written as version 1 unless the data requires version 2 or an indexed file is requested, so older versions can still read them.
+// Index is uint16_t or uint32_t. Reading diffs with indices that don't fit into Index leaves them out.
+template<typename Index>
+class BasicOSDataFile {
 	uint32_t header;
 	uint32_t version;
 	uint32_t dataCount;
-	std::unordered_map<std::string, std::unordered_map<uint16_t, nifly::Vector3>> dataDiffs;
+	uint32_t droppedCount = 0;
+	std::unordered_map<std::string, std::unordered_map<Index, nifly::Vector3>> dataDiffs;
+
+	// Reads all sets if dataNames is null
+	bool ReadSets(const std::string& fileName, const std::vector<std::string>* dataNames);
+	bool WriteIndexed(std::fstream& file);
 
 public:
-	OSDataFile();
-	~OSDataFile();
+	BasicOSDataFile();
+	~BasicOSDataFile();
 
 	bool Read(const std::string& fileName);
-	bool Write(const std::string& fileName);
+	// Only reads the requested sets, names missing in the file are left out
+	bool Read(const std::string& fileName, const std::vector<std::string>& dataNames);
+	bool Write(const std::string& fileName, bool indexed = false);
 
-	std::unordered_map<std::string, std::unordered_map<uint16_t, nifly::Vector3>> GetDataDiffs();
-	std::unordered_map<uint16_t, nifly::Vector3>* GetDataDiff(const std::string& dataName);
-	void SetDataDiff(const std::string& dataName, std::unordered_map<uint16_t, nifly::Vector3>& inDataDiff);
+	uint32_t GetVersion() const { return version; }
+	// Number of diffs left out by Read because their index didn't fit
+	uint32_t GetDroppedCount() const { return droppedCount; }
+
+	std::unordered_map<std::string, std::unordered_map<Index, nifly::Vector3>> GetDataDiffs();
+	std::unordered_map<std::string, std::unordered_map<Index, nifly::Vector3>>& GetDataDiffsRef() { return dataDiffs; }
+	std::unordered_map<Index, nifly::Vector3>* GetDataDiff(const std::string& dataName);
+	void SetDataDiff(const std::string& dataName, const std::unordered_map<Index, nifly::Vector3>& inDataDiff);
 };
 
+typedef BasicOSDataFile<uint16_t> OSDataFile;
+typedef BasicOSDataFile<uint32_t> OSDataFile32;
+
 class DiffDataSets {
 	std::unordered_map<std::string, std::unordered_map<uint16_t, nifly::Vector3>> namedSet;
+	std::unordered_map<std::string, SharedDiffSet> sharedSet; // Read-only packed sets, copied to namedSet on the first modification
 	std::map<std::string, std::string> dataTargets;
 
+	// Data of a set if it matches the target, only one of owned and shared is set
+	struct SetRef {
+		bool match = false;
+		const std::unordered_map<uint16_t, nifly::Vector3>* owned = nullptr;
+		const SharedDiffData* shared = nullptr;
+	};
+
+	struct HandleEntry {
+		std::string set;
+		std::string target;
+		uint32_t generation = UINT32_MAX;
+		SetRef ref;
+	};
+
+	std::vector<HandleEntry> handles;
+	std::map<std::pair<std::string, std::string>, DiffHandle> handleIndex;
+	uint32_t generation = 0; // Increased whenever sets are added, removed, renamed or copied from shared to owned data
+	uint64_t version = NextDiffDataVersion(); // Renewed on every change of owned data, or access that may change it
+
+	bool halfPrecision = false;
+	float precisionLoss = 0.0f; // Largest half precision error of sets copied to owned data since the last Clear
+
+	void SetsChanged() {
+		generation++;
+		version = NextDiffDataVersion();
+	}
+
+	SetRef FindSet(const std::string& set, const std::string& target) const;
+	// Looks up the set of a handle again if sets changed since the last use
+	const SetRef& GetHandleSet(DiffHandle handle);
+
+	static bool ApplyDiff(const SetRef& ref, float percent, std::vector<nifly::Vector3>* inOutResult);
+	static bool ApplyUVDiff(const SetRef& ref, float percent, std::vector<nifly::Vector2>* inOutResult);
+	static bool ApplyClamp(const SetRef& ref, std::vector<nifly::Vector3>* inOutResult);
+	static void GetDiffIndices(const SetRef& ref, std::vector<uint16_t>& outIndices, float threshold);
+
+	// Diff data of a set, empty if the set doesn't exist
+	const std::unordered_map<uint16_t, nifly::Vector3>& GetSet(const std::string& name) const;
+	// Modifiable diff data of a set, creates the set or a copy of its shared data if necessary
+	std::unordered_map<uint16_t, nifly::Vector3>& OwnSet(const std::string& name);
+	void OwnTargetSets(const std::string& target);
+
 public:
 	inline bool TargetMatch(const std::string& set, const std::string& target);
 	void MoveToSet(const std::string& name, const std::string& target, std::unordered_map<uint16_t, nifly::Vector3>& inDiffData);
 	void LoadSet(const std::string& name, const std::string& target, const std::unordered_map<uint16_t, nifly::Vector3>& inDiffData);
 	int LoadSet(const std::string& name, const std::string& target, const std::string& fromFile);
+	void ShareSet(const std::string& name, const std::string& target, const SharedDiffSet& inDiffData);
+	// Same as LoadSet/LoadData, but references the data from the process-wide DiffDataCache instead of owning a copy
+	int LoadSharedSet(const std::string& name, const std::string& target, const std::string& fromFile);
+	bool LoadSharedData(const std::map<std::string, std::map<std::string, std::string>>& osdNames);
 	int SaveSet(const std::string& name, const std::string& target, const std::string& toFile);
 	bool LoadData(const std::map<std::string, std::map<std::string, std::string>>& osdNames);
-	bool SaveData(const std::map<std::string, std::map<std::string, std::string>>& osdNames);
+
+	// Sets read by LoadSet and LoadData from files are stored read-only and deduplicated by content (see DiffDataCache::Share),
+	// and copied once modified. With half precision, they are stored in half precision where the error is small enough.
+	void SetHalfPrecision(bool enable) { halfPrecision = enable; }
+	// Largest difference between the loaded and the current diffs caused by half precision storage, to be reported when saving
+	float GetPrecisionLoss() const;
+	// Writes indexed .osd files if requested, see BasicOSDataFile
+	bool SaveData(const std::map<std::string, std::map<std::string, std::string>>& osdNames, bool indexed = false);
 	void RenameSet(const std::string& oldName, const std::string& newName);
 	void DeepRename(const std::string& oldName, const std::string& newName);
 	void DeepCopy(const std::string& srcName, const std::string& destName);
@@ -57,21 +289,45 @@ public:
 	std::unordered_map<uint16_t, nifly::Vector3>* GetDiffSet(const std::string& targetDataName);
 	void GetDiffIndices(const std::string& set, const std::string& target, std::vector<uint16_t>& outIndices, float threshold = 0.0f);
 
+	// Returns a handle for a set and target, for use with the handle overloads below. The set doesn't have to exist yet.
+	// Handles stay valid until Clear and follow later changes of the sets. Using the same DiffDataSets from several threads
+	// requires all handles to be resolved first and no sets to be changed meanwhile.
+	DiffHandle Resolve(const std::string& set, const std::string& target);
+	bool ApplyDiff(DiffHandle handle, float percent, std::vector<nifly::Vector3>* inOutResult);
+	bool ApplyUVDiff(DiffHandle handle, float percent, std::vector<nifly::Vector2>* inOutResult);
+	bool ApplyClamp(DiffHandle handle, std::vector<nifly::Vector3>* inOutResult);
+	void GetDiffIndices(DiffHandle handle, std::vector<uint16_t>& outIndices, float threshold = 0.0f);
+
+	// Applies all terms in one pass instead of one ApplyDiff/ApplyUVDiff/ApplyClamp/GetDiffIndices call each.
+	// Vertex and UV terms are accumulated block by block over the vertices, writing the high and the low output in the same traversal.
+	// Clamp terms are applied last in their order. Zapped vertices are set in zapMask, indices outside of it are left out.
+	void Evaluate(const std::vector<DiffTerm>& terms, const DiffEvalOutput& high, const DiffEvalOutput& low = DiffEvalOutput(), std::vector<bool>* zapMask = nullptr);
+	// Same as Evaluate, but reuses the baked result of earlier calls with the same terms, data versions and output sizes from MorphCache.
+	// Weights are rounded to WeightQuantum. Owned data modified through pointers kept from GetDiffSet isn't noticed.
+	void EvaluateCached(const std::vector<DiffTerm>& terms, const DiffEvalOutput& high, const DiffEvalOutput& low = DiffEvalOutput(), std::vector<bool>* zapMask = nullptr);
+	// Combines the terms into a baked morph for outputs of the given sizes, see EvaluateCached
+	std::shared_ptr<const BakedMorph> Bake(const std::vector<DiffTerm>& terms, const DiffEvalOutput& high, const DiffEvalOutput& low, size_t zapCount);
+	static constexpr float WeightQuantum = 0.0001f;
+
 	// indices must be in ascending order.
 	void DeleteVerts(const std::string& target, const std::vector<uint16_t>& indices);
 	// indices must be in ascending order.
 	void InsertVertexIndices(const std::string& target, const std::vector<uint16_t>& indices);
+	// Moves the diffs of all sets of the target to their new vertex indices, processing the sets in parallel
+	void RemapVerts(const std::string& target, const VertexRemap& remap);
 	void ClearSet(const std::string& name);
 	void EmptySet(const std::string& set, const std::string& target) {
 		if (!TargetMatch(set, target))
 			return;
 
+		sharedSet.erase(set);
 		namedSet[set].clear();
+		SetsChanged();
 	}
 
 
 	void ZeroVertDiff(const std::string& set, int vertCount, float* vColorMask) {
-		for (auto& ns : namedSet[set]) {
+		for (auto& ns : OwnSet(set)) {
 			if (ns.first < vertCount) {
 				float f = vColorMask[ns.first];
 				if (f == 1.0f)
@@ -92,18 +348,20 @@ public:
 		if (!TargetMatch(set, target))
 			return;
 
+		auto& data = OwnSet(set);
+
 		std::vector<uint16_t> v;
 		if (vertSet) {
 			v = (*vertSet);
 		}
 		else {
-			for (auto& diff : namedSet[set])
+			for (auto& diff : data)
 				v.push_back(diff.first);
 		}
 
 		for (auto& i : v) {
-			auto d = namedSet[set].find(i);
-			if (d == namedSet[set].end())
+			auto d = data.find(i);
+			if (d == data.end())
 				continue;
 
 			float f = 0.0f;
@@ -117,16 +375,22 @@ public:
 				continue;
 
 			if (f == 0.0f) {
-				namedSet[set].erase(i);
+				data.erase(i);
 				continue;
 			}
-			namedSet[set][i] *= f;
+			data[i] *= f;
 		}
 	}
 
+	// Also invalidates all handles
 	void Clear() {
 		namedSet.clear();
+		sharedSet.clear();
 		dataTargets.clear();
+		handles.clear();
+		handleIndex.clear();
+		precisionLoss = 0.0f;
+		SetsChanged();
 	}
 };
 
@@ -0,0 +1,281 @@
+/*
+BodySlide and Outfit Studio
+See the included LICENSE file
+*/
+
+#include "DiffDataCache.h"
+#include "../utils/PlatformUtil.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <limits>
+
+using namespace nifly;
+
+DiffDataCache& DiffDataCache::Get() {
+	static DiffDataCache cache;
+	return cache;
+}
+
+bool DiffDataCache::GetFileKey(const std::string& fileName, Key& outKey) {
+	std::error_code ec;
+	auto path = std::filesystem::absolute(std::filesystem::u8path(fileName), ec);
+	if (ec)
+		return false;
+
+	outKey.filePath = path.lexically_normal().u8string();
+	return PlatformUtil::GetFileStamp(outKey.filePath, outKey.size, outKey.time);
+}
+
+size_t DiffDataCache::EstimateSize(const SharedDiffData& diff) {
+	// The map view is only created for saving, which builds don't do
+	return sizeof(SharedDiffData) + diff.GetMemorySize();
+}
+
+SharedDiffSet DiffDataCache::Find(const Key& key) {
+	auto it = entries.find(key);
+	if (it == entries.end())
+		return nullptr;
+
+	lru.splice(lru.begin(), lru, it->second.lruPos);
+	return it->second.data;
+}
+
+SharedDiffSet DiffDataCache::Insert(const Key& key, const SharedDiffSet& packed) {
+	SharedDiffSet data = Find(key);
+	if (data)
+		return data;
+
+	Entry entry;
+	entry.data = packed;
+	entry.bytes = EstimateSize(*entry.data);
+	entry.lruPos = lru.insert(lru.begin(), key);
+
+	data = entry.data;
+	memoryUsage += entry.bytes;
+	entries.emplace(key, std::move(entry));
+
+	Evict();
+	return data;
+}
+
+void DiffDataCache::Evict() {
+	while (memoryUsage > memoryLimit && !lru.empty()) {
+		auto it = entries.find(lru.back());
+		memoryUsage -= it->second.bytes;
+		entries.erase(it);
+		lru.pop_back();
+	}
+}
+
+void DiffDataCache::BeginLoad(std::unique_lock<std::mutex>& lock, const std::string& filePath) {
+	loadingDone.wait(lock, [&] { return loadingFiles.find(filePath) == loadingFiles.end(); });
+	loadingFiles.insert(filePath);
+}
+
+void DiffDataCache::EndLoad(const std::string& filePath) {
+	loadingFiles.erase(filePath);
+	loadingDone.notify_all();
+}
+
+void DiffDataCache::SetMemoryLimit(size_t bytes) {
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	memoryLimit = bytes;
+	Evict();
+}
+
+size_t DiffDataCache::GetMemoryLimit() {
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	return memoryLimit;
+}
+
+void DiffDataCache::SetKeepMapped(bool enable) {
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	keepMapped = enable;
+}
+
+void DiffDataCache::SetHalfPrecision(bool enable) {
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	if (halfPrecision == enable)
+		return;
+
+	// Cached data was read with the other setting
+	halfPrecision = enable;
+	entries.clear();
+	missingData.clear();
+	lru.clear();
+	memoryUsage = 0;
+}
+
+bool DiffDataCache::GetHalfPrecision() {
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	return halfPrecision;
+}
+
+size_t DiffDataCache::GetMemoryUsage() {
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	return memoryUsage;
+}
+
+SharedDiffSet DiffDataCache::Share(const SharedDiffSet& data) {
+	if (!data)
+		return data;
+
+	const uint64_t hash = data->GetContentHash();
+
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	dedupStats.sets++;
+
+	auto range = contents.equal_range(hash);
+	for (auto it = range.first; it != range.second;) {
+		SharedDiffSet existing = it->second.lock();
+		if (!existing) {
+			it = contents.erase(it);
+			continue;
+		}
+
+		if (existing == data)
+			return data;
+
+		if (existing->HasSameContent(*data)) {
+			dedupStats.duplicates++;
+			dedupStats.bytesSaved += EstimateSize(*data);
+			return existing;
+		}
+
+		++it;
+	}
+
+	contents.emplace(hash, data);
+
+	if (contents.size() >= contentsPurgeSize) {
+		for (auto it = contents.begin(); it != contents.end();) {
+			if (it->second.expired())
+				it = contents.erase(it);
+			else
+				++it;
+		}
+
+		contentsPurgeSize = std::max<size_t>(1024, contents.size() * 2);
+	}
+
+	return data;
+}
+
+DiffDataCache::DedupStats DiffDataCache::GetDedupStats() {
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	return dedupStats;
+}
+
+bool DiffDataCache::GetOSDSets(const std::string& fileName, const std::vector<std::string>& dataNames, std::map<std::string, SharedDiffSet>& outSets) {
+	Key key;
+	if (!GetFileKey(fileName, key))
+		return false;
+
+	auto findAll = [&]() {
+		for (auto& dataName : dataNames) {
+			key.dataName = dataName;
+			SharedDiffSet data = Find(key);
+			if (data)
+				outSets[dataName] = data;
+			else if (missingData.find(key) == missingData.end())
+				return false;
+		}
+		return true;
+	};
+
+	std::unique_lock<std::mutex> lock(cacheMutex);
+	if (findAll())
+		return true;
+
+	// Only one thread reads the same file, the others wait for the result
+	LoadGuard loading(*this, lock, key.filePath);
+	if (findAll())
+		return true;
+
+	const bool mapped = keepMapped;
+	const bool half = halfPrecision;
+	lock.unlock();
+
+	// Only the requested sets are read, indexed files are read without parsing the other sets
+	std::map<std::string, SharedDiffSet> packedSets;
+	bool read = ReadSharedOSDSets(fileName, dataNames, packedSets, mapped, half);
+	for (auto& packed : packedSets)
+		packed.second = Share(packed.second);
+
+	loading.End();
+
+	if (!read)
+		return false;
+
+	for (auto& packed : packedSets) {
+		key.dataName = packed.first;
+		outSets[packed.first] = Insert(key, packed.second);
+	}
+
+	// Names missing from previous versions of the file can't be requested again
+	Key fileKey;
+	fileKey.filePath = key.filePath;
+	fileKey.size = std::numeric_limits<int64_t>::min();
+	fileKey.time = std::numeric_limits<int64_t>::min();
+	auto it = missingData.lower_bound(fileKey);
+	while (it != missingData.end() && it->filePath == key.filePath) {
+		if (it->size != key.size || it->time != key.time)
+			it = missingData.erase(it);
+		else
+			++it;
+	}
+
+	// Forgotten names only cost another read of their file
+	if (missingData.size() >= missingDataLimit)
+		missingData.clear();
+
+	// Stale data names would otherwise read the whole file again on every request
+	for (auto& dataName : dataNames) {
+		if (packedSets.find(dataName) == packedSets.end()) {
+			key.dataName = dataName;
+			missingData.insert(key);
+		}
+	}
+
+	return true;
+}
+
+SharedDiffSet DiffDataCache::GetBSDSet(const std::string& fileName) {
+	Key key;
+	if (!GetFileKey(fileName, key))
+		return nullptr;
+
+	std::unique_lock<std::mutex> lock(cacheMutex);
+	SharedDiffSet data = Find(key);
+	if (data)
+		return data;
+
+	LoadGuard loading(*this, lock, key.filePath);
+	data = Find(key);
+	if (data)
+		return data;
+
+	const bool half = halfPrecision;
+	lock.unlock();
+
+	std::unordered_map<uint32_t, Vector3> diff;
+	bool read = ReadBSDFile(fileName, diff);
+	if (read)
+		data = Share(std::make_shared<const SharedDiffData>(diff, half));
+
+	loading.End();
+
+	if (!read)
+		return nullptr;
+
+	return Insert(key, data);
+}
+
+void DiffDataCache::Clear() {
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	entries.clear();
+	missingData.clear();
+	lru.clear();
+	memoryUsage = 0;
+}
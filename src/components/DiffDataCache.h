@@ -0,0 +1,146 @@
+/*
+BodySlide and Outfit Studio
+See the included LICENSE file
+*/
+
+#pragma once
+
+#include "DiffData.h"
+
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <set>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+// Process-wide cache of parsed, immutable diff data shared by concurrent outfit builds.
+// Entries are keyed by absolute file path, file size, modification time and data name, so modified files are read again.
+// Least recently used entries are evicted once the memory limit is exceeded. Evicted data stays valid for as long as it's referenced.
+// Data with identical content is deduplicated across files and sets, see Share.
+class DiffDataCache {
+public:
+	// Savings of the content deduplication since the start
+	struct DedupStats {
+		size_t sets = 0;	   // Sets passed to Share
+		size_t duplicates = 0; // Sets replaced by existing data with the same content
+		size_t bytesSaved = 0; // Memory of the replaced sets
+	};
+
+private:
+	struct Key {
+		std::string filePath;
+		int64_t size = 0;
+		int64_t time = 0;
+		std::string dataName;
+
+		bool operator<(const Key& other) const {
+			return std::tie(filePath, size, time, dataName) < std::tie(other.filePath, other.size, other.time, other.dataName);
+		}
+	};
+
+	struct Entry {
+		SharedDiffSet data;
+		size_t bytes = 0;
+		std::list<Key>::iterator lruPos;
+	};
+
+	std::map<Key, Entry> entries;
+	std::list<Key> lru; // Most recently used first
+	std::set<std::string> loadingFiles;
+	std::set<Key> missingData; // Data names requested from a file that doesn't contain them, only the current stamp of each file
+	size_t missingDataLimit = 4096;
+
+	// Live shared data by content hash, expired entries are removed when found or once the count doubled
+	std::unordered_multimap<uint64_t, std::weak_ptr<const SharedDiffData>> contents;
+	size_t contentsPurgeSize = 1024;
+	DedupStats dedupStats;
+	std::condition_variable loadingDone;
+	std::mutex cacheMutex;
+
+	size_t memoryUsage = 0;
+	size_t memoryLimit = 512 * 1024 * 1024;
+	bool keepMapped = false;
+	bool halfPrecision = false;
+
+	DiffDataCache() = default;
+
+	static bool GetFileKey(const std::string& fileName, Key& outKey);
+	static size_t EstimateSize(const SharedDiffData& diff);
+
+	// Returns the cached data and marks it as recently used, null if not cached. Cache mutex must be locked.
+	SharedDiffSet Find(const Key& key);
+	// Adds data to the cache and evicts old entries if necessary. Returns the already cached data if any. Cache mutex must be locked.
+	SharedDiffSet Insert(const Key& key, const SharedDiffSet& packed);
+	void Evict();
+
+	// Marks a file as being read by the calling thread. Waits for other threads currently reading the same file.
+	void BeginLoad(std::unique_lock<std::mutex>& lock, const std::string& filePath);
+	void EndLoad(const std::string& filePath);
+
+	// Calls BeginLoad and ends the load on every path out of the reading function, including exceptions.
+	// The lock is released while reading, End and the destructor lock it again.
+	class LoadGuard {
+		DiffDataCache& cache;
+		std::unique_lock<std::mutex>& lock;
+		std::string filePath;
+		bool loading = true;
+
+	public:
+		LoadGuard(DiffDataCache& cache, std::unique_lock<std::mutex>& lock, const std::string& filePath)
+			: cache(cache)
+			, lock(lock)
+			, filePath(filePath) {
+			cache.BeginLoad(lock, filePath);
+		}
+
+		~LoadGuard() { End(); }
+
+		LoadGuard(const LoadGuard&) = delete;
+		LoadGuard& operator=(const LoadGuard&) = delete;
+
+		void End() {
+			if (!loading)
+				return;
+
+			if (!lock.owns_lock())
+				lock.lock();
+
+			cache.EndLoad(filePath);
+			loading = false;
+		}
+	};
+
+public:
+	static DiffDataCache& Get();
+
+	DiffDataCache(const DiffDataCache&) = delete;
+	DiffDataCache& operator=(const DiffDataCache&) = delete;
+
+	// Memory limit in bytes. Existing entries are evicted as necessary.
+	void SetMemoryLimit(size_t bytes);
+	size_t GetMemoryLimit();
+	size_t GetMemoryUsage();
+
+	// Uncompressed sets of indexed .osd files reference the memory-mapped file instead of being copied.
+	// Mapped files can't be overwritten on Windows while cached, so this is meant for processes that don't write them.
+	void SetKeepMapped(bool enable);
+	// Data read afterwards is stored in half precision where the error is small enough, see SharedDiffData
+	void SetHalfPrecision(bool enable);
+	bool GetHalfPrecision();
+
+	// Returns data with the same content as data if any is still referenced, otherwise data, which is then used for later calls.
+	// Identical sets of different files share one buffer this way. DiffDataSets copy shared data before modifying it.
+	SharedDiffSet Share(const SharedDiffSet& data);
+	DedupStats GetDedupStats();
+
+	// Gets the requested data of an .osd file, reading the file if necessary. Data names missing in the file are left out.
+	// Returns false if the file couldn't be read.
+	bool GetOSDSets(const std::string& fileName, const std::vector<std::string>& dataNames, std::map<std::string, SharedDiffSet>& outSets);
+
+	// Gets the data of a .bsd file, reading the file if necessary. Returns null if the file couldn't be read.
+	SharedDiffSet GetBSDSet(const std::string& fileName);
+
+	void Clear();
+};
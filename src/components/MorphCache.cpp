@@ -0,0 +1,81 @@
+/*
+BodySlide and Outfit Studio
+See the included LICENSE file
+*/
+
+#include "MorphCache.h"
+
+MorphCache& MorphCache::Get() {
+	static MorphCache cache;
+	return cache;
+}
+
+void MorphCache::Evict() {
+	while (memoryUsage > memoryLimit && !lru.empty()) {
+		auto it = entries.find(lru.back());
+		memoryUsage -= it->second.bytes;
+		entries.erase(it);
+		lru.pop_back();
+	}
+}
+
+void MorphCache::SetMemoryLimit(size_t bytes) {
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	memoryLimit = bytes;
+	Evict();
+}
+
+size_t MorphCache::GetMemoryLimit() {
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	return memoryLimit;
+}
+
+size_t MorphCache::GetMemoryUsage() {
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	return memoryUsage;
+}
+
+MorphCache::Stats MorphCache::GetStats() {
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	return stats;
+}
+
+std::shared_ptr<const BakedMorph> MorphCache::Find(const Key& key) {
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	auto it = entries.find(key);
+	if (it == entries.end()) {
+		stats.misses++;
+		return nullptr;
+	}
+
+	stats.hits++;
+	lru.splice(lru.begin(), lru, it->second.lruPos);
+	return it->second.morph;
+}
+
+std::shared_ptr<const BakedMorph> MorphCache::Insert(const Key& key, const std::shared_ptr<const BakedMorph>& morph) {
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	auto it = entries.find(key);
+	if (it != entries.end()) {
+		lru.splice(lru.begin(), lru, it->second.lruPos);
+		return it->second.morph;
+	}
+
+	Entry entry;
+	entry.morph = morph;
+	entry.bytes = morph->GetMemorySize() + key.capacity() * sizeof(uint64_t) * 2;
+	entry.lruPos = lru.insert(lru.begin(), key);
+
+	memoryUsage += entry.bytes;
+	entries.emplace(key, std::move(entry));
+
+	Evict();
+	return morph;
+}
+
+void MorphCache::Clear() {
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	entries.clear();
+	lru.clear();
+	memoryUsage = 0;
+}
@@ -0,0 +1,67 @@
+/*
+BodySlide and Outfit Studio
+See the included LICENSE file
+*/
+
+#pragma once
+
+#include "DiffData.h"
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Process-wide cache of baked morphs, the combined diffs of all sliders of a shape for one set of slider values.
+// Repeated builds of the same preset, preview refreshes and outfits sharing a target reuse them instead of adding every diff again.
+// Keys are built by DiffDataSets::EvaluateCached from the output sizes and each term's kind, weights and data version,
+// so changed data or slider values simply miss. Least recently used entries are evicted once the memory limit is exceeded.
+class MorphCache {
+public:
+	typedef std::vector<uint64_t> Key;
+
+	// Counters since the start
+	struct Stats {
+		size_t hits = 0;
+		size_t misses = 0;
+	};
+
+private:
+	struct Entry {
+		std::shared_ptr<const BakedMorph> morph;
+		size_t bytes = 0;
+		std::list<Key>::iterator lruPos;
+	};
+
+	std::map<Key, Entry> entries;
+	std::list<Key> lru; // Most recently used first
+	Stats stats;
+	std::mutex cacheMutex;
+
+	size_t memoryUsage = 0;
+	size_t memoryLimit = 128 * 1024 * 1024;
+
+	MorphCache() = default;
+
+	void Evict();
+
+public:
+	static MorphCache& Get();
+
+	MorphCache(const MorphCache&) = delete;
+	MorphCache& operator=(const MorphCache&) = delete;
+
+	// Memory limit in bytes, 0 disables the cache. Existing entries are evicted as necessary.
+	void SetMemoryLimit(size_t bytes);
+	size_t GetMemoryLimit();
+	size_t GetMemoryUsage();
+	Stats GetStats();
+
+	// Returns the cached morph and marks it as recently used, null if not cached
+	std::shared_ptr<const BakedMorph> Find(const Key& key);
+	// Adds a morph and evicts old entries if necessary. Returns the already cached morph if another thread baked it meanwhile.
+	std::shared_ptr<const BakedMorph> Insert(const Key& key, const std::shared_ptr<const BakedMorph>& morph);
+
+	void Clear();
+};
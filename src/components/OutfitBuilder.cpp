@@ -0,0 +1,1077 @@
+/*
+BodySlide and Outfit Studio
+See the included LICENSE file
+*/
+
+#include "OutfitBuilder.h"
+#include "DiffDataCache.h"
+#include "MorphCache.h"
+#include "../utils/BoundedQueue.h"
+#include "../utils/ConfigurationManager.h"
+#include "../utils/PlatformUtil.h"
+#include "../utils/ThreadPool.h"
+
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <regex>
+#include <sstream>
+#include <thread>
+#include <wx/filename.h>
+#include <wx/intl.h>
+#include <wx/log.h>
+#include <wx/utils.h>
+
+using namespace nifly;
+
+// Increase when the build output changes for the same inputs, so that all outfits are rebuilt
+constexpr uint64_t BuildManifestVersion = 3;
+
+void RefNormalsCache::Apply(NifFile& nif, const std::string& appDir) {
+	std::lock_guard<std::mutex> lock(cacheMutex);
+
+	for (auto& s : nif.GetShapes()) {
+		std::string shapeName = s->name.get();
+
+		if (cache.find(shapeName) != cache.end()) {
+			// Apply normals from file cache
+			NifFile& srcNif = cache[shapeName];
+			nif.ApplyNormalsFromFile(srcNif, shapeName);
+		}
+		else {
+			// Check if reference normals file exists
+			wxString fileName = wxString::Format("%s/RefNormals/%s.nif", wxString::FromUTF8(appDir), wxString::FromUTF8(shapeName));
+			if (wxFileName::FileExists(fileName)) {
+				std::fstream file;
+				PlatformUtil::OpenFileStream(file, fileName.ToUTF8().data(), std::ios::in | std::ios::binary);
+
+				NifFile srcNif;
+				if (srcNif.Load(file) != 0)
+					continue;
+
+				// Apply normals from file
+				nif.ApplyNormalsFromFile(srcNif, shapeName);
+
+				// Move file to cache
+				cache[shapeName] = std::move(srcNif);
+			}
+		}
+	}
+}
+
+void RefNormalsCache::Clear() {
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	cache.clear();
+}
+
+
+OutfitBuilder::OutfitBuilder(SliderManager& sliderManager, const OutfitBuildOptions& options)
+	: sliderManager(sliderManager)
+	, options(options)
+	, memoryBudget(options.memoryLimit) {
+	// Zap choices are read once for the whole batch
+	BuildSelectionFile buildSelFile;
+	buildSelFile.Open(options.appDir + PathSepStr + "BuildSelection.xml");
+	if (!buildSelFile.fail())
+		buildSelFile.Get(buildSelection);
+
+	if (this->options.targets.empty())
+		this->options.targets.push_back({options.preset, options.dataPath});
+
+	// Each preset of a multi-preset build is built as it is
+	if (this->options.targets.size() == 1) {
+		for (auto& s : sliderManager.slidersBig)
+			if (s.changed && !s.clamp)
+				changedBig.emplace(s.name, s.value);
+
+		for (auto& s : sliderManager.slidersSmall)
+			if (s.changed && !s.clamp)
+				changedSmall.emplace(s.name, s.value);
+	}
+}
+
+size_t OutfitBuilder::GetMemoryLimit(int limitMB) {
+	uint64_t limit = 0;
+	if (limitMB > 0)
+		limit = (uint64_t)limitMB * 1024 * 1024;
+	else {
+		wxMemorySize freeMemory = wxGetFreeMemory();
+		if (freeMemory > 0)
+			limit = (uint64_t)freeMemory.GetValue() / 4 * 3;
+	}
+
+	// Address space of 32-bit builds
+	if (sizeof(void*) < 8 && (limit == 0 || limit > 1024ull * 1024 * 1024))
+		limit = 1024ull * 1024 * 1024;
+
+	return (size_t)limit;
+}
+
+void OutfitBuilder::SetDefaultConfig(ConfigurationManager& config) {
+	config.SetDefaultValue("BuildThreads", 0);
+	config.SetDefaultBoolValue("IncrementalBuilds", true);
+	config.SetDefaultValue("DiffCacheSize", 512);
+	config.SetDefaultValue("MorphCacheSize", 128);
+	config.SetDefaultValue("BuildMemoryLimit", 0);
+}
+
+void OutfitBuilder::ApplyConfig(ConfigurationManager& config, long threadCount) {
+	// Outfits built at the same time are limited by their estimated memory, so 32-bit builds can use multiple threads as well
+	if (threadCount < 0)
+		threadCount = config.GetIntValue("BuildThreads");
+	if (threadCount < 0)
+		threadCount = 1;
+
+	ThreadPool::Get().SetThreadCount(threadCount);
+
+	// Diff data shared between outfits of a batch build, in MB
+	int diffCacheSize = config.GetIntValue("DiffCacheSize");
+	if (sizeof(void*) < 8)
+		diffCacheSize = std::min(diffCacheSize, 128);
+
+	DiffDataCache::Get().SetMemoryLimit((size_t)std::max(diffCacheSize, 0) * 1024 * 1024);
+	DiffDataCache::Get().SetHalfPrecision(config.GetBoolValue("HalfPrecisionDiffs"));
+
+	// Combined slider diffs reused by repeated builds of the same values, in MB
+	int morphCacheSize = config.GetIntValue("MorphCacheSize");
+	MorphCache::Get().SetMemoryLimit((size_t)std::max(morphCacheSize, 0) * 1024 * 1024);
+}
+
+float OutfitBuilder::GetSliderValue(SliderData& slider, bool big, const std::string& preset) {
+	float value = 0.0f;
+	if (big)
+		value = sliderManager.GetBigPresetValue(preset, slider.name, slider.defBigValue / 100.0f);
+	else
+		value = sliderManager.GetSmallPresetValue(preset, slider.name, slider.defSmallValue / 100.0f);
+
+	// Slider values changed in the user interface override the preset
+	auto& changed = big ? changedBig : changedSmall;
+	auto it = changed.find(slider.name);
+	if (it != changed.end())
+		value = it->second;
+
+	return value;
+}
+
+void OutfitBuilder::ApplyZapToggles(SliderSet& sliderSet, const std::string& preset) {
+	for (size_t s = 0; s < sliderSet.size(); s++) {
+		if (sliderSet[s].bClamp)
+			continue;
+
+		if (sliderSet[s].bZap && !sliderSet[s].bUV) {
+			float vbig = GetSliderValue(sliderSet[s], true, preset);
+
+			if (!sliderSet[s].bHidden) {
+				// Apply stored zap choice for zaps visible to the user
+				if (buildSelection.HasZapChoice(sliderSet.GetName(), sliderSet[s].name)) {
+					bool zapChoice = buildSelection.GetZapChoice(sliderSet.GetName(), sliderSet[s].name);
+					vbig = zapChoice ? 1.0f : 0.0f;
+				}
+			}
+
+			// Apply zap toggles if zap is not in default state
+			if (vbig != sliderSet[s].defBigValue / 100.0f) {
+				for (auto& zapToggle : sliderSet[s].zapToggles) {
+					// Toggled zap default values are read in later code if no preset overwrites it
+					auto& slider = sliderSet[zapToggle];
+					slider.defBigValue = 100.0f - slider.defBigValue;
+					slider.defSmallValue = 100.0f - slider.defSmallValue;
+				}
+			}
+		}
+	}
+}
+
+void OutfitBuilder::ResolveSliderValues(SliderSet& sliderSet, const std::string& preset, std::vector<ResolvedSliderValue>& outValues) {
+	outValues.resize(sliderSet.size());
+
+	for (size_t s = 0; s < sliderSet.size(); s++) {
+		auto& slider = sliderSet[s];
+		auto& value = outValues[s];
+
+		value.big = GetSliderValue(slider, true, preset);
+		if (sliderSet.GenWeights())
+			value.small = GetSliderValue(slider, false, preset);
+
+		if (slider.bInvert) {
+			value.big = 1.0f - value.big;
+			if (sliderSet.GenWeights())
+				value.small = 1.0f - value.small;
+		}
+
+		value.uv = slider.bUV;
+		value.zap = slider.bZap && !slider.bUV;
+
+		// Apply stored zap choice for zaps visible to the user
+		if (value.zap && !slider.bHidden && buildSelection.HasZapChoice(sliderSet.GetName(), slider.name)) {
+			bool zapChoice = buildSelection.GetZapChoice(sliderSet.GetName(), slider.name);
+			value.big = zapChoice ? 1.0f : 0.0f;
+		}
+
+		if (slider.bClamp) {
+			value.clampBig = slider.defBigValue > 0;
+			value.clampSmall = sliderSet.GenWeights() && slider.defSmallValue > 0;
+		}
+	}
+}
+
+uint64_t OutfitBuilder::HashInputs(SliderSet& sliderSet, const std::vector<ResolvedSliderValue>& sliderValues) {
+	BuildHash hash;
+	hash.Add(BuildManifestVersion);
+
+	std::string setData;
+	SliderSetIndex::WriteSet(sliderSet, setData);
+	hash.Add(setData);
+
+	std::set<std::string> inputFiles;
+	sliderSet.GetDataFilePaths(inputFiles);
+	inputFiles.insert(sliderSet.GetInputFileName());
+
+	for (auto& inputFile : inputFiles) {
+		uint64_t fileHash = 0;
+		bool exists = options.manifest->HashFile(inputFile, fileHash);
+
+		hash.Add(inputFile);
+		hash.Add(exists);
+		hash.Add(fileHash);
+	}
+
+	// Reference normals replace the calculated normals of shapes that have a file, see RefNormalsCache
+	if (options.forceNormals) {
+		for (auto shape = sliderSet.ShapesBegin(); shape != sliderSet.ShapesEnd(); ++shape) {
+			std::string refNormalsFile = options.appDir + "/RefNormals/" + shape->first + ".nif";
+
+			uint64_t fileHash = 0;
+			bool exists = options.manifest->HashFile(refNormalsFile, fileHash);
+
+			hash.Add(refNormalsFile);
+			hash.Add(exists);
+			hash.Add(fileHash);
+		}
+	}
+
+	for (auto& value : sliderValues) {
+		hash.Add(value.big);
+		hash.Add(value.small);
+		hash.Add(value.zap);
+		hash.Add(value.clampBig);
+		hash.Add(value.clampSmall);
+	}
+
+	hash.Add(options.tri);
+	hash.Add(options.forceNormals);
+	hash.Add(options.triOnRoot);
+
+	// Half precision diffs can move vertices slightly
+	hash.Add(DiffDataCache::Get().GetHalfPrecision());
+	return hash.Get();
+}
+
+void OutfitBuilder::Finish(OutfitBuildJob& job, OutfitBuildStatus status, const wxString& error) {
+	if (options.manifest) {
+		const std::string& dataPath = options.targets[job.result.target].dataPath;
+		if (status == OutfitBuildStatus::Built && !job.partial)
+			options.manifest->SetBuilt(job.result.outfit, dataPath, job.inputHash, job.result.outputFiles);
+		else if (status != OutfitBuildStatus::UpToDate)
+			options.manifest->Remove(job.result.outfit, dataPath);
+	}
+
+	job.result.status = status;
+	job.result.error = error.ToUTF8();
+	job.finished = true;
+	job.source.reset();
+	job.memory.reset();
+}
+
+void OutfitBuilder::RunStage(const std::vector<OutfitBuildJob*>& jobs, const std::function<void()>& stage) {
+	auto startTime = std::chrono::steady_clock::now();
+
+	try {
+		stage();
+	}
+	catch (const std::exception& e) {
+		for (auto job : jobs)
+			if (!job->finished)
+				Finish(*job, OutfitBuildStatus::Failed, wxString::Format(_("Unexpected exception: %s"), e.what()));
+	}
+
+	// Only the time spent in stages is counted, not the time waiting in queues
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	for (auto job : jobs)
+		job->result.seconds += seconds / jobs.size();
+}
+
+void OutfitBuilder::GetInputSizes(SliderSet& sliderSet, uint64_t& outNifSize, uint64_t& outDataSize) {
+	int64_t size = 0;
+	int64_t time = 0;
+
+	outNifSize = 0;
+	if (PlatformUtil::GetFileStamp(sliderSet.GetInputFileName(), size, time))
+		outNifSize = size;
+
+	outDataSize = 0;
+
+	std::set<std::string> dataFiles;
+	sliderSet.GetDataFilePaths(dataFiles);
+	for (auto& dataFile : dataFiles)
+		if (PlatformUtil::GetFileStamp(dataFile, size, time))
+			outDataSize += size;
+}
+
+size_t OutfitBuilder::EstimateMemory(SliderSet& sliderSet, size_t jobCount, uint64_t nifSize, uint64_t dataSize) {
+	// Vertex counts aren't known before parsing, the file sizes stand in for them.
+	// Parsed NIF files take about three times their file size, parsed diffs about four times (hash map entries of 14 byte diffs).
+	uint64_t nifCount = jobCount * (sliderSet.GenWeights() ? 2 : 1);
+	if (jobCount > 1)
+		nifCount++; // Template copied by the jobs
+
+	uint64_t bytes = nifSize + nifSize * 3 * nifCount + dataSize * 4;
+
+	// TRI morphs hold another copy of the diffs of each job
+	if (options.tri)
+		bytes += dataSize * 4 * jobCount;
+
+	return (size_t)std::min<uint64_t>(bytes, std::numeric_limits<size_t>::max());
+}
+
+void OutfitBuilder::CreateJobs(const std::string& outfit, const std::string& sourceFile, std::vector<std::unique_ptr<OutfitBuildJob>>& outJobs) {
+	for (size_t t = 0; t < options.targets.size(); t++) {
+		auto job = std::make_unique<OutfitBuildJob>();
+		job->result.outfit = outfit;
+		job->result.target = t;
+		job->sourceFile = sourceFile;
+		outJobs.push_back(std::move(job));
+	}
+}
+
+wxString OutfitBuilder::LoadSet(const std::string& outfit, const std::string& sourceFile, SliderSet& outSliderSet) {
+	if (options.sliderSetIndex) {
+		int error = options.sliderSetIndex->GetSet(sourceFile, outfit, outSliderSet);
+		if (error == 1)
+			return _("Unable to get slider set from file: ") + sourceFile;
+		else if (error)
+			return _("Unable to open slider set file: ") + sourceFile;
+	}
+	else {
+		SliderSetFile sliderDoc;
+		sliderDoc.Open(sourceFile);
+		if (sliderDoc.fail())
+			return _("Unable to open slider set file: ") + sourceFile;
+
+		if (sliderDoc.GetSet(outfit, outSliderSet))
+			return _("Unable to get slider set from file: ") + sourceFile;
+	}
+
+	return wxEmptyString;
+}
+
+void OutfitBuilder::Prefetch(const std::vector<OutfitBuildJob*>& jobs) {
+	auto finishAll = [&](OutfitBuildStatus status, const wxString& error) {
+		for (auto job : jobs)
+			Finish(*job, status, error);
+	};
+
+	const std::string& outfit = jobs.front()->result.outfit;
+	const std::string& sourceFile = jobs.front()->sourceFile;
+
+	/* Load set */
+	SliderSet baseSet;
+	BuildStats setStats;
+	wxString error;
+
+	{
+		ScopedStageTimer timer(setStats, BuildStage::ParseSet);
+		error = LoadSet(outfit, sourceFile, baseSet);
+	}
+
+	for (size_t j = 0; j < jobs.size(); j++)
+		jobs[j]->result.stats.Add(setStats, jobs.size(), j);
+
+	if (!error.empty())
+		return finishAll(OutfitBuildStatus::Failed, error);
+
+	baseSet.SetBaseDataPath(options.projectPath + PathSepStr + "ShapeData");
+
+	std::vector<OutfitBuildJob*> buildJobs;
+
+	for (auto job : jobs) {
+		SliderSet& currentSet = job->sliderSet;
+		currentSet = baseSet;
+
+		const OutfitBuildTarget& target = options.targets[job->result.target];
+		const std::string& datapath = target.dataPath;
+
+		if (options.clean) {
+			bool genWeights = currentSet.GenWeights();
+
+			wxString removePath = wxString::FromUTF8(datapath + currentSet.GetOutputFilePath());
+			wxString removeHigh = removePath + ".nif";
+			if (genWeights)
+				removeHigh = removePath + "_1.nif";
+
+			if (wxFileName::FileExists(removeHigh) && wxRemoveFile(removeHigh))
+				job->result.outputFiles.push_back(removeHigh.ToUTF8().data());
+
+			if (genWeights) {
+				wxString removeLow = removePath + "_0.nif";
+				if (wxFileName::FileExists(removeLow) && wxRemoveFile(removeLow))
+					job->result.outputFiles.push_back(removeLow.ToUTF8().data());
+			}
+
+			Finish(*job, OutfitBuildStatus::Cleaned);
+			continue;
+		}
+
+		job->result.stats.sliders = currentSet.size();
+
+		// Zap toggles change slider defaults, so they're applied before resolving the values
+		ApplyZapToggles(currentSet, target.preset);
+		ResolveSliderValues(currentSet, target.preset, job->sliderValues);
+
+		if (options.manifest) {
+			job->inputHash = HashInputs(currentSet, job->sliderValues);
+
+			if (!options.rebuildAll && options.manifest->IsUpToDate(outfit, datapath, job->inputHash)) {
+				Finish(*job, OutfitBuildStatus::UpToDate);
+				continue;
+			}
+		}
+
+		job->triKeep = currentSet.PreventMorphFile();
+
+		if (options.tri && !job->triKeep) {
+			std::string triFilePath = datapath + currentSet.GetOutputFilePath() + ".tri";
+
+			// TRI file already exists but isn't a body TRI file, don't overwrite!
+			if (wxFileName::FileExists(wxString::FromUTF8(triFilePath)) && !IsBodyTriFile(triFilePath))
+				job->triKeep = true;
+		}
+
+		buildJobs.push_back(job);
+	}
+
+	if (buildJobs.empty())
+		return;
+
+	uint64_t nifSize = 0;
+	uint64_t dataSize = 0;
+	GetInputSizes(baseSet, nifSize, dataSize);
+
+	// Waits until enough memory is available, the jobs return it once they're finished
+	auto memory = memoryBudget.Acquire(EstimateMemory(baseSet, buildJobs.size(), nifSize, dataSize));
+
+	/* Read input NIF and diff data, shared by all targets */
+	auto source = std::make_shared<OutfitSourceData>();
+	source->jobCount = buildJobs.size();
+
+	BuildStats sourceStats;
+	bool nifRead = false;
+
+	{
+		ScopedStageTimer timer(sourceStats, BuildStage::LoadNif);
+
+		std::fstream file;
+		PlatformUtil::OpenFileStream(file, baseSet.GetInputFileName(), std::ios::in | std::ios::binary);
+		if (file) {
+			std::stringstream nifData;
+			nifData << file.rdbuf();
+			source->nifData = nifData.str();
+			sourceStats.bytesRead += source->nifData.size();
+			nifRead = true;
+		}
+	}
+
+	if (nifRead) {
+		ScopedStageTimer timer(sourceStats, BuildStage::LoadDiffs);
+
+		// Zap toggles only change slider values, the data files are the same for all targets
+		baseSet.LoadSetDiffData(source->diffs, "", true);
+
+		for (auto it = baseSet.ShapesBegin(); it != baseSet.ShapesEnd(); ++it) {
+			const std::string& target = it->second.targetShape;
+			std::vector<DiffHandle>& shapeHandles = source->diffHandles[it->first];
+			shapeHandles.reserve(baseSet.size());
+
+			for (size_t s = 0; s < baseSet.size(); s++) {
+				std::string dn = baseSet[s].TargetDataName(target);
+				shapeHandles.push_back(dn.empty() ? InvalidDiffHandle : source->diffs.Resolve(dn, target));
+			}
+		}
+
+		// Data files count as read even if they were cached by a previous build
+		sourceStats.bytesRead += dataSize;
+	}
+
+	for (size_t j = 0; j < buildJobs.size(); j++) {
+		OutfitBuildJob* job = buildJobs[j];
+		job->result.stats.Add(sourceStats, buildJobs.size(), j);
+		job->memory = memory;
+
+		if (nifRead)
+			job->source = source;
+		else
+			Finish(*job, OutfitBuildStatus::Failed, _("Unable to load input nif: ") + baseSet.GetInputFileName());
+	}
+}
+
+void OutfitBuilder::Compute(OutfitBuildJob& job) {
+	SliderSet& currentSet = job.sliderSet;
+	OutfitSourceData& source = *job.source;
+	DiffDataSets& currentDiffs = source.diffs;
+	auto& sliderValues = job.sliderValues;
+	BuildStats& stats = job.result.stats;
+
+	/* Load input NIFs */
+	NifFile& nifBig = job.nifBig;
+	NifFile& nifSmall = job.nifSmall;
+
+	{
+		ScopedStageTimer timer(stats, BuildStage::LoadNif);
+
+		if (source.jobCount == 1) {
+			std::istringstream file(source.nifData);
+			std::string().swap(source.nifData);
+
+			if (nifBig.Load(file))
+				return Finish(job, OutfitBuildStatus::Failed, _("Unable to load input nif: ") + currentSet.GetInputFileName());
+		}
+		else {
+			// The first job parses the NIF, all jobs copy it
+			std::call_once(source.nifParsed, [&source] {
+				std::istringstream file(source.nifData);
+				std::string().swap(source.nifData);
+				source.nifLoaded = source.nif.Load(file) == 0;
+			});
+
+			if (!source.nifLoaded)
+				return Finish(job, OutfitBuildStatus::Failed, _("Unable to load input nif: ") + currentSet.GetInputFileName());
+
+			nifBig.CopyFrom(source.nif);
+		}
+
+		if (currentSet.GenWeights())
+			nifSmall.CopyFrom(nifBig);
+	}
+
+	/* Shape the NIF files */
+	std::vector<Vector3> vertsLow;
+	std::vector<Vector3> vertsHigh;
+	std::vector<Vector2> uvsLow;
+	std::vector<Vector2> uvsHigh;
+	std::vector<DiffTerm> terms;
+	std::vector<bool> zapMask;
+	std::vector<uint16_t> zapIdx;
+	std::unordered_map<std::string, std::vector<uint16_t>>& zapIdxAll = job.zapIndices;
+
+	for (auto it = currentSet.ShapesBegin(); it != currentSet.ShapesEnd(); ++it) {
+		auto shapeHandles = source.diffHandles.find(it->first);
+		if (shapeHandles == source.diffHandles.end())
+			continue;
+
+		auto shape = nifBig.FindBlockByName<NiShape>(it->first);
+		if (!nifBig.GetVertsForShape(shape, vertsHigh))
+			continue;
+
+		nifBig.GetUvsForShape(shape, uvsHigh);
+
+		if (currentSet.GenWeights()) {
+			auto shapeSmall = nifSmall.FindBlockByName<NiShape>(it->first);
+			if (!nifSmall.GetVertsForShape(shapeSmall, vertsLow))
+				continue;
+
+			nifSmall.GetUvsForShape(shapeSmall, uvsLow);
+		}
+
+		zapIdxAll.emplace(it->first, std::vector<uint16_t>());
+		stats.vertices += vertsHigh.size();
+
+		{
+			ScopedStageTimer timer(stats, BuildStage::ApplyMorphs);
+
+			const std::vector<DiffHandle>& handles = shapeHandles->second;
+
+			terms.clear();
+			for (size_t s = 0; s < currentSet.size(); s++) {
+				DiffHandle handle = handles[s];
+				if (handle == InvalidDiffHandle)
+					continue;
+
+				auto& value = sliderValues[s];
+				DiffTerm term;
+				term.handle = handle;
+
+				if (value.zap) {
+					// Zaps only depend on the high value and apply to both weights
+					term.kind = DiffTermKind::Zap;
+					term.weight = value.big;
+					terms.push_back(term);
+					continue;
+				}
+
+				term.kind = value.uv ? DiffTermKind::UV : DiffTermKind::Vertex;
+				term.weight = value.big;
+				term.weightLow = value.small;
+				terms.push_back(term);
+
+				if (currentSet[s].bClamp) {
+					term.kind = DiffTermKind::Clamp;
+					term.weight = value.clampBig ? 1.0f : 0.0f;
+					term.weightLow = value.clampSmall ? 1.0f : 0.0f;
+					terms.push_back(term);
+				}
+			}
+
+			DiffEvalOutput high;
+			high.verts = &vertsHigh;
+			high.uvs = &uvsHigh;
+
+			DiffEvalOutput low;
+			if (currentSet.GenWeights()) {
+				low.verts = &vertsLow;
+				low.uvs = &uvsLow;
+			}
+
+			zapMask.assign(vertsHigh.size(), false);
+			currentDiffs.EvaluateCached(terms, high, low, &zapMask);
+
+			// Zap indices are 16-bit, zapped vertices beyond them are kept instead of deleting the wrong ones
+			const size_t zapLimit = std::min<size_t>(zapMask.size(), static_cast<size_t>(std::numeric_limits<uint16_t>::max()) + 1);
+			for (size_t i = 0; i < zapLimit; i++)
+				if (zapMask[i])
+					zapIdx.push_back(static_cast<uint16_t>(i));
+
+			const size_t skippedZaps = std::count(zapMask.begin() + zapLimit, zapMask.end(), true);
+			if (skippedZaps > 0)
+				wxLogWarning("Skipped %u zapped vertices of shape '%s' with vertex indices above 65535.", static_cast<unsigned int>(skippedZaps), it->first);
+
+			zapIdxAll[it->first] = zapIdx;
+		}
+
+		nifBig.SetVertsForShape(shape, vertsHigh);
+		nifBig.SetUvsForShape(shape, uvsHigh);
+
+		if (!it->second.lockNormals) {
+			{
+				ScopedStageTimer timer(stats, BuildStage::CalcNormals);
+				nifBig.CalcNormalsForShape(shape, options.forceNormals, it->second.smoothSeamNormals);
+			}
+
+			if (options.forceNormals) {
+				ScopedStageTimer timer(stats, BuildStage::RefNormals);
+				refNormals.Apply(nifBig, options.appDir);
+			}
+		}
+
+		{
+			ScopedStageTimer timer(stats, BuildStage::CalcTangents);
+			nifBig.CalcTangentsForShape(shape);
+		}
+
+		{
+			ScopedStageTimer timer(stats, BuildStage::DeleteZaps);
+			if (nifBig.DeleteVertsForShape(shape, zapIdx))
+				nifBig.DeleteShape(shape);
+		}
+
+		if (currentSet.GenWeights()) {
+			auto shapeSmall = nifSmall.FindBlockByName<NiShape>(it->first);
+			nifSmall.SetVertsForShape(shapeSmall, vertsLow);
+			nifSmall.SetUvsForShape(shapeSmall, uvsLow);
+
+			if (!it->second.lockNormals) {
+				{
+					ScopedStageTimer timer(stats, BuildStage::CalcNormals);
+					nifSmall.CalcNormalsForShape(shapeSmall, options.forceNormals, it->second.smoothSeamNormals);
+				}
+
+				if (options.forceNormals) {
+					ScopedStageTimer timer(stats, BuildStage::RefNormals);
+					refNormals.Apply(nifSmall, options.appDir);
+				}
+			}
+
+			{
+				ScopedStageTimer timer(stats, BuildStage::CalcTangents);
+				nifSmall.CalcTangentsForShape(shapeSmall);
+			}
+
+			{
+				ScopedStageTimer timer(stats, BuildStage::DeleteZaps);
+				if (nifSmall.DeleteVertsForShape(shapeSmall, zapIdx))
+					nifSmall.DeleteShape(shapeSmall);
+			}
+		}
+
+		zapIdx.clear();
+	}
+
+
+	/* Add TRI path for in-game morphs */
+	if (options.tri && !job.triKeep) {
+		bool triEnd = options.tri;
+		std::string triPath = currentSet.GetOutputFilePath() + ".tri";
+		std::string triPathTrimmed = triPath;
+		triPathTrimmed = std::regex_replace(triPathTrimmed, std::regex("/+|\\\\+"),
+											"\\"); // Replace multiple backslashes or forward slashes with one backslash
+		triPathTrimmed = std::regex_replace(triPathTrimmed,
+											std::regex(".*meshes\\\\", std::regex_constants::icase),
+											""); // Remove everything before and including the meshes path
+
+		{
+			ScopedStageTimer timer(stats, BuildStage::MorphTRI);
+			CreateMorphTRI(currentSet, currentDiffs, nifBig, zapIdxAll, job.tri);
+		}
+
+		if (!options.triOnRoot) {
+			for (auto targetShape = currentSet.ShapesBegin(); targetShape != currentSet.ShapesEnd(); ++targetShape) {
+				auto shape = nifBig.FindBlockByName<NiShape>(targetShape->first);
+				if (!shape)
+					continue;
+
+				if (triEnd && shape->GetNumVertices() > 0) {
+					AddTriData(nifBig, targetShape->first, triPathTrimmed);
+					if (currentSet.GenWeights())
+						AddTriData(nifSmall, targetShape->first, triPathTrimmed);
+
+					triEnd = false;
+				}
+			}
+		}
+		else {
+			AddTriData(nifBig, "", triPathTrimmed, true);
+			if (currentSet.GenWeights())
+				AddTriData(nifSmall, "", triPathTrimmed, true);
+		}
+
+		// Set all shapes to dynamic/mutable
+		for (auto it = currentSet.ShapesBegin(); it != currentSet.ShapesEnd(); ++it) {
+			nifBig.SetShapeDynamic(it->first);
+			if (currentSet.GenWeights())
+				nifSmall.SetShapeDynamic(it->first);
+		}
+	}
+
+	// Input data isn't needed by the writer, the last job of the outfit releases it
+	job.source.reset();
+}
+
+void OutfitBuilder::Write(OutfitBuildJob& job) {
+	SliderSet& currentSet = job.sliderSet;
+	BuildStats& stats = job.result.stats;
+	NifFile& nifBig = job.nifBig;
+	NifFile& nifSmall = job.nifSmall;
+
+	const std::string& datapath = options.targets[job.result.target].dataPath;
+
+	/* Create directory for the outfit */
+	wxString dir = wxString::FromUTF8(datapath + currentSet.GetOutputPath());
+	bool success = wxFileName::Mkdir(dir, wxS_DIR_DEFAULT, wxPATH_MKDIR_FULL);
+
+	if (!success)
+		return Finish(job, OutfitBuildStatus::Failed, _("Unable to create destination directory: ") + dir);
+
+	std::string outFileNameSmall = datapath + currentSet.GetOutputFilePath();
+	std::string outFileNameBig = outFileNameSmall;
+
+	wxString triError;
+	if (options.tri && !job.triKeep) {
+		std::string triFilePath = outFileNameBig + ".tri";
+
+		ScopedStageTimer timer(stats, BuildStage::MorphTRI);
+		if (job.tri.Write(triFilePath))
+			job.result.outputFiles.push_back(triFilePath);
+		else {
+			wxLogError("Failed to create TRI file to '%s'!", currentSet.GetOutputFilePath() + ".tri");
+			triError = _("Unable to save tri file: ") + triFilePath;
+			job.partial = true;
+		}
+	}
+	else if (!job.triKeep) {
+		std::string triPath = outFileNameBig + ".tri";
+		if (IsBodyTriFile(triPath))
+			wxRemoveFile(wxString::FromUTF8(triPath));
+	}
+
+	NifSaveOptions nifOptions;
+	nifOptions.optimize = false;
+
+	/* Set filenames for the outfit */
+	if (currentSet.GenWeights()) {
+		outFileNameSmall += "_0.nif";
+		outFileNameBig += "_1.nif";
+
+		ScopedStageTimer timer(stats, BuildStage::SaveNif);
+
+		std::fstream fileBig;
+		PlatformUtil::OpenFileStream(fileBig, outFileNameBig, std::ios::out | std::ios::binary);
+
+		if (nifBig.Save(fileBig, nifOptions))
+			return Finish(job, OutfitBuildStatus::Failed, _("Unable to save nif file: ") + outFileNameBig);
+
+		job.result.outputFiles.push_back(outFileNameBig);
+
+		std::fstream fileSmall;
+		PlatformUtil::OpenFileStream(fileSmall, outFileNameSmall, std::ios::out | std::ios::binary);
+
+		if (nifSmall.Save(fileSmall, nifOptions))
+			return Finish(job, OutfitBuildStatus::Failed, _("Unable to save nif file: ") + outFileNameSmall);
+
+		job.result.outputFiles.push_back(outFileNameSmall);
+	}
+	else {
+		outFileNameBig += ".nif";
+
+		ScopedStageTimer timer(stats, BuildStage::SaveNif);
+
+		std::fstream fileBig;
+		PlatformUtil::OpenFileStream(fileBig, outFileNameBig, std::ios::out | std::ios::binary);
+
+		if (nifBig.Save(fileBig, nifOptions))
+			return Finish(job, OutfitBuildStatus::Failed, _("Unable to save nif file: ") + outFileNameBig);
+
+		job.result.outputFiles.push_back(outFileNameBig);
+	}
+
+	for (auto& outputFile : job.result.outputFiles) {
+		int64_t size = 0;
+		int64_t time = 0;
+		if (PlatformUtil::GetFileStamp(outputFile, size, time))
+			stats.bytesWritten += size;
+	}
+
+	Finish(job, OutfitBuildStatus::Built, triError);
+}
+
+std::vector<OutfitBuildResult> OutfitBuilder::Build(const std::string& outfit, const std::string& sourceFile) {
+	std::vector<std::unique_ptr<OutfitBuildJob>> jobs;
+	CreateJobs(outfit, sourceFile, jobs);
+
+	std::vector<OutfitBuildJob*> jobPtrs;
+	for (auto& job : jobs)
+		jobPtrs.push_back(job.get());
+
+	RunStage(jobPtrs, [&] { Prefetch(jobPtrs); });
+
+	std::vector<OutfitBuildResult> results;
+	for (auto& job : jobs) {
+		if (!job->finished)
+			RunStage({job.get()}, [&] { Compute(*job); });
+		if (!job->finished)
+			RunStage({job.get()}, [&] { Write(*job); });
+
+		results.push_back(job->result);
+	}
+
+	return results;
+}
+
+void OutfitBuilder::BuildAll(const std::vector<std::pair<std::string, std::string>>& outfits, const std::function<void(const OutfitBuildResult&)>& onFinished) {
+	typedef std::unique_ptr<OutfitBuildJob> JobPtr;
+
+	// Bounded queues limit the number of outfits held in memory at once
+	size_t computeThreads = ThreadPool::Get().GetThreadCount();
+	size_t ioThreads = std::min<size_t>(computeThreads, 2);
+
+	BoundedQueue<JobPtr> computeQueue(computeThreads);
+	BoundedQueue<JobPtr> writeQueue(computeThreads);
+
+	// Largest outfits start first, so that none of them is left running alone at the end of the build
+	std::vector<size_t> order(outfits.size());
+	std::vector<size_t> estimates(outfits.size());
+
+	ThreadPool::Get().ParallelFor(outfits.size(), [&](size_t i) {
+		order[i] = i;
+
+		SliderSet sliderSet;
+		if (LoadSet(outfits[i].first, outfits[i].second, sliderSet).empty()) {
+			sliderSet.SetBaseDataPath(options.projectPath + PathSepStr + "ShapeData");
+
+			uint64_t nifSize = 0;
+			uint64_t dataSize = 0;
+			GetInputSizes(sliderSet, nifSize, dataSize);
+			estimates[i] = EstimateMemory(sliderSet, options.targets.size(), nifSize, dataSize);
+		}
+	});
+
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return estimates[a] > estimates[b]; });
+
+	/* Prefetch stage: read slider sets, input NIFs and diff data once per outfit */
+	std::atomic<size_t> nextOutfit = 0;
+	std::atomic<size_t> prefetchRunning = ioThreads;
+
+	std::vector<std::thread> prefetchThreads;
+	for (size_t t = 0; t < ioThreads; t++) {
+		prefetchThreads.emplace_back([&] {
+			for (size_t next = nextOutfit++; next < outfits.size(); next = nextOutfit++) {
+				size_t i = order[next];
+
+				std::vector<JobPtr> jobs;
+				CreateJobs(outfits[i].first, outfits[i].second, jobs);
+
+				std::vector<OutfitBuildJob*> jobPtrs;
+				for (auto& job : jobs)
+					jobPtrs.push_back(job.get());
+
+				RunStage(jobPtrs, [&] { Prefetch(jobPtrs); });
+
+				for (auto& job : jobs) {
+					if (job->finished)
+						onFinished(job->result);
+					else
+						computeQueue.Push(std::move(job));
+				}
+			}
+
+			if (--prefetchRunning == 0)
+				computeQueue.Close();
+		});
+	}
+
+	/* Write stage: save NIF and TRI files */
+	std::vector<std::thread> writeThreads;
+	for (size_t t = 0; t < ioThreads; t++) {
+		writeThreads.emplace_back([&] {
+			JobPtr job;
+			while (writeQueue.Pop(job)) {
+				RunStage({job.get()}, [&] { Write(*job); });
+				onFinished(job->result);
+				job.reset();
+			}
+		});
+	}
+
+	/* Compute stage: morph, normals, tangents and zaps */
+	// The loops block on the queue, so they run on their own threads instead of as pool tasks.
+	// Any thread waiting in ParallelFor may run queued pool tasks, including the prefetch threads, which would then never return.
+	std::vector<std::thread> computeLoops;
+	for (size_t t = 0; t < computeThreads; t++) {
+		computeLoops.emplace_back([&] {
+			JobPtr job;
+			while (computeQueue.Pop(job)) {
+				RunStage({job.get()}, [&] { Compute(*job); });
+				if (job->finished)
+					onFinished(job->result);
+				else
+					writeQueue.Push(std::move(job));
+
+				job.reset();
+			}
+		});
+	}
+
+	for (auto& t : computeLoops)
+		t.join();
+
+	writeQueue.Close();
+
+	for (auto& t : prefetchThreads)
+		t.join();
+
+	for (auto& t : writeThreads)
+		t.join();
+}
+
+void OutfitBuilder::CreateMorphTRI(SliderSet& sliderSet,
+								   DiffDataSets& diffs,
+								   NifFile& nif,
+								   std::unordered_map<std::string, std::vector<uint16_t>>& zapIndices,
+								   TriFile& outTri) {
+	for (auto targetShape = sliderSet.ShapesBegin(); targetShape != sliderSet.ShapesEnd(); ++targetShape) {
+		auto shape = nif.FindBlockByName<NiShape>(targetShape->first);
+		if (!shape)
+			continue;
+
+		const std::vector<uint16_t>& shapeZapIndices = zapIndices[targetShape->first];
+
+		int shapeVertCount = shape->GetNumVertices();
+		shapeVertCount += shapeZapIndices.size();
+
+		if (shapeVertCount <= 0)
+			continue;
+
+		if (shapeZapIndices.size() > 0 && shapeZapIndices.back() >= shapeVertCount)
+			continue;
+
+		for (size_t s = 0; s < sliderSet.size(); s++) {
+			std::string dn = sliderSet[s].TargetDataName(targetShape->second.targetShape);
+			std::string target = targetShape->second.targetShape;
+			if (dn.empty())
+				continue;
+
+			if (!sliderSet[s].bClamp && !sliderSet[s].bZap) {
+				MorphDataPtr morph = std::make_shared<MorphData>();
+				morph->name = sliderSet[s].name;
+
+				if (sliderSet[s].bUV) {
+					morph->type = MORPHTYPE_UV;
+
+					std::vector<Vector2> uvs;
+					uvs.resize(shapeVertCount);
+
+					diffs.ApplyUVDiff(dn, target, 1.0f, &uvs);
+
+					for (int i = shapeZapIndices.size() - 1; i >= 0; i--)
+						uvs.erase(uvs.begin() + shapeZapIndices[i]);
+
+					int i = 0;
+					for (auto& uv : uvs) {
+						Vector3 v(uv.u, uv.v, 0.0f);
+						if (!v.IsZero(true))
+							morph->offsets.emplace(i, v);
+						i++;
+					}
+				}
+				else {
+					morph->type = MORPHTYPE_POSITION;
+
+					std::vector<Vector3> verts;
+					verts.resize(shapeVertCount);
+
+					diffs.ApplyDiff(dn, target, 1.0f, &verts);
+
+					for (int i = shapeZapIndices.size() - 1; i >= 0; i--)
+						verts.erase(verts.begin() + shapeZapIndices[i]);
+
+					int i = 0;
+					for (auto& v : verts) {
+						if (!v.IsZero(true))
+							morph->offsets.emplace(i, v);
+						i++;
+					}
+				}
+
+				if (morph->offsets.size() > 0)
+					outTri.AddMorph(targetShape->first, morph);
+			}
+		}
+	}
+}
+
+bool OutfitBuilder::WriteMorphTRI(const std::string& triPath,
+								  SliderSet& sliderSet,
+								  NifFile& nif,
+								  std::unordered_map<std::string, std::vector<uint16_t>>& zapIndices) {
+	DiffDataSets currentDiffs;
+	sliderSet.LoadSetDiffData(currentDiffs, "", true);
+
+	TriFile tri;
+	CreateMorphTRI(sliderSet, currentDiffs, nif, zapIndices, tri);
+
+	return tri.Write(triPath + ".tri");
+}
+
+void OutfitBuilder::AddTriData(NifFile& nif, const std::string& shapeName, const std::string& triPath, bool toRoot) {
+	NiAVObject* target = nullptr;
+
+	if (toRoot)
+		target = nif.GetRootNode();
+	else
+		target = nif.FindBlockByName<NiShape>(shapeName);
+
+	if (target) {
+		auto triExtraData = std::make_unique<NiStringExtraData>();
+		triExtraData->name.get() = "BODYTRI";
+		triExtraData->stringData.get() = triPath;
+		nif.AssignExtraData(target, std::move(triExtraData));
+	}
+}
@@ -0,0 +1,208 @@
+/*
+BodySlide and Outfit Studio
+See the included LICENSE file
+*/
+
+#pragma once
+
+#include "BuildManifest.h"
+#include "BuildStats.h"
+#include "SliderSetIndex.h"
+#include "BuildSelection.h"
+#include "SliderManager.h"
+#include "../files/TriFile.h"
+#include "../utils/MemoryBudget.h"
+#include "../utils/StringStuff.h"
+#include "NifFile.hpp"
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <wx/string.h>
+
+class ConfigurationManager;
+
+enum class OutfitBuildStatus { Built, UpToDate, Cleaned, Skipped, Failed };
+
+struct OutfitBuildResult {
+	std::string outfit;
+	OutfitBuildStatus status = OutfitBuildStatus::Failed;
+	std::string error; // Also set for built outfits with missing output files, see IsIncomplete
+	std::vector<std::string> outputFiles;
+	double seconds = 0.0;
+	size_t target = 0; // Index into OutfitBuildOptions::targets
+	BuildStats stats;
+
+	// Built, but some output files couldn't be written
+	bool IsIncomplete() const { return status == OutfitBuildStatus::Built && !error.empty(); }
+};
+
+struct OutfitBuildTarget {
+	std::string preset;	  // Preset used for slider values
+	std::string dataPath; // Output root, including the trailing path separator
+};
+
+struct OutfitBuildOptions {
+	std::string dataPath;	 // Output root, including the trailing path separator
+	std::string projectPath; // Folder containing "ShapeData"
+	std::string appDir;		 // Folder containing "RefNormals" and "BuildSelection.xml"
+	std::string preset;		 // Preset used for slider values
+	bool clean = false;		 // Remove the output files instead of building them
+	bool tri = false;
+	bool forceNormals = false;
+	bool triOnRoot = false; // Fallout 4 and 76 store the TRI path on the root node
+
+	BuildManifest* manifest = nullptr; // Records input hashes of built outfits if set
+	bool rebuildAll = false;		   // Builds outfits that are up to date according to the manifest as well
+
+	SliderSetIndex* sliderSetIndex = nullptr; // Slider sets are read from the index instead of their XML files if set
+
+	size_t memoryLimit = 0; // Estimated memory in bytes of outfits built at the same time, 0 = unlimited
+
+	// Presets and output roots built from the same loaded data, each outfit is read once and built for every target.
+	// If empty, preset and dataPath are the only target.
+	std::vector<OutfitBuildTarget> targets;
+};
+
+// Reference normals loaded from "RefNormals" in the application folder.
+// Files are only loaded once and shared by all threads of a batch build.
+class RefNormalsCache {
+	std::map<std::string, nifly::NifFile, case_insensitive_compare> cache;
+	std::mutex cacheMutex;
+
+public:
+	void Apply(nifly::NifFile& nif, const std::string& appDir);
+	void Clear();
+};
+
+// Final slider values of a set, resolved once per build from the preset, user interface and zap choices
+struct ResolvedSliderValue {
+	float big = 0.0f;
+	float small = 0.0f;
+	bool zap = false;		 // Vertices of the slider are removed if big > 0
+	bool uv = false;
+	bool clampBig = false;	 // Clamp slider applied to the high weight mesh
+	bool clampSmall = false; // Clamp slider applied to the low weight mesh
+};
+
+// Input data of an outfit, read once and shared by the jobs of all targets
+struct OutfitSourceData {
+	std::string nifData; // Contents of the input NIF file, released once parsed
+	size_t jobCount = 0;
+
+	// Parsed input NIF, copied by each job if there's more than one
+	nifly::NifFile nif;
+	bool nifLoaded = false;
+	std::once_flag nifParsed;
+
+	// Only read by the jobs, so it's safe to use from several threads at once
+	DiffDataSets diffs;
+	// Per shape, handle of the data of each slider or InvalidDiffHandle. Resolved before the jobs start.
+	std::unordered_map<std::string, std::vector<DiffHandle>> diffHandles;
+};
+
+// State of a single outfit and target passed between the build stages
+struct OutfitBuildJob {
+	OutfitBuildResult result;
+	std::string sourceFile;
+	bool finished = false; // Result is final, remaining stages are skipped
+
+	SliderSet sliderSet;
+	std::vector<ResolvedSliderValue> sliderValues;
+	uint64_t inputHash = 0;
+	bool triKeep = false; // Existing TRI file is kept
+	bool partial = false; // Built with missing output files, not recorded in the manifest so the next build retries
+
+	/* Prefetch */
+	std::shared_ptr<OutfitSourceData> source;
+	std::shared_ptr<MemoryBudget::Reservation> memory; // Shared by the jobs of the outfit
+
+	/* Compute */
+	nifly::NifFile nifBig;
+	nifly::NifFile nifSmall;
+	std::unordered_map<std::string, std::vector<uint16_t>> zapIndices;
+	TriFile tri;
+};
+
+// Builds outfits from their slider sets without any user interface.
+// Used by batch builds in BodySlide and the command-line builder.
+class OutfitBuilder {
+	SliderManager& sliderManager;
+	OutfitBuildOptions options;
+	BuildSelection buildSelection;
+	RefNormalsCache refNormals;
+	MemoryBudget memoryBudget;
+
+	// Slider values changed in the user interface, they override the preset
+	std::map<std::string, float> changedBig;
+	std::map<std::string, float> changedSmall;
+
+	float GetSliderValue(SliderData& slider, bool big, const std::string& preset);
+	void ApplyZapToggles(SliderSet& sliderSet, const std::string& preset);
+	void ResolveSliderValues(SliderSet& sliderSet, const std::string& preset, std::vector<ResolvedSliderValue>& outValues);
+
+	// Hash of everything the build output depends on: set definition, data files, input NIF, slider values, zap choices and options.
+	uint64_t HashInputs(SliderSet& sliderSet, const std::vector<ResolvedSliderValue>& sliderValues);
+
+	void Finish(OutfitBuildJob& job, OutfitBuildStatus status, const wxString& error = wxEmptyString);
+	// Runs a stage for jobs of the same outfit and splits its duration between their results. Exceptions fail the unfinished jobs.
+	void RunStage(const std::vector<OutfitBuildJob*>& jobs, const std::function<void()>& stage);
+
+	// Reads a slider set from the index or its file. Returns an error message on failure.
+	wxString LoadSet(const std::string& outfit, const std::string& sourceFile, SliderSet& outSliderSet);
+
+	// Sizes of the input NIF and of all data files of a set
+	void GetInputSizes(SliderSet& sliderSet, uint64_t& outNifSize, uint64_t& outDataSize);
+	// Rough peak memory of building an outfit for a number of targets
+	size_t EstimateMemory(SliderSet& sliderSet, size_t jobCount, uint64_t nifSize, uint64_t dataSize);
+
+	// Creates the jobs of an outfit, one per target.
+	void CreateJobs(const std::string& outfit, const std::string& sourceFile, std::vector<std::unique_ptr<OutfitBuildJob>>& outJobs);
+
+	// Reads the slider set, input NIF and diff data once for the jobs of an outfit. Clean builds and up-to-date targets finish here.
+	void Prefetch(const std::vector<OutfitBuildJob*>& jobs);
+	// Applies the sliders, calculates normals and tangents, removes zapped vertices and creates the TRI morphs.
+	void Compute(OutfitBuildJob& job);
+	// Writes the NIF and TRI files.
+	void Write(OutfitBuildJob& job);
+
+public:
+	OutfitBuilder(SliderManager& sliderManager, const OutfitBuildOptions& options);
+
+	const OutfitBuildOptions& GetOptions() const { return options; }
+
+	// Memory limit of a batch build from a configured value in MB. 0 or less = three quarters of the currently free memory.
+	static size_t GetMemoryLimit(int limitMB);
+
+	// Sets the defaults of the build settings, shared by BodySlide and the command-line builder.
+	static void SetDefaultConfig(ConfigurationManager& config);
+	// Sets up the thread pool and the diff and morph caches from the build settings.
+	// threadCount overrides the BuildThreads setting if it's not negative.
+	static void ApplyConfig(ConfigurationManager& config, long threadCount = -1);
+
+	// Builds a single outfit for all targets, the slider set is read from its source file.
+	// May be called from multiple threads at once.
+	std::vector<OutfitBuildResult> Build(const std::string& outfit, const std::string& sourceFile);
+
+	// Builds a list of outfits (name, source file) as a pipeline: reading, computing and writing of different outfits overlap.
+	// Computation runs on the thread pool, reading and writing on separate threads. onFinished is called from any of these threads,
+	// once for each outfit and target.
+	void BuildAll(const std::vector<std::pair<std::string, std::string>>& outfits, const std::function<void(const OutfitBuildResult&)>& onFinished);
+
+	// Creates TRI morphs of all sliders of the set. Zapped vertices are removed from the morphs.
+	static void CreateMorphTRI(SliderSet& sliderSet,
+							   DiffDataSets& diffs,
+							   nifly::NifFile& nif,
+							   std::unordered_map<std::string, std::vector<uint16_t>>& zapIndices,
+							   TriFile& outTri);
+
+	// Writes a TRI file with all sliders of the set as morphs. Zapped vertices are removed from the morphs.
+	static bool WriteMorphTRI(const std::string& triPath,
+							  SliderSet& sliderSet,
+							  nifly::NifFile& nif,
+							  std::unordered_map<std::string, std::vector<uint16_t>>& zapIndices);
+
+	// Adds the BODYTRI extra data pointing to the TRI file to a shape or the root node.
+	static void AddTriData(nifly::NifFile& nif, const std::string& shapeName, const std::string& triPath, bool toRoot = false);
+};
@@ -0,0 +1,242 @@
+/*
+BodySlide and Outfit Studio
+See the included LICENSE file
+*/
+
+#include "PackedDiffSet.h"
+
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define PACKEDDIFF_SSE
+#include <xmmintrin.h>
+#endif
+
+using namespace nifly;
+
+static_assert(sizeof(Vector3) == sizeof(float) * 3, "Vector3 must consist of three packed floats");
+static_assert(sizeof(Vector2) == sizeof(float) * 2, "Vector2 must consist of two packed floats");
+
+#ifdef PACKEDDIFF_SSE
+namespace {
+// Converts four x, y and z values to four consecutive Vector3 (12 floats)
+inline void InterleaveXYZ(__m128 vx, __m128 vy, __m128 vz, __m128& out0, __m128& out1, __m128& out2) {
+	__m128 xyLow = _mm_unpacklo_ps(vx, vy);	 // x0 y0 x1 y1
+	__m128 xyHigh = _mm_unpackhi_ps(vx, vy); // x2 y2 x3 y3
+
+	__m128 z0x1 = _mm_shuffle_ps(vz, xyLow, _MM_SHUFFLE(3, 2, 0, 0));	  // z0 z0 x1 y1
+	out0 = _mm_shuffle_ps(xyLow, z0x1, _MM_SHUFFLE(2, 0, 1, 0));		  // x0 y0 z0 x1
+	__m128 y1z1 = _mm_shuffle_ps(xyLow, vz, _MM_SHUFFLE(1, 1, 3, 3));	  // y1 y1 z1 z1
+	out1 = _mm_shuffle_ps(y1z1, xyHigh, _MM_SHUFFLE(1, 0, 2, 0));		  // y1 z1 x2 y2
+	__m128 z2x3 = _mm_shuffle_ps(vz, xyHigh, _MM_SHUFFLE(2, 2, 2, 2));	  // z2 z2 x3 x3
+	__m128 x3z3 = _mm_shuffle_ps(xyHigh, vz, _MM_SHUFFLE(3, 3, 3, 2));	  // x3 y3 z3 z3
+	out2 = _mm_shuffle_ps(z2x3, x3z3, _MM_SHUFFLE(2, 1, 2, 0));			  // z2 x3 y3 z3
+}
+} // namespace
+#endif
+
+namespace {
+// Adds the diffs from position first to last to one or, with Dual, two results
+template<bool Dual, typename Index, typename Value>
+void ApplyDiffs(const PackedDiffView<Index, Value>& view, size_t first, size_t last, float percent, Vector3* inOutResult, float percentLow, Vector3* inOutLow) {
+	const Index* indices = view.indices;
+	size_t i = first;
+
+#ifdef PACKEDDIFF_SSE
+	if constexpr (std::is_same_v<Value, float>) {
+		const float* x = view.x;
+		const float* y = view.y;
+		const float* z = view.z;
+		const __m128 scale = _mm_set1_ps(percent);
+		const __m128 scaleLow = _mm_set1_ps(percentLow);
+		while (i + 4 <= last) {
+			// Indices are unique and ascending, so four of them spanning three are consecutive
+			if (indices[i + 3] - indices[i] != 3u) {
+				const Vector3 diff(x[i], y[i], z[i]);
+				inOutResult[indices[i]] += diff * percent;
+				if constexpr (Dual)
+					inOutLow[indices[i]] += diff * percentLow;
+
+				i++;
+				continue;
+			}
+
+			// Interleaved once, then scaled for each result
+			__m128 diff0, diff1, diff2;
+			InterleaveXYZ(_mm_loadu_ps(&x[i]), _mm_loadu_ps(&y[i]), _mm_loadu_ps(&z[i]), diff0, diff1, diff2);
+
+			float* result = &inOutResult[indices[i]].x;
+			_mm_storeu_ps(result, _mm_add_ps(_mm_loadu_ps(result), _mm_mul_ps(diff0, scale)));
+			_mm_storeu_ps(result + 4, _mm_add_ps(_mm_loadu_ps(result + 4), _mm_mul_ps(diff1, scale)));
+			_mm_storeu_ps(result + 8, _mm_add_ps(_mm_loadu_ps(result + 8), _mm_mul_ps(diff2, scale)));
+
+			if constexpr (Dual) {
+				float* low = &inOutLow[indices[i]].x;
+				_mm_storeu_ps(low, _mm_add_ps(_mm_loadu_ps(low), _mm_mul_ps(diff0, scaleLow)));
+				_mm_storeu_ps(low + 4, _mm_add_ps(_mm_loadu_ps(low + 4), _mm_mul_ps(diff1, scaleLow)));
+				_mm_storeu_ps(low + 8, _mm_add_ps(_mm_loadu_ps(low + 8), _mm_mul_ps(diff2, scaleLow)));
+			}
+
+			i += 4;
+		}
+	}
+#endif
+
+	for (; i < last; i++) {
+		const Vector3 diff = view.GetDiff(i);
+		inOutResult[indices[i]] += diff * percent;
+		if constexpr (Dual)
+			inOutLow[indices[i]] += diff * percentLow;
+	}
+}
+
+template<bool Dual, typename Index, typename Value>
+void ApplyUVDiffs(const PackedDiffView<Index, Value>& view, size_t first, size_t last, float percent, Vector2* inOutResult, float percentLow, Vector2* inOutLow) {
+	const Index* indices = view.indices;
+	size_t i = first;
+
+#ifdef PACKEDDIFF_SSE
+	if constexpr (std::is_same_v<Value, float>) {
+		const float* x = view.x;
+		const float* y = view.y;
+		const __m128 scale = _mm_set1_ps(percent);
+		const __m128 scaleLow = _mm_set1_ps(percentLow);
+		while (i + 4 <= last) {
+			if (indices[i + 3] - indices[i] != 3u) {
+				Vector2& result = inOutResult[indices[i]];
+				result.u += x[i] * percent;
+				result.v += y[i] * percent;
+
+				if constexpr (Dual) {
+					Vector2& low = inOutLow[indices[i]];
+					low.u += x[i] * percentLow;
+					low.v += y[i] * percentLow;
+				}
+
+				i++;
+				continue;
+			}
+
+			__m128 vu = _mm_loadu_ps(&x[i]);
+			__m128 vv = _mm_loadu_ps(&y[i]);
+			__m128 diff0 = _mm_unpacklo_ps(vu, vv);
+			__m128 diff1 = _mm_unpackhi_ps(vu, vv);
+
+			float* result = &inOutResult[indices[i]].u;
+			_mm_storeu_ps(result, _mm_add_ps(_mm_loadu_ps(result), _mm_mul_ps(diff0, scale)));
+			_mm_storeu_ps(result + 4, _mm_add_ps(_mm_loadu_ps(result + 4), _mm_mul_ps(diff1, scale)));
+
+			if constexpr (Dual) {
+				float* low = &inOutLow[indices[i]].u;
+				_mm_storeu_ps(low, _mm_add_ps(_mm_loadu_ps(low), _mm_mul_ps(diff0, scaleLow)));
+				_mm_storeu_ps(low + 4, _mm_add_ps(_mm_loadu_ps(low + 4), _mm_mul_ps(diff1, scaleLow)));
+			}
+
+			i += 4;
+		}
+	}
+#endif
+
+	for (; i < last; i++) {
+		const float u = static_cast<float>(view.x[i]);
+		const float v = static_cast<float>(view.y[i]);
+
+		Vector2& result = inOutResult[indices[i]];
+		result.u += u * percent;
+		result.v += v * percent;
+
+		if constexpr (Dual) {
+			Vector2& low = inOutLow[indices[i]];
+			low.u += u * percentLow;
+			low.v += v * percentLow;
+		}
+	}
+}
+} // namespace
+
+template<typename Index, typename Value>
+size_t PackedDiffView<Index, Value>::CountBelow(size_t maxIndex) const {
+	if (count == 0 || indices[count - 1] < maxIndex)
+		return count;
+
+	return std::lower_bound(indices, indices + count, maxIndex, [](Index index, size_t value) { return index < value; }) - indices;
+}
+
+template<typename Index, typename Value>
+void PackedDiffView<Index, Value>::ApplyRange(size_t begin, size_t end, float percent, Vector3* inOutResult, float percentLow, Vector3* inOutLow) const {
+	const size_t first = begin > 0 ? CountBelow(begin) : 0;
+	const size_t last = CountBelow(end);
+
+	if (inOutLow)
+		ApplyDiffs<true>(*this, first, last, percent, inOutResult, percentLow, inOutLow);
+	else
+		ApplyDiffs<false>(*this, first, last, percent, inOutResult, 0.0f, nullptr);
+}
+
+template<typename Index, typename Value>
+void PackedDiffView<Index, Value>::ApplyUVRange(size_t begin, size_t end, float percent, Vector2* inOutResult, float percentLow, Vector2* inOutLow) const {
+	const size_t first = begin > 0 ? CountBelow(begin) : 0;
+	const size_t last = CountBelow(end);
+
+	if (inOutLow)
+		ApplyUVDiffs<true>(*this, first, last, percent, inOutResult, percentLow, inOutLow);
+	else
+		ApplyUVDiffs<false>(*this, first, last, percent, inOutResult, 0.0f, nullptr);
+}
+
+template<typename Index, typename Value>
+void PackedDiffView<Index, Value>::Clamp(Vector3* inOutResult, size_t resultCount) const {
+	const size_t end = CountBelow(resultCount);
+	size_t i = 0;
+
+#ifdef PACKEDDIFF_SSE
+	if constexpr (std::is_same_v<Value, float>) {
+		while (i + 4 <= end) {
+			if (indices[i + 3] - indices[i] != 3u) {
+				inOutResult[indices[i]] = Vector3(x[i], y[i], z[i]);
+				i++;
+				continue;
+			}
+
+			__m128 out0, out1, out2;
+			InterleaveXYZ(_mm_loadu_ps(&x[i]), _mm_loadu_ps(&y[i]), _mm_loadu_ps(&z[i]), out0, out1, out2);
+
+			float* result = &inOutResult[indices[i]].x;
+			_mm_storeu_ps(result, out0);
+			_mm_storeu_ps(result + 4, out1);
+			_mm_storeu_ps(result + 8, out2);
+			i += 4;
+		}
+	}
+#endif
+
+	for (; i < end; i++)
+		inOutResult[indices[i]] = GetDiff(i);
+}
+
+template<typename Index, typename Value>
+void PackedDiffView<Index, Value>::GetIndices(std::vector<uint16_t>& outIndices, float threshold) const {
+	const size_t end = CountBelow(static_cast<size_t>(UINT16_MAX) + 1);
+	for (size_t i = 0; i < end; i++) {
+		const Vector3 diff = GetDiff(i);
+		if (std::fabs(diff.x) > threshold || std::fabs(diff.y) > threshold || std::fabs(diff.z) > threshold)
+			outIndices.push_back(static_cast<uint16_t>(indices[i]));
+	}
+}
+
+template<typename Index, typename Value>
+void PackedDiffView<Index, Value>::MarkIndices(std::vector<bool>& inOutMask, float threshold) const {
+	const size_t end = CountBelow(inOutMask.size());
+	for (size_t i = 0; i < end; i++) {
+		const Vector3 diff = GetDiff(i);
+		if (std::fabs(diff.x) > threshold || std::fabs(diff.y) > threshold || std::fabs(diff.z) > threshold)
+			inOutMask[indices[i]] = true;
+	}
+}
+
+template struct PackedDiffView<uint16_t>;
+template struct PackedDiffView<uint32_t>;
+template struct PackedDiffView<uint16_t, half_float::half>;
+template struct PackedDiffView<uint32_t, half_float::half>;
@@ -0,0 +1,120 @@
+/*
+BodySlide and Outfit Studio
+See the included LICENSE file
+*/
+
+#pragma once
+
+#include "Object3d.hpp"
+#include "half.hpp"
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+// Read-only diff data as vertex indices in ascending order and separate x/y/z arrays, referencing memory owned elsewhere.
+// Applying walks the arrays and the result in order and uses SSE for runs of consecutive vertices.
+// Value is float or half_float::half, half values take half the memory and are widened to float when applied.
+template<typename Index, typename Value = float>
+struct PackedDiffView {
+	const Index* indices = nullptr;
+	const Value* x = nullptr;
+	const Value* y = nullptr;
+	const Value* z = nullptr;
+	size_t count = 0;
+
+	// Number of diffs with an index below maxIndex
+	size_t CountBelow(size_t maxIndex) const;
+	nifly::Vector3 GetDiff(size_t i) const { return nifly::Vector3(static_cast<float>(x[i]), static_cast<float>(y[i]), static_cast<float>(z[i])); }
+
+	// Adds the diffs multiplied by percent to the first resultCount elements of inOutResult
+	void Apply(float percent, nifly::Vector3* inOutResult, size_t resultCount) const { ApplyRange(0, resultCount, percent, inOutResult); }
+	// Same as Apply, using x and y of the diffs as u and v
+	void ApplyUV(float percent, nifly::Vector2* inOutResult, size_t resultCount) const { ApplyUVRange(0, resultCount, percent, inOutResult); }
+
+	// Adds the diffs with indices from begin to end (exclusive) multiplied by percent to inOutResult.
+	// If inOutLow isn't null, the diffs multiplied by percentLow are added to it in the same pass. Both need at least end elements.
+	void ApplyRange(size_t begin, size_t end, float percent, nifly::Vector3* inOutResult, float percentLow = 0.0f, nifly::Vector3* inOutLow = nullptr) const;
+	// Same as ApplyRange, using x and y of the diffs as u and v
+	void ApplyUVRange(size_t begin, size_t end, float percent, nifly::Vector2* inOutResult, float percentLow = 0.0f, nifly::Vector2* inOutLow = nullptr) const;
+	// Replaces the elements of inOutResult with the diffs
+	void Clamp(nifly::Vector3* inOutResult, size_t resultCount) const;
+
+	// Appends the indices of diffs with any component above the threshold. Indices above 65535 are left out.
+	void GetIndices(std::vector<uint16_t>& outIndices, float threshold) const;
+	// Sets the mask elements of diffs with any component above the threshold. Indices outside of the mask are left out.
+	void MarkIndices(std::vector<bool>& inOutMask, float threshold) const;
+};
+
+// Diff set owning its packed data, see PackedDiffView.
+// Index is uint16_t or uint32_t, data of meshes with up to 65536 vertices should use the smaller one.
+template<typename Index, typename Value = float>
+class BasicPackedDiffSet {
+	std::vector<Index> indices;
+	std::vector<Value> x;
+	std::vector<Value> y;
+	std::vector<Value> z;
+
+public:
+	BasicPackedDiffSet() = default;
+
+	// Indices of the map have to fit into Index
+	template<typename MapIndex>
+	explicit BasicPackedDiffSet(const std::unordered_map<MapIndex, nifly::Vector3>& diff) {
+		indices.reserve(diff.size());
+		for (auto& d : diff)
+			indices.push_back(static_cast<Index>(d.first));
+
+		std::sort(indices.begin(), indices.end());
+
+		x.resize(indices.size());
+		y.resize(indices.size());
+		z.resize(indices.size());
+
+		for (size_t i = 0; i < indices.size(); i++) {
+			const nifly::Vector3& v = diff.at(static_cast<MapIndex>(indices[i]));
+			x[i] = static_cast<Value>(v.x);
+			y[i] = static_cast<Value>(v.y);
+			z[i] = static_cast<Value>(v.z);
+		}
+	}
+
+	size_t size() const { return indices.size(); }
+	bool empty() const { return indices.empty(); }
+	size_t GetMemorySize() const {
+		return indices.capacity() * sizeof(Index) + (x.capacity() + y.capacity() + z.capacity()) * sizeof(Value);
+	}
+
+	const std::vector<Index>& GetIndices() const { return indices; }
+	nifly::Vector3 GetDiff(size_t i) const { return nifly::Vector3(static_cast<float>(x[i]), static_cast<float>(y[i]), static_cast<float>(z[i])); }
+
+	std::unordered_map<Index, nifly::Vector3> ToMap() const {
+		std::unordered_map<Index, nifly::Vector3> diff;
+		diff.reserve(indices.size());
+
+		for (size_t i = 0; i < indices.size(); i++)
+			diff.emplace(indices[i], GetDiff(i));
+
+		return diff;
+	}
+
+	PackedDiffView<Index, Value> View() const {
+		PackedDiffView<Index, Value> view;
+		view.indices = indices.data();
+		view.x = x.data();
+		view.y = y.data();
+		view.z = z.data();
+		view.count = indices.size();
+		return view;
+	}
+
+	void Apply(float percent, nifly::Vector3* inOutResult, size_t count) const { View().Apply(percent, inOutResult, count); }
+	void ApplyUV(float percent, nifly::Vector2* inOutResult, size_t count) const { View().ApplyUV(percent, inOutResult, count); }
+	void Clamp(nifly::Vector3* inOutResult, size_t count) const { View().Clamp(inOutResult, count); }
+	void GetIndices(std::vector<uint16_t>& outIndices, float threshold) const { View().GetIndices(outIndices, threshold); }
+};
+
+typedef BasicPackedDiffSet<uint16_t> PackedDiffSet;
+typedef BasicPackedDiffSet<uint32_t> PackedDiffSet32;
+typedef BasicPackedDiffSet<uint16_t, half_float::half> PackedHalfDiffSet;
+typedef BasicPackedDiffSet<uint32_t, half_float::half> PackedHalfDiffSet32;
@@ -169,7 +169,53 @@ int SliderSet::LoadSliderSet(XMLElement* element) {
 	return 0;
 }
 
-void SliderSet::LoadSetDiffData(DiffDataSets& inDataStorage, const std::string& forShape) {
+std::string SliderSet::ResolveDataFilePath(const DiffInfo& ddf, std::string& outDataName) {
+	std::string shapeName = TargetToShape(ddf.targetName);
+	bool isBSDFile = ddf.fileName.compare(ddf.fileName.size() - 4, ddf.fileName.size(), ".bsd") == 0;
+	std::string fullFilePath = baseDataPath + PathSepStr;
+	outDataName.clear();
+
+	std::vector<std::string> dataFolders;
+	if (!ddf.bLocal)
+		dataFolders = GetShapeDataFolders(shapeName);
+	else
+		dataFolders.push_back(datafolder);
+
+	for (auto& df : dataFolders) {
+		if (isBSDFile) {
+			std::string filePath = df + PathSepStr + ddf.fileName;
+
+			// Use data folder that contains the external file
+			if (std::filesystem::exists(fullFilePath + filePath)) {
+				fullFilePath += filePath;
+				break;
+			}
+		}
+		else {
+			// Split file name to get file and data name in it
+			size_t split = ddf.fileName.find_last_of('/');
+			if (split == std::string::npos)
+				split = ddf.fileName.find_last_of('\\');
+			if (split == std::string::npos)
+				continue;
+
+			std::string fileName = ddf.fileName.substr(0, split);
+			outDataName = ddf.fileName.substr(split + 1);
+
+			std::string filePath = df + PathSepStr + fileName;
+
+			// Use data folder that contains the external file
+			if (std::filesystem::exists(fullFilePath + filePath)) {
+				fullFilePath += filePath;
+				break;
+			}
+		}
+	}
+
+	return fullFilePath;
+}
+
+void SliderSet::LoadSetDiffData(DiffDataSets& inDataStorage, const std::string& forShape, const bool shared) {
 	std::map<std::string, std::map<std::string, std::string>> osdNames;
 
 	for (auto& slider : sliders) {
@@ -182,49 +228,15 @@ void SliderSet::LoadSetDiffData(DiffDataSets& inDataStorage, const std::string&
 				continue;
 
 			bool isBSDFile = ddf.fileName.compare(ddf.fileName.size() - 4, ddf.fileName.size(), ".bsd") == 0;
-			std::string fullFilePath = baseDataPath + PathSepStr;
 			std::string dataName;
-
-			std::vector<std::string> dataFolders;
-			if (!ddf.bLocal)
-				dataFolders = GetShapeDataFolders(shapeName);
-			else
-				dataFolders.push_back(datafolder);
-
-			for (auto& df : dataFolders) {
-				if (isBSDFile) {
-					std::string filePath = df + PathSepStr + ddf.fileName;
-
-					// Use data folder that contains the external file
-					if (std::filesystem::exists(fullFilePath + filePath)) {
-						fullFilePath += filePath;
-						break;
-					}
-				}
-				else {
-					// Split file name to get file and data name in it
-					size_t split = ddf.fileName.find_last_of('/');
-					if (split == std::string::npos)
-						split = ddf.fileName.find_last_of('\\');
-					if (split == std::string::npos)
-						continue;
-
-					std::string fileName = ddf.fileName.substr(0, split);
-					dataName = ddf.fileName.substr(split + 1);
-
-					std::string filePath = df + PathSepStr + fileName;
-
-					// Use data folder that contains the external file
-					if (std::filesystem::exists(fullFilePath + filePath)) {
-						fullFilePath += filePath;
-						break;
-					}
-				}
-			}
+			std::string fullFilePath = ResolveDataFilePath(ddf, dataName);
 
 			// BSD format
 			if (isBSDFile) {
-				inDataStorage.LoadSet(ddf.dataName, ddf.targetName, fullFilePath);
+				if (shared)
+					inDataStorage.LoadSharedSet(ddf.dataName, ddf.targetName, fullFilePath);
+				else
+					inDataStorage.LoadSet(ddf.dataName, ddf.targetName, fullFilePath);
 			}
 			// OSD format
 			else {
@@ -235,7 +247,22 @@ void SliderSet::LoadSetDiffData(DiffDataSets& inDataStorage, const std::string&
 	}
 
 	// Load from cached data locations at once
-	inDataStorage.LoadData(osdNames);
+	if (shared)
+		inDataStorage.LoadSharedData(osdNames);
+	else
+		inDataStorage.LoadData(osdNames);
+}
+
+void SliderSet::GetDataFilePaths(std::set<std::string>& outFilePaths) {
+	for (auto& slider : sliders) {
+		for (auto& ddf : slider.dataFiles) {
+			if (ddf.fileName.size() <= 4)
+				continue;
+
+			std::string dataName;
+			outFilePaths.insert(ResolveDataFilePath(ddf, dataName));
+		}
+	}
 }
 
 void SliderSet::Merge(SliderSet& mergeSet, DiffDataSets& inDataStorage, DiffDataSets& baseDiffData, const std::string& baseShape, const bool newDataLocal) {
@@ -600,6 +627,21 @@ int SliderSetFile::GetAllSets(std::vector<SliderSet>& outAppendSets) {
 	return 0;
 }
 
+bool SliderSetFile::GetSetNormalsXML(const std::string& setName, std::string& outXML) {
+	outXML.clear();
+
+	if (!HasSet(setName))
+		return false;
+
+	XMLElement* normalsGeneration = setsInFile[setName]->FirstChildElement("NormalsGeneration");
+	if (normalsGeneration) {
+		XMLPrinter printer(nullptr, true);
+		normalsGeneration->Accept(&printer);
+		outXML = printer.CStr();
+	}
+	return true;
+}
+
 void SliderSetFile::GetSetOutputFilePath(const std::string& setName, std::string& outFilePath) {
 	outFilePath.clear();
 
@@ -10,6 +10,8 @@ See the included LICENSE file
 #include "../components/NormalGenLayers.h"
 #include "SliderData.h"
 
+#include <set>
+
 using namespace tinyxml2;
 
 
@@ -25,6 +27,8 @@ public:
 };
 
 class SliderSet {
+	friend class SliderSetIndex;
+
 	std::string name;
 	std::string baseDataPath; // Base data path - from application configuration.
 	std::string datafolder;	  // Default data folder specified for a slider set.
@@ -41,6 +45,9 @@ class SliderSet {
 
 	SliderData Empty;
 
+	// Finds the data folder containing the file and returns the full path. For OSD files, outDataName receives the data name within the file.
+	std::string ResolveDataFilePath(const DiffInfo& ddf, std::string& outDataName);
+
 public:
 	SliderSet();
 	SliderSet(XMLElement* sliderSetSource);
@@ -65,7 +72,11 @@ public:
 	std::vector<NormalGenLayer>& GetNormalsGenLayers() { return defNormalGen; }
 
 	int LoadSliderSet(XMLElement* sliderSetSource);
-	void LoadSetDiffData(DiffDataSets& inDataStorage, const std::string& forShape = "");
+	// With "shared", the data is referenced read-only from the process-wide DiffDataCache
+	void LoadSetDiffData(DiffDataSets& inDataStorage, const std::string& forShape = "", const bool shared = false);
+
+	// Full paths of all data files (.osd/.bsd) referenced by the sliders, as used by LoadSetDiffData.
+	void GetDataFilePaths(std::set<std::string>& outFilePaths);
 
 	void Merge(SliderSet& mergeSet, DiffDataSets& inDataStorage, DiffDataSets& baseDiffData, const std::string& baseShape, const bool newDataLocal = true);
 
@@ -352,6 +363,8 @@ public:
 	int GetSet(const std::string& setName, SliderSet& outSliderSet);
 	// Adds all of the slider sets in the file to the supplied slider set vector. Does not clear the vector before doing so.
 	int GetAllSets(std::vector<SliderSet>& outAppendSets);
+	// Gets the set's normals generation XML element as compact text, empty if there is none
+	bool GetSetNormalsXML(const std::string& setName, std::string& outXML);
 	// Gets only the output file path for the set
 	void GetSetOutputFilePath(const std::string& setName, std::string& outFilePath);
 	// Updates a slider set in the xml document with the provided set's information.
@@ -0,0 +1,432 @@
+/*
+BodySlide and Outfit Studio
+See the included LICENSE file
+*/
+
+#include "SliderSetIndex.h"
+#include "../utils/PlatformUtil.h"
+
+#include <cstring>
+#include <sstream>
+
+namespace {
+constexpr uint32_t SliderSetIndexVersion = 1;
+
+class IndexWriter {
+	std::string& buffer;
+
+public:
+	IndexWriter(std::string& outBuffer)
+		: buffer(outBuffer) {}
+
+	template<typename T>
+	void Write(const T& value) {
+		buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+	}
+
+	void Write(const std::string& str) {
+		Write(static_cast<uint32_t>(str.size()));
+		buffer.append(str);
+	}
+
+	void Write(const std::vector<std::string>& strings) {
+		Write(static_cast<uint32_t>(strings.size()));
+		for (auto& str : strings)
+			Write(str);
+	}
+};
+
+// Reads from a buffer, reading past the end sets the fail state and returns empty values
+class IndexReader {
+	const std::string& buffer;
+	size_t pos = 0;
+	bool failed = false;
+
+	bool Check(size_t size) {
+		if (failed || buffer.size() - pos < size)
+			failed = true;
+
+		return !failed;
+	}
+
+public:
+	IndexReader(const std::string& inBuffer)
+		: buffer(inBuffer) {}
+
+	bool fail() const { return failed; }
+
+	template<typename T>
+	void Read(T& value) {
+		if (!Check(sizeof(T))) {
+			value = T();
+			return;
+		}
+
+		std::memcpy(&value, buffer.data() + pos, sizeof(T));
+		pos += sizeof(T);
+	}
+
+	void Read(std::string& str) {
+		uint32_t size = 0;
+		Read(size);
+
+		if (!Check(size)) {
+			str.clear();
+			return;
+		}
+
+		str.assign(buffer.data() + pos, size);
+		pos += size;
+	}
+
+	void Read(std::vector<std::string>& strings) {
+		uint32_t count = 0;
+		Read(count);
+
+		strings.clear();
+		for (uint32_t i = 0; i < count && !failed; i++) {
+			std::string str;
+			Read(str);
+			strings.push_back(std::move(str));
+		}
+	}
+};
+} // namespace
+
+void SliderSetIndex::WriteSet(SliderSet& sliderSet, std::string& outData) {
+	outData.clear();
+	IndexWriter writer(outData);
+
+	writer.Write(sliderSet.name);
+	writer.Write(sliderSet.datafolder);
+	writer.Write(sliderSet.inputfile);
+	writer.Write(sliderSet.outputpath);
+	writer.Write(sliderSet.outputfile);
+	writer.Write(sliderSet.genWeights);
+	writer.Write(sliderSet.preventMorphFile);
+
+	writer.Write(static_cast<uint32_t>(sliderSet.shapeAttributes.size()));
+	for (auto& shape : sliderSet.shapeAttributes) {
+		writer.Write(shape.first);
+		writer.Write(shape.second.targetShape);
+		writer.Write(shape.second.dataFolders);
+		writer.Write(shape.second.smoothSeamNormals);
+		writer.Write(shape.second.smoothSeamNormalsAngle);
+		writer.Write(shape.second.lockNormals);
+	}
+
+	writer.Write(static_cast<uint32_t>(sliderSet.sliders.size()));
+	for (auto& slider : sliderSet.sliders) {
+		writer.Write(slider.name);
+		writer.Write(slider.bHidden);
+		writer.Write(slider.bInvert);
+		writer.Write(slider.bZap);
+		writer.Write(slider.bClamp);
+		writer.Write(slider.bUV);
+		writer.Write(slider.defSmallValue);
+		writer.Write(slider.defBigValue);
+		writer.Write(slider.zapToggles);
+
+		writer.Write(static_cast<uint32_t>(slider.dataFiles.size()));
+		for (auto& df : slider.dataFiles) {
+			writer.Write(df.bLocal);
+			writer.Write(df.dataName);
+			writer.Write(df.targetName);
+			writer.Write(df.fileName);
+		}
+	}
+}
+
+bool SliderSetIndex::ReadSet(const SetData& setData, SliderSet& outSliderSet) {
+	IndexReader reader(setData.data);
+
+	reader.Read(outSliderSet.name);
+	reader.Read(outSliderSet.datafolder);
+	reader.Read(outSliderSet.inputfile);
+	reader.Read(outSliderSet.outputpath);
+	reader.Read(outSliderSet.outputfile);
+	reader.Read(outSliderSet.genWeights);
+	reader.Read(outSliderSet.preventMorphFile);
+
+	uint32_t shapeCount = 0;
+	reader.Read(shapeCount);
+	for (uint32_t i = 0; i < shapeCount && !reader.fail(); i++) {
+		std::string shapeName;
+		reader.Read(shapeName);
+
+		auto& shape = outSliderSet.shapeAttributes[shapeName];
+		reader.Read(shape.targetShape);
+		reader.Read(shape.dataFolders);
+		reader.Read(shape.smoothSeamNormals);
+		reader.Read(shape.smoothSeamNormalsAngle);
+		reader.Read(shape.lockNormals);
+	}
+
+	uint32_t sliderCount = 0;
+	reader.Read(sliderCount);
+	for (uint32_t i = 0; i < sliderCount && !reader.fail(); i++) {
+		SliderData slider;
+		reader.Read(slider.name);
+		reader.Read(slider.bHidden);
+		reader.Read(slider.bInvert);
+		reader.Read(slider.bZap);
+		reader.Read(slider.bClamp);
+		reader.Read(slider.bUV);
+		reader.Read(slider.defSmallValue);
+		reader.Read(slider.defBigValue);
+		reader.Read(slider.zapToggles);
+
+		uint32_t dataCount = 0;
+		reader.Read(dataCount);
+		for (uint32_t j = 0; j < dataCount && !reader.fail(); j++) {
+			DiffInfo df;
+			reader.Read(df.bLocal);
+			reader.Read(df.dataName);
+			reader.Read(df.targetName);
+			reader.Read(df.fileName);
+			slider.dataFiles.push_back(std::move(df));
+		}
+
+		outSliderSet.sliders.push_back(std::move(slider));
+	}
+
+	if (reader.fail())
+		return false;
+
+	// Same as SliderSet::LoadSliderSet
+	if (!setData.normalsXML.empty()) {
+		if (outSliderSet.defNormalGen.empty()) {
+			XMLDocument doc;
+			if (doc.Parse(setData.normalsXML.c_str(), setData.normalsXML.size()) == XML_SUCCESS && doc.RootElement())
+				NormalGenLayer::LoadFromXML(doc.RootElement(), outSliderSet.defNormalGen);
+		}
+	}
+	else
+		outSliderSet.defNormalGen.clear();
+
+	return true;
+}
+
+bool SliderSetIndex::Load(const std::string& srcFileName) {
+	std::lock_guard<std::mutex> lock(indexMutex);
+
+	fileName = srcFileName;
+	files.clear();
+	changed = false;
+
+	std::fstream file;
+	PlatformUtil::OpenFileStream(file, srcFileName, std::ios::in | std::ios::binary);
+	if (!file)
+		return false;
+
+	std::stringstream stream;
+	stream << file.rdbuf();
+	std::string buffer = stream.str();
+
+	IndexReader reader(buffer);
+
+	uint32_t header = 0;
+	uint32_t version = 0;
+	reader.Read(header);
+	reader.Read(version);
+	if (header != "BSSI"_mci || version != SliderSetIndexVersion)
+		return false;
+
+	uint32_t fileCount = 0;
+	reader.Read(fileCount);
+	for (uint32_t i = 0; i < fileCount && !reader.fail(); i++) {
+		std::string sourceFile;
+		reader.Read(sourceFile);
+
+		FileEntry& entry = files[sourceFile];
+		reader.Read(entry.size);
+		reader.Read(entry.time);
+
+		uint32_t setCount = 0;
+		reader.Read(setCount);
+		for (uint32_t j = 0; j < setCount && !reader.fail(); j++) {
+			SetInfo info;
+			reader.Read(info.name);
+			reader.Read(info.outputFilePath);
+			reader.Read(info.hasZaps);
+			entry.sets.push_back(std::move(info));
+		}
+
+		uint32_t dataCount = 0;
+		reader.Read(dataCount);
+		for (uint32_t j = 0; j < dataCount && !reader.fail(); j++) {
+			std::string setName;
+			reader.Read(setName);
+
+			SetData& setData = entry.setData[setName];
+			reader.Read(setData.data);
+			reader.Read(setData.normalsXML);
+		}
+	}
+
+	if (reader.fail()) {
+		files.clear();
+		return false;
+	}
+
+	return true;
+}
+
+bool SliderSetIndex::Save() {
+	std::lock_guard<std::mutex> lock(indexMutex);
+
+	for (auto it = files.begin(); it != files.end();) {
+		if (!it->second.used) {
+			it = files.erase(it);
+			changed = true;
+		}
+		else
+			++it;
+	}
+
+	if (!changed)
+		return true;
+
+	std::string buffer;
+	IndexWriter writer(buffer);
+	writer.Write("BSSI"_mci);
+	writer.Write(SliderSetIndexVersion);
+
+	writer.Write(static_cast<uint32_t>(files.size()));
+	for (auto& file : files) {
+		writer.Write(file.first);
+		writer.Write(file.second.size);
+		writer.Write(file.second.time);
+
+		writer.Write(static_cast<uint32_t>(file.second.sets.size()));
+		for (auto& info : file.second.sets) {
+			writer.Write(info.name);
+			writer.Write(info.outputFilePath);
+			writer.Write(info.hasZaps);
+		}
+
+		writer.Write(static_cast<uint32_t>(file.second.setData.size()));
+		for (auto& setData : file.second.setData) {
+			writer.Write(setData.first);
+			writer.Write(setData.second.data);
+			writer.Write(setData.second.normalsXML);
+		}
+	}
+
+	std::fstream file;
+	PlatformUtil::OpenFileStream(file, fileName, std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!file)
+		return false;
+
+	file.write(buffer.data(), buffer.size());
+	if (!file)
+		return false;
+
+	changed = false;
+	return true;
+}
+
+bool SliderSetIndex::UpdateFile(const std::string& sourceFile) {
+	int64_t size = -1;
+	int64_t time = 0;
+	if (!PlatformUtil::GetFileStamp(sourceFile, size, time))
+		return false;
+
+	{
+		std::lock_guard<std::mutex> lock(indexMutex);
+		auto it = files.find(sourceFile);
+		if (it != files.end() && it->second.size == size && it->second.time == time) {
+			it->second.used = true;
+			return true;
+		}
+	}
+
+	// Parse outside of the lock, other threads may look up other files meanwhile
+	SliderSetFile sliderDoc;
+	sliderDoc.Open(sourceFile);
+	if (sliderDoc.fail())
+		return false;
+
+	FileEntry entry;
+	entry.size = size;
+	entry.time = time;
+	entry.used = true;
+
+	std::vector<std::string> setNames;
+	sliderDoc.GetSetNamesUnsorted(setNames, false);
+	for (auto& setName : setNames) {
+		SetInfo info;
+		info.name = setName;
+		sliderDoc.GetSetOutputFilePath(setName, info.outputFilePath);
+
+		auto setData = entry.setData.find(setName);
+		if (setData == entry.setData.end()) {
+			SliderSet sliderSet;
+			if (sliderDoc.GetSet(setName, sliderSet) == 0) {
+				SetData& data = entry.setData[setName];
+				WriteSet(sliderSet, data.data);
+				sliderDoc.GetSetNormalsXML(setName, data.normalsXML);
+
+				for (size_t s = 0; s < sliderSet.size(); s++) {
+					auto& slider = sliderSet[s];
+					if (slider.bZap && !slider.bHidden) {
+						info.hasZaps = true;
+						break;
+					}
+				}
+			}
+		}
+		else {
+			// Duplicate set name in the same file
+			for (auto& other : entry.sets)
+				if (other.name == setName)
+					info.hasZaps = other.hasZaps;
+		}
+
+		entry.sets.push_back(std::move(info));
+	}
+
+	std::lock_guard<std::mutex> lock(indexMutex);
+	files[sourceFile] = std::move(entry);
+	changed = true;
+	return true;
+}
+
+bool SliderSetIndex::GetFileSets(const std::string& sourceFile, std::vector<SetInfo>& outSets) {
+	outSets.clear();
+
+	if (!UpdateFile(sourceFile))
+		return false;
+
+	std::lock_guard<std::mutex> lock(indexMutex);
+	auto it = files.find(sourceFile);
+	if (it == files.end())
+		return false;
+
+	outSets = it->second.sets;
+	return true;
+}
+
+int SliderSetIndex::GetSet(const std::string& sourceFile, const std::string& setName, SliderSet& outSliderSet) {
+	if (!UpdateFile(sourceFile))
+		return 2;
+
+	SetData setData;
+	{
+		std::lock_guard<std::mutex> lock(indexMutex);
+		auto it = files.find(sourceFile);
+		if (it == files.end())
+			return 2;
+
+		auto data = it->second.setData.find(setName);
+		if (data == it->second.setData.end())
+			return 1;
+
+		setData = data->second;
+	}
+
+	if (!ReadSet(setData, outSliderSet))
+		return 1;
+
+	return 0;
+}
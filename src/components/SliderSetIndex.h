@@ -0,0 +1,60 @@
+/*
+BodySlide and Outfit Studio
+See the included LICENSE file
+*/
+
+#pragma once
+
+#include "SliderSet.h"
+
+#include <mutex>
+
+// Binary index of all parsed slider set files.
+// Each entry is validated against the size and modification time of its source file, only changed files are parsed again.
+// The index is stored as "SliderSetIndex.bin" in the application folder.
+class SliderSetIndex {
+public:
+	struct SetInfo {
+		std::string name;
+		std::string outputFilePath; // Same as SliderSetFile::GetSetOutputFilePath
+		bool hasZaps = false;		// Set has visible zap sliders
+	};
+
+private:
+	struct SetData {
+		std::string data;		 // See WriteSet
+		std::string normalsXML; // Normals generation is stored as XML, the layers contain configuration dependent paths
+	};
+
+	struct FileEntry {
+		int64_t size = -1;
+		int64_t time = 0;
+		std::vector<SetInfo> sets; // In order of appearance
+		std::map<std::string, SetData> setData;
+		bool used = false;
+	};
+
+	std::string fileName;
+	std::map<std::string, FileEntry> files;
+	std::mutex indexMutex;
+	bool changed = false;
+
+	// Parses the slider set file again if it changed since it was indexed. Returns false if the file couldn't be opened.
+	bool UpdateFile(const std::string& sourceFile);
+
+	static bool ReadSet(const SetData& setData, SliderSet& outSliderSet);
+
+public:
+	bool Load(const std::string& srcFileName);
+	// Writes the index, removing files that weren't accessed since Load
+	bool Save();
+
+	// Gets all sets of a slider set file. Returns false if the file couldn't be opened.
+	bool GetFileSets(const std::string& sourceFile, std::vector<SetInfo>& outSets);
+
+	// Same as SliderSetFile::GetSet. Returns 1 if the set doesn't exist and 2 if the file couldn't be opened.
+	int GetSet(const std::string& sourceFile, const std::string& setName, SliderSet& outSliderSet);
+
+	// Serializes the data of a slider set, except for the default normals generation layers
+	static void WriteSet(SliderSet& sliderSet, std::string& outData);
+};
@@ -0,0 +1,92 @@
+/*
+BodySlide and Outfit Studio
+See the included LICENSE file
+*/
+
+#include "VertexRemap.h"
+
+#include <algorithm>
+
+using namespace nifly;
+
+VertexRemap VertexRemap::Deletion(const std::vector<uint16_t>& indices) {
+	VertexRemap remap;
+	if (indices.empty())
+		return remap;
+
+	remap.indices = indices;
+	remap.offset = -static_cast<int>(indices.size());
+	remap.indexMap.resize(static_cast<size_t>(indices.back()) + 1);
+
+	int newIndex = 0;
+	size_t next = 0;
+	for (size_t i = 0; i < remap.indexMap.size(); i++) {
+		if (next < indices.size() && indices[next] == i) {
+			remap.indexMap[i] = -1;
+			next++;
+		}
+		else
+			remap.indexMap[i] = newIndex++;
+	}
+
+	return remap;
+}
+
+VertexRemap VertexRemap::Insertion(const std::vector<uint16_t>& indices) {
+	VertexRemap remap;
+	if (indices.empty())
+		return remap;
+
+	remap.indices = indices;
+	remap.offset = static_cast<int>(indices.size());
+	remap.insertion = true;
+	remap.indexMap.resize(static_cast<size_t>(indices.back()) + 1);
+
+	// Old index i moves past all inserted indices up to its new position
+	size_t inserted = 0;
+	for (size_t i = 0; i < remap.indexMap.size(); i++) {
+		while (inserted < indices.size() && indices[inserted] <= i + inserted)
+			inserted++;
+
+		remap.indexMap[i] = static_cast<int>(i + inserted);
+	}
+
+	return remap;
+}
+
+size_t VertexRemap::MappedCount(size_t count) const {
+	if (insertion) {
+		// Inserted indices past the end of the grown array are left out
+		size_t newCount = count;
+		for (uint16_t index : indices)
+			if (index <= newCount)
+				newCount++;
+
+		return newCount;
+	}
+
+	auto end = std::lower_bound(indices.begin(), indices.end(), count);
+	return count - static_cast<size_t>(end - indices.begin());
+}
+
+void VertexRemap::ApplyToTriangles(std::vector<Triangle>& inOutTris) const {
+	if (empty())
+		return;
+
+	size_t kept = 0;
+	for (const Triangle& t : inOutTris) {
+		int p1 = Map(t.p1);
+		int p2 = Map(t.p2);
+		int p3 = Map(t.p3);
+		if (p1 < 0 || p2 < 0 || p3 < 0)
+			continue;
+
+		Triangle& out = inOutTris[kept++];
+		out = t;
+		out.p1 = static_cast<uint16_t>(p1);
+		out.p2 = static_cast<uint16_t>(p2);
+		out.p3 = static_cast<uint16_t>(p3);
+	}
+
+	inOutTris.resize(kept);
+}
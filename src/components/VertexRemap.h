@@ -0,0 +1,98 @@
+/*
+BodySlide and Outfit Studio
+See the included LICENSE file
+*/
+
+#pragma once
+
+#include "Object3d.hpp"
+
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Old to new vertex indices of a shape for deleting or inserting vertices.
+// Computed once per mesh edit and applied to all per-vertex data of the shape: diff sets, bone weights, masks and vertex arrays.
+class VertexRemap {
+	std::vector<int> indexMap;		// New index of each old index up to the highest changed one, -1 if deleted
+	std::vector<uint16_t> indices;	// Deleted old or inserted new indices in ascending order
+	int offset = 0;					// Shift of all indices past the map
+	bool insertion = false;
+
+public:
+	VertexRemap() = default;
+
+	// indices must be in ascending order.
+	static VertexRemap Deletion(const std::vector<uint16_t>& indices);
+	// indices are the positions of the new vertices after inserting and must be in ascending order.
+	static VertexRemap Insertion(const std::vector<uint16_t>& indices);
+
+	bool empty() const { return indices.empty(); }
+	bool IsInsertion() const { return insertion; }
+	const std::vector<uint16_t>& GetIndices() const { return indices; }
+
+	// New index of an old index, -1 if it was deleted
+	int Map(size_t index) const {
+		if (index < indexMap.size())
+			return indexMap[index];
+
+		return static_cast<int>(index) + offset;
+	}
+
+	// Number of elements after remapping an array with count elements
+	size_t MappedCount(size_t count) const;
+
+	// Moves the values to their new keys and drops the deleted ones
+	template<typename Key, typename Value>
+	void ApplyToMapKeys(std::unordered_map<Key, Value>& inOutMap) const {
+		if (empty())
+			return;
+
+		std::unordered_map<Key, Value> remapped;
+		remapped.reserve(inOutMap.size());
+
+		for (auto& entry : inOutMap) {
+			int newIndex = Map(entry.first);
+			if (newIndex >= 0)
+				remapped.emplace(static_cast<Key>(newIndex), std::move(entry.second));
+		}
+
+		inOutMap.swap(remapped);
+	}
+
+	// Erases or inserts elements in a single pass over the array. Inserted elements are value-initialized.
+	template<typename T>
+	void ApplyToVector(std::vector<T>& inOutVector) const {
+		if (empty() || inOutVector.empty())
+			return;
+
+		const size_t count = inOutVector.size();
+		const size_t newCount = MappedCount(count);
+
+		if (insertion) {
+			// Moves elements back to their new positions, starting with the last one
+			inOutVector.resize(newCount);
+			for (size_t i = count; i-- > 0;) {
+				size_t newIndex = static_cast<size_t>(Map(i));
+				if (newIndex != i)
+					inOutVector[newIndex] = std::move(inOutVector[i]);
+			}
+
+			for (uint16_t index : indices)
+				if (index < newCount)
+					inOutVector[index] = T();
+		}
+		else {
+			for (size_t i = 0; i < count; i++) {
+				int newIndex = Map(i);
+				if (newIndex >= 0 && static_cast<size_t>(newIndex) != i)
+					inOutVector[newIndex] = std::move(inOutVector[i]);
+			}
+
+			inOutVector.resize(newCount);
+		}
+	}
+
+	// Renumbers the points of the triangles, triangles with deleted points are removed
+	void ApplyToTriangles(std::vector<nifly::Triangle>& inOutTris) const;
+};
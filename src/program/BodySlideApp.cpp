@@ -16,22 +16,19 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "BodySlideApp.h"
+#include "../components/DiffDataCache.h"
+#include "../components/MorphCache.h"
 #include "../files/wxDDSImage.h"
 #include "../utils/PlatformUtil.h"
 #include "../utils/StringStuff.h"
+#include "../utils/ThreadPool.h"
 
 #include <atomic>
+#include <limits>
 #include <regex>
+#include <thread>
 #include <wx/debugrpt.h>
 
-#ifdef WIN64
-#include <concurrent_unordered_map.h>
-#include <ppl.h>
-#include <ppltasks.h>
-#else
-#undef _PPL_H
-#endif
-
 using namespace nifly;
 
 ConfigurationManager Config;
@@ -148,6 +145,9 @@ bool BodySlideApp::OnInit() {
 	if (!SetDefaultConfig())
 		return false;
 
+	OutfitBuilder::ApplyConfig(Config);
+	wxLogMessage("Using %zu threads for parallel work.", ThreadPool::Get().GetThreadCount());
+
 	InitLanguage();
 
 	wxString gameName = "Target game: ";
@@ -203,6 +203,8 @@ bool BodySlideApp::OnInit() {
 
 	LoadAllCategories();
 	LoadAllGroups();
+
+	sliderSetIndex.Load(Config["AppDir"] + PathSepStr + "SliderSetIndex.bin");
 	LoadSliderSets();
 
 	if (cmdGroupBuild.empty()) {
@@ -234,17 +236,31 @@ bool BodySlideApp::OnCmdLineParsed(wxCmdLineParser& parser) {
 		}
 	}
 
-	wxString targetDir;
-	parser.Found("t", &targetDir);
+	// Multi-preset builds pass one target directory per preset, separated by commas
+	wxString targetDirs;
+	parser.Found("t", &targetDirs);
 
-	if (!targetDir.IsEmpty() && !targetDir.EndsWith(PathSepChar))
-		targetDir.Append(PathSepChar);
+	tokenizer.SetString(targetDirs, ",");
+	while (tokenizer.HasMoreTokens()) {
+		wxString targetDir = tokenizer.GetNextToken().Trim().Trim(false);
+		if (targetDir.IsEmpty())
+			continue;
 
-	cmdTargetDir = targetDir.ToUTF8().data();
+		if (!targetDir.EndsWith(PathSepChar))
+			targetDir.Append(PathSepChar);
 
-	wxString preset;
-	parser.Found("p", &preset);
-	cmdPreset = preset.ToUTF8().data();
+		cmdTargetDirs.push_back(targetDir.ToUTF8().data());
+	}
+
+	wxString presets;
+	parser.Found("p", &presets);
+
+	tokenizer.SetString(presets, ",");
+	while (tokenizer.HasMoreTokens()) {
+		wxString preset = tokenizer.GetNextToken().Trim().Trim(false);
+		if (!preset.IsEmpty())
+			cmdPresets.push_back(preset.ToUTF8().data());
+	}
 
 	cmdTri = parser.Found("tri");
 	return true;
@@ -368,6 +384,7 @@ void BodySlideApp::LoadData() {
 
 	sliderManager.ClearSliders();
 	sliderManager.ClearPresets();
+	sliderHandles.clear();
 
 	if (!activeOutfit.empty()) {
 		wxLogMessage("Setting up set '%s'...", activeOutfit);
@@ -494,25 +511,22 @@ void BodySlideApp::CharHook(wxKeyEvent& event) {
 int BodySlideApp::CreateSetSliders(const std::string& outfit) {
 	wxLogMessage("Creating sliders...");
 	dataSets.Clear();
+	sliderHandles.clear();
 	if (outfitNameSource.find(outfit) == outfitNameSource.end())
 		return 1;
 
-	SliderSetFile sliderDoc;
-	sliderDoc.Open(outfitNameSource[outfit]);
-	if (!sliderDoc.fail()) {
-		activeSet.Clear();
-		sliderManager.ClearSliders();
-		if (!sliderDoc.GetSet(outfit, activeSet)) {
-			activeSet.SetBaseDataPath(GetProjectPath() + PathSepStr + "ShapeData");
-			sliderManager.AddSlidersInSet(activeSet);
-			DisplayActiveSet();
-		}
-		else
-			return 3;
-	}
-	else
+	activeSet.Clear();
+	sliderManager.ClearSliders();
+
+	int error = sliderSetIndex.GetSet(outfitNameSource[outfit], outfit, activeSet);
+	if (error == 1)
+		return 3;
+	else if (error)
 		return 2;
 
+	activeSet.SetBaseDataPath(GetProjectPath() + PathSepStr + "ShapeData");
+	sliderManager.AddSlidersInSet(activeSet);
+	DisplayActiveSet();
 	return 0;
 }
 
@@ -534,6 +548,7 @@ void BodySlideApp::RefreshOutfitList() {
 int BodySlideApp::LoadSliderSets() {
 	wxLogMessage("Loading all slider sets...");
 	dataSets.Clear();
+	sliderHandles.clear();
 	outfitNameSource.clear();
 	outfitNameOrder.clear();
 	outfitHasZaps.clear();
@@ -552,48 +567,39 @@ int BodySlideApp::LoadSliderSets() {
 			filterHasZaps = menuFilterHasZaps->IsChecked();
 	}
 
-	for (auto& file : files) {
-		std::string fileName{file.ToUTF8()};
+	// Only files that changed since the last start are parsed
+	std::vector<std::string> fileNames(files.size());
+	std::vector<std::vector<SliderSetIndex::SetInfo>> fileSets(files.size());
+	std::vector<char> fileRead(files.size(), false);
+
+	for (size_t i = 0; i < files.size(); i++)
+		fileNames[i] = files[i].ToUTF8();
 
-		SliderSetFile sliderDoc;
-		sliderDoc.Open(fileName);
-		if (sliderDoc.fail())
+	ThreadPool::Get().ParallelFor(files.size(), [&](size_t i) { fileRead[i] = sliderSetIndex.GetFileSets(fileNames[i], fileSets[i]); });
+
+	for (size_t i = 0; i < files.size(); i++) {
+		if (!fileRead[i])
 			continue;
 
-		std::string outFilePath;
-		std::vector<std::string> outfitNames;
-		sliderDoc.GetSetNamesUnsorted(outfitNames, false);
-		for (auto& o : outfitNames) {
+		for (auto& setInfo : fileSets[i]) {
+			const std::string& o = setInfo.name;
 			if (outfitNameSource.find(o) != outfitNameSource.end())
 				continue;
 
-			outfitNameSource[o] = fileName;
+			outfitNameSource[o] = fileNames[i];
 			outfitNameOrder.push_back(o);
 
-			if (filterHasZaps) {
-				bool hasZaps = false;
-
-				SliderSet sliderSet;
-				if (sliderDoc.GetSet(o, sliderSet) == 0) {
-					for (size_t s = 0; s < sliderSet.size(); s++) {
-						auto& slider = sliderSet[s];
-						if (slider.bZap && !slider.bHidden) {
-							hasZaps = true;
-							break;
-						}
-					}
-				}
-
-				if (hasZaps)
-					outfitHasZaps.push_back(o);
-			}
+			if (filterHasZaps && setInfo.hasZaps)
+				outfitHasZaps.push_back(o);
 
-			sliderDoc.GetSetOutputFilePath(o, outFilePath);
-			if (!outFilePath.empty())
-				outFileCount[outFilePath].push_back(o);
+			if (!setInfo.outputFilePath.empty())
+				outFileCount[setInfo.outputFilePath].push_back(o);
 		}
 	}
 
+	if (!sliderSetIndex.Save())
+		wxLogWarning("Failed to save slider set index.");
+
 	ungroupedOutfits.clear();
 	for (auto& o : outfitNameSource) {
 		std::vector<std::string> groups;
@@ -1013,117 +1019,77 @@ void BodySlideApp::LaunchOutfitStudio(const wxString& args) {
 	}
 }
 
-void BodySlideApp::ApplySliders(
-	const std::string& targetShape, std::vector<Slider>& sliderSet, std::vector<Vector3>& verts, std::vector<uint16_t>& ZapIdx, std::vector<Vector2>* uvs) {
-	for (auto& slider : sliderSet) {
-		float val = slider.value;
-		if (slider.zap && !slider.uv) {
-			if (val > 0)
-				for (size_t j = 0; j < slider.linkedDataSets.size(); j++)
-					dataSets.GetDiffIndices(slider.linkedDataSets[j], targetShape, ZapIdx);
-		}
-		else {
-			if (slider.invert)
-				val = 1.0f - val;
-
-			for (size_t j = 0; j < slider.linkedDataSets.size(); j++) {
-				if (slider.uv) {
-					if (uvs)
-						dataSets.ApplyUVDiff(slider.linkedDataSets[j], targetShape, val, uvs);
-				}
-				else
-					dataSets.ApplyDiff(slider.linkedDataSets[j], targetShape, val, &verts);
-			}
-		}
-	}
-
-	for (auto& slider : sliderSet)
-		if (slider.clamp && slider.value > 0)
-			for (size_t j = 0; j < slider.linkedDataSets.size(); j++)
-				dataSets.ApplyClamp(slider.linkedDataSets[j], targetShape, &verts);
-}
-
-bool BodySlideApp::WriteMorphTRI(const std::string& triPath, SliderSet& sliderSet, NifFile& nif, std::unordered_map<std::string, std::vector<uint16_t>>& zapIndices) {
-	DiffDataSets currentDiffs;
-	sliderSet.LoadSetDiffData(currentDiffs);
-
-	TriFile tri;
-	std::string triFilePath = triPath + ".tri";
-
-	for (auto targetShape = sliderSet.ShapesBegin(); targetShape != sliderSet.ShapesEnd(); ++targetShape) {
-		auto shape = nif.FindBlockByName<NiShape>(targetShape->first);
-		if (!shape)
-			continue;
-
-		const std::vector<uint16_t>& shapeZapIndices = zapIndices[targetShape->first];
-
-		int shapeVertCount = shape->GetNumVertices();
-		shapeVertCount += shapeZapIndices.size();
-
-		if (shapeVertCount <= 0)
-			continue;
-
-		if (shapeZapIndices.size() > 0 && shapeZapIndices.back() >= shapeVertCount)
-			continue;
-
-		for (size_t s = 0; s < sliderSet.size(); s++) {
-			std::string dn = sliderSet[s].TargetDataName(targetShape->second.targetShape);
-			std::string target = targetShape->second.targetShape;
-			if (dn.empty())
+void BodySlideApp::ApplySliders(const std::string& targetShape,
+							   std::vector<Vector3>& verts,
+							   std::vector<uint16_t>& zapIdx,
+							   std::vector<Vector2>* uvs,
+							   std::vector<Vector3>* vertsLow,
+							   std::vector<Vector2>* uvsLow) {
+	std::vector<Slider>& slidersBig = sliderManager.slidersBig;
+	std::vector<Slider>& slidersSmall = sliderManager.slidersSmall;
+
+	// Big and small sliders link the same data sets
+	std::vector<DiffHandle>& handles = sliderHandles[targetShape];
+	if (handles.empty())
+		for (auto& slider : slidersBig)
+			for (auto& dataSet : slider.linkedDataSets)
+				handles.push_back(dataSets.Resolve(dataSet, targetShape));
+
+	std::vector<DiffTerm> terms;
+	size_t h = 0;
+	for (size_t i = 0; i < slidersBig.size(); i++) {
+		Slider& slider = slidersBig[i];
+		Slider& sliderSmall = slidersSmall[i];
+
+		for (size_t j = 0; j < slider.linkedDataSets.size(); j++) {
+			DiffTerm term;
+			term.handle = handles[h + j];
+
+			if (slider.zap && !slider.uv) {
+				term.kind = DiffTermKind::Zap;
+				term.weight = slider.value;
+				term.weightLow = vertsLow ? sliderSmall.value : 0.0f;
+				terms.push_back(term);
 				continue;
+			}
 
-			if (!sliderSet[s].bClamp && !sliderSet[s].bZap) {
-				MorphDataPtr morph = std::make_shared<MorphData>();
-				morph->name = sliderSet[s].name;
-
-				if (sliderSet[s].bUV) {
-					morph->type = MORPHTYPE_UV;
-
-					std::vector<Vector2> uvs;
-					uvs.resize(shapeVertCount);
-
-					currentDiffs.ApplyUVDiff(dn, target, 1.0f, &uvs);
-
-					for (int i = shapeZapIndices.size() - 1; i >= 0; i--)
-						uvs.erase(uvs.begin() + shapeZapIndices[i]);
-
-					int i = 0;
-					for (auto& uv : uvs) {
-						Vector3 v(uv.u, uv.v, 0.0f);
-						if (!v.IsZero(true))
-							morph->offsets.emplace(i, v);
-						i++;
-					}
-				}
-				else {
-					morph->type = MORPHTYPE_POSITION;
+			term.kind = slider.uv ? DiffTermKind::UV : DiffTermKind::Vertex;
+			term.weight = slider.invert ? 1.0f - slider.value : slider.value;
+			term.weightLow = sliderSmall.invert ? 1.0f - sliderSmall.value : sliderSmall.value;
+			terms.push_back(term);
 
-					std::vector<Vector3> verts;
-					verts.resize(shapeVertCount);
+			if (slider.clamp) {
+				term.kind = DiffTermKind::Clamp;
+				term.weight = slider.value > 0 ? 1.0f : 0.0f;
+				term.weightLow = sliderSmall.value > 0 ? 1.0f : 0.0f;
+				terms.push_back(term);
+			}
+		}
 
-					currentDiffs.ApplyDiff(dn, target, 1.0f, &verts);
+		h += slider.linkedDataSets.size();
+	}
 
-					for (int i = shapeZapIndices.size() - 1; i >= 0; i--)
-						verts.erase(verts.begin() + shapeZapIndices[i]);
+	DiffEvalOutput high;
+	high.verts = &verts;
+	high.uvs = uvs;
 
-					int i = 0;
-					for (auto& v : verts) {
-						if (!v.IsZero(true))
-							morph->offsets.emplace(i, v);
-						i++;
-					}
-				}
+	DiffEvalOutput low;
+	low.verts = vertsLow;
+	low.uvs = vertsLow ? uvsLow : nullptr;
 
-				if (morph->offsets.size() > 0)
-					tri.AddMorph(targetShape->first, morph);
-			}
-		}
-	}
+	std::vector<bool> zapMask(verts.size(), false);
+	dataSets.EvaluateCached(terms, high, low, &zapMask);
 
-	if (!tri.Write(triFilePath))
-		return false;
+	// Zap indices are 16-bit, zapped vertices beyond them are kept instead of deleting the wrong ones
+	zapIdx.clear();
+	const size_t zapLimit = std::min<size_t>(zapMask.size(), static_cast<size_t>(std::numeric_limits<uint16_t>::max()) + 1);
+	for (size_t i = 0; i < zapLimit; i++)
+		if (zapMask[i])
+			zapIdx.push_back(static_cast<uint16_t>(i));
 
-	return true;
+	const size_t skippedZaps = std::count(zapMask.begin() + zapLimit, zapMask.end(), true);
+	if (skippedZaps > 0)
+		wxLogWarning("Skipped %u zapped vertices of shape '%s' with vertex indices above 65535.", static_cast<unsigned int>(skippedZaps), targetShape);
 }
 
 void BodySlideApp::CopySliderValues(bool toHigh) {
@@ -1211,7 +1177,7 @@ void BodySlideApp::InitPreview() {
 
 	preview->ShowWeight(activeSet.GenWeights());
 
-	activeSet.LoadSetDiffData(dataSets);
+	activeSet.LoadSetDiffData(dataSets, "", true);
 
 	std::vector<Vector3> verts;
 	std::vector<Vector2> uvs;
@@ -1225,7 +1191,7 @@ void BodySlideApp::InitPreview() {
 
 		previewBaseNif->GetUvsForShape(shape, uvs);
 
-		ApplySliders(it->second.targetShape, sliderManager.slidersBig, verts, zapIdx, &uvs);
+		ApplySliders(it->second.targetShape, verts, zapIdx, &uvs);
 
 		// Zap deleted verts before preview
 		shape = PreviewMod.FindBlockByName<NiShape>(it->first);
@@ -1292,9 +1258,10 @@ void BodySlideApp::UpdatePreview() {
 		uvsHigh = uvs;
 		uvsLow = uvs;
 
-		ApplySliders(it->second.targetShape, sliderManager.slidersBig, vertsHigh, zapIdx, &uvsHigh);
 		if (activeSet.GenWeights())
-			ApplySliders(it->second.targetShape, sliderManager.slidersSmall, vertsLow, zapIdx, &uvsLow);
+			ApplySliders(it->second.targetShape, vertsHigh, zapIdx, &uvsHigh, &vertsLow, &uvsLow);
+		else
+			ApplySliders(it->second.targetShape, vertsHigh, zapIdx, &uvsHigh);
 
 		// Calculate result of weight
 		auto uvsz = uvs.size();
@@ -1361,9 +1328,10 @@ void BodySlideApp::RebuildPreviewMeshes() {
 		uvsHigh = uvs;
 		uvsLow = uvs;
 
-		ApplySliders(it->second.targetShape, sliderManager.slidersBig, vertsHigh, zapIdx, &uvsHigh);
 		if (activeSet.GenWeights())
-			ApplySliders(it->second.targetShape, sliderManager.slidersSmall, vertsLow, zapIdx, &uvsLow);
+			ApplySliders(it->second.targetShape, vertsHigh, zapIdx, &uvsHigh, &vertsLow, &uvsLow);
+		else
+			ApplySliders(it->second.targetShape, vertsHigh, zapIdx, &uvsHigh);
 
 		// Calculate result of weight
 		for (size_t i = 0; i < verts.size(); i++) {
@@ -1404,33 +1372,7 @@ void BodySlideApp::UpdateMeshesFromSet() {
 }
 
 void BodySlideApp::ApplyReferenceNormals(NifFile& nif) {
-	for (auto& s : nif.GetShapes()) {
-		std::string shapeName = s->name.get();
-
-		if (refNormalsCache.find(shapeName) != refNormalsCache.end()) {
-			// Apply normals from file cache
-			NifFile& srcNif = refNormalsCache[shapeName];
-			nif.ApplyNormalsFromFile(srcNif, shapeName);
-		}
-		else {
-			// Check if reference normals file exists
-			wxString fileName = wxString::Format("%s/RefNormals/%s.nif", wxString::FromUTF8(Config["AppDir"]), wxString::FromUTF8(shapeName));
-			if (wxFile::Exists(fileName)) {
-				std::fstream file;
-				PlatformUtil::OpenFileStream(file, fileName.ToUTF8().data(), std::ios::in | std::ios::binary);
-
-				NifFile srcNif;
-				if (srcNif.Load(file) != 0)
-					continue;
-
-				// Apply normals from file
-				nif.ApplyNormalsFromFile(srcNif, shapeName);
-
-				// Move file to cache
-				refNormalsCache[shapeName] = std::move(srcNif);
-			}
-		}
-	}
+	refNormals.Apply(nif, Config["AppDir"]);
 }
 
 bool BodySlideApp::SetDefaultConfig() {
@@ -1448,6 +1390,7 @@ bool BodySlideApp::SetDefaultConfig() {
 	Config.SetDefaultBoolValue("WarnMissingGamePath", true);
 	Config.SetDefaultBoolValue("WarnBatchBuildOverride", true);
 	Config.SetDefaultBoolValue("BSATextureScan", true);
+	OutfitBuilder::SetDefaultConfig(Config);
 	Config.SetDefaultValue("LogLevel", "3");
 	Config.SetDefaultBoolValue("UseSystemLanguage", false);
 	BodySlideConfig.SetDefaultValue("SelectedOutfit", "");
@@ -2123,7 +2066,7 @@ int BodySlideApp::BuildBodies(bool localPath, bool clean, bool tri, bool forceNo
 		return 0;
 	}
 
-	refNormalsCache.clear();
+	refNormals.Clear();
 
 	std::fstream file;
 	PlatformUtil::OpenFileStream(file, inputFileName, std::ios::in | std::ios::binary);
@@ -2138,7 +2081,8 @@ int BodySlideApp::BuildBodies(bool localPath, bool clean, bool tri, bool forceNo
 		nifSmall.CopyFrom(nifBig);
 
 	dataSets.Clear();
-	activeSet.LoadSetDiffData(dataSets);
+	sliderHandles.clear();
+	activeSet.LoadSetDiffData(dataSets, "", true);
 
 	std::vector<Vector3> vertsLow;
 	std::vector<Vector3> vertsHigh;
@@ -2164,7 +2108,11 @@ int BodySlideApp::BuildBodies(bool localPath, bool clean, bool tri, bool forceNo
 
 		zapIdxAll.emplace(it->first, std::vector<uint16_t>());
 
-		ApplySliders(it->second.targetShape, sliderManager.slidersBig, vertsHigh, zapIdx, &uvsHigh);
+		if (activeSet.GenWeights())
+			ApplySliders(it->second.targetShape, vertsHigh, zapIdx, &uvsHigh, &vertsLow, &uvsLow);
+		else
+			ApplySliders(it->second.targetShape, vertsHigh, zapIdx, &uvsHigh);
+
 		nifBig.SetVertsForShape(shape, vertsHigh);
 		nifBig.SetUvsForShape(shape, uvsHigh);
 
@@ -2180,9 +2128,6 @@ int BodySlideApp::BuildBodies(bool localPath, bool clean, bool tri, bool forceNo
 			nifBig.DeleteShape(shape);
 
 		if (activeSet.GenWeights()) {
-			zapIdx.clear();
-			ApplySliders(it->second.targetShape, sliderManager.slidersSmall, vertsLow, zapIdx, &uvsLow);
-
 			auto shapeSmall = nifSmall.FindBlockByName<NiShape>(it->first);
 			nifSmall.SetVertsForShape(shapeSmall, vertsLow);
 			nifSmall.SetUvsForShape(shapeSmall, uvsLow);
@@ -2223,7 +2168,7 @@ int BodySlideApp::BuildBodies(bool localPath, bool clean, bool tri, bool forceNo
 		// Remove everything before and including the meshes path
 		triPathTrimmed = std::regex_replace(triPathTrimmed, std::regex(".*meshes\\\\", std::regex_constants::icase), "");
 
-		if (!WriteMorphTRI(outFileNameBig, activeSet, nifBig, zapIdxAll)) {
+		if (!OutfitBuilder::WriteMorphTRI(outFileNameBig, activeSet, nifBig, zapIdxAll)) {
 			wxLogError("Failed to write TRI file to '%s'!", triPath);
 			wxMessageBox(wxString().Format(_("Failed to write TRI file to the following location\n\n%s"), triPath), _("Unable to process"), wxOK | wxICON_ERROR);
 		}
@@ -2235,18 +2180,18 @@ int BodySlideApp::BuildBodies(bool localPath, bool clean, bool tri, bool forceNo
 					continue;
 
 				if (tri && shape->GetNumVertices() > 0) {
-					AddTriData(nifBig, targetShape->first, triPathTrimmed);
+					OutfitBuilder::AddTriData(nifBig, targetShape->first, triPathTrimmed);
 					if (activeSet.GenWeights())
-						AddTriData(nifSmall, targetShape->first, triPathTrimmed);
+						OutfitBuilder::AddTriData(nifSmall, targetShape->first, triPathTrimmed);
 
 					tri = false;
 				}
 			}
 		}
 		else {
-			AddTriData(nifBig, "", triPathTrimmed, true);
+			OutfitBuilder::AddTriData(nifBig, "", triPathTrimmed, true);
 			if (activeSet.GenWeights())
-				AddTriData(nifSmall, "", triPathTrimmed, true);
+				OutfitBuilder::AddTriData(nifSmall, "", triPathTrimmed, true);
 		}
 
 		// Set all shapes to dynamic/mutable
@@ -2342,8 +2287,13 @@ int BodySlideApp::BuildBodies(bool localPath, bool clean, bool tri, bool forceNo
 	return 0;
 }
 
-int BodySlideApp::BuildListBodies(
-	std::vector<std::string>& outfitList, std::map<std::string, std::string>& failedOutfits, bool clean, bool tri, bool forceNormals, const std::string& custPath) {
+int BodySlideApp::BuildListBodies(std::vector<std::string>& outfitList,
+								  std::map<std::string, std::string>& failedOutfits,
+								  bool clean,
+								  bool tri,
+								  bool forceNormals,
+								  const std::string& custPath,
+								  const std::vector<OutfitBuildTarget>& targets) {
 	std::string datapath = custPath;
 
 	wxLogMessage("Started batch build with options: Custom Path = %s, Cleaning = %s, TRI = %s",
@@ -2351,6 +2301,9 @@ int BodySlideApp::BuildListBodies(
 				 clean ? "True" : "False",
 				 tri ? "True" : "False");
 
+	for (auto& target : targets)
+		wxLogMessage("Building preset '%s' to '%s'.", target.preset, target.dataPath);
+
 	if (clean) {
 		int ret = wxMessageBox(_("WARNING: This will delete the output files from the output folders, potentially causing crashes.\n\nDo you want to continue?"),
 							   _("Clean Batch Build"),
@@ -2363,7 +2316,7 @@ int BodySlideApp::BuildListBodies(
 
 	std::string activePreset = BodySlideConfig["SelectedPreset"];
 
-	if (datapath.empty()) {
+	if (datapath.empty() && targets.empty()) {
 		if (GetOutputDataPath().empty()) {
 			if (clean) {
 				wxLogError("Aborted batch clean with unconfigured data path. Files can't be removed that way.");
@@ -2498,389 +2451,136 @@ int BodySlideApp::BuildListBodies(
 		}
 	}
 
-	refNormalsCache.clear();
+	OutfitBuildOptions buildOptions;
+	buildOptions.dataPath = datapath;
+	buildOptions.projectPath = GetProjectPath();
+	buildOptions.appDir = Config["AppDir"];
+	buildOptions.preset = activePreset;
+	buildOptions.clean = clean && custPath.empty();
+	buildOptions.tri = tri;
+	buildOptions.forceNormals = forceNormals;
+	buildOptions.triOnRoot = targetGame == FO4 || targetGame == FO4VR || targetGame == FO76;
+
+	// Skip outfits that haven't changed since the last build
+	BuildManifest manifest;
+	manifest.Load(Config["AppDir"] + PathSepStr + "BuildManifest.xml");
+	buildOptions.manifest = &manifest;
+	buildOptions.rebuildAll = !Config.MatchValue("IncrementalBuilds", "true");
+	buildOptions.sliderSetIndex = &sliderSetIndex;
+	buildOptions.memoryLimit = OutfitBuilder::GetMemoryLimit(Config.GetIntValue("BuildMemoryLimit"));
+	buildOptions.targets = targets;
+
+	OutfitBuilder builder(sliderManager, buildOptions);
+
+	const auto& buildTargets = builder.GetOptions().targets;
+	int totalCount = (int)(outfitList.size() * buildTargets.size());
+
+	// Outfits are named with their preset if more than one is built
+	auto resultName = [&](const std::string& outfit, size_t target) {
+		if (buildTargets.size() > 1)
+			return outfit + " (" + buildTargets[target].preset + ")";
+
+		return outfit;
+	};
 
 	wxProgressDialog progWnd(_("Processing Outfits"), _("Starting..."), 1000, sliderView, wxPD_AUTO_HIDE | wxPD_APP_MODAL | wxPD_ELAPSED_TIME);
 	progWnd.SetSize(400, 150);
-	float progstep = 1000.0f / outfitList.size();
+	float progstep = 1000.0f / totalCount;
 	std::atomic<int> count = 0;
+	std::atomic<int> upToDateCount = 0;
 
-#ifdef _PPL_H
-	concurrency::concurrent_unordered_map<std::string, std::string> failedOutfitsCon;
-#else
-	std::unordered_map<std::string, std::string> failedOutfitsCon;
-#endif
-
-	auto buildOutfit = [&](const std::string& outfit) {
-		wxString progMsg = wxString::Format(_("Processing '%s' (%d of %d)..."), outfit, ++count, (int)outfitList.size());
-		progWnd.Update((int)(count * progstep) - 1, progMsg);
-		progWnd.Fit();
+	// Outfits are built on worker threads, the progress dialog is only updated from the main thread
+	std::mutex progMutex;
+	wxString progMsg;
 
-		wxLogMessage(progMsg);
-
-		/* Load set */
-		if (outfitNameSource.find(outfit) == outfitNameSource.end()) {
-			failedOutfitsCon[outfit] = _("No recorded outfit name source");
-			return;
-		}
+	std::mutex failedMutex;
+	std::map<std::string, std::string> failedOutfitsCon;
 
-		SliderSet currentSet;
-		DiffDataSets currentDiffs;
+	BuildStatsReport statsReport;
 
-		SliderSetFile sliderDoc;
-		sliderDoc.Open(outfitNameSource[outfit]);
-		if (!sliderDoc.fail()) {
-			if (sliderDoc.GetSet(outfit, currentSet)) {
-				failedOutfitsCon[outfit] = _("Unable to get slider set from file: ") + outfitNameSource[outfit];
-				return;
-			}
-		}
+	std::vector<std::pair<std::string, std::string>> buildList;
+	for (auto& outfit : outfitList) {
+		auto source = outfitNameSource.find(outfit);
+		if (source != outfitNameSource.end())
+			buildList.emplace_back(outfit, source->second);
 		else {
-			failedOutfitsCon[outfit] = _("Unable to open slider set file: ") + outfitNameSource[outfit];
-			return;
-		}
-
-		currentSet.SetBaseDataPath(GetProjectPath() + PathSepStr + "ShapeData");
-
-		// ALT key
-		if (clean && custPath.empty()) {
-			bool genWeights = currentSet.GenWeights();
-
-			wxString removePath = wxString::FromUTF8(datapath + currentSet.GetOutputFilePath());
-			wxString removeHigh = removePath + ".nif";
-			if (genWeights)
-				removeHigh = removePath + "_1.nif";
-
-			if (wxFileName::FileExists(removeHigh))
-				wxRemoveFile(removeHigh);
+			for (size_t t = 0; t < buildTargets.size(); t++)
+				failedOutfitsCon[resultName(outfit, t)] = _("No recorded outfit name source").ToUTF8();
 
-			if (!genWeights)
-				return;
-
-			wxString removeLow = removePath + "_0.nif";
-			if (wxFileName::FileExists(removeLow))
-				wxRemoveFile(removeLow);
-
-			return;
+			count += (int)buildTargets.size();
 		}
+	}
 
-		/* Load input NIFs */
-		std::fstream file;
-		PlatformUtil::OpenFileStream(file, currentSet.GetInputFileName(), std::ios::in | std::ios::binary);
-
-		NifFile nifBig;
-		NifFile nifSmall;
-		if (nifBig.Load(file)) {
-			failedOutfitsCon[outfit] = _("Unable to load input nif: ") + currentSet.GetInputFileName();
-			return;
-		}
-
-		if (currentSet.GenWeights())
-			nifSmall.CopyFrom(nifBig);
-
-		currentSet.LoadSetDiffData(currentDiffs);
-
-		// Load BuildSelection file for zap choices
-		BuildSelectionFile buildSelFile;
-		BuildSelection buildSelection;
-		GetBuildSelection(buildSelFile, buildSelection);
-
-		/* Shape the NIF files */
-		std::vector<Vector3> vertsLow;
-		std::vector<Vector3> vertsHigh;
-		std::vector<Vector2> uvsLow;
-		std::vector<Vector2> uvsHigh;
-		std::vector<int> clamps;
-		std::vector<uint16_t> zapIdx;
-		std::unordered_map<std::string, std::vector<uint16_t>> zapIdxAll;
-
-		for (size_t s = 0; s < currentSet.size(); s++) {
-			std::string name = currentSet[s].name;
-
-			if (currentSet[s].bClamp) {
-				clamps.push_back(s);
-				continue;
-			}
-
-			if (currentSet[s].bZap && !currentSet[s].bUV) {
-				float vbig = sliderManager.GetBigPresetValue(activePreset, name, currentSet[s].defBigValue / 100.0f);
-				for (auto& sliderBig : sliderManager.slidersBig) {
-					if (sliderBig.name == name && sliderBig.changed && !sliderBig.clamp) {
-						vbig = sliderBig.value;
-						break;
-					}
-				}
-
-				if (!currentSet[s].bHidden) {
-					// Apply stored zap choice for zaps visible to the user
-					if (buildSelection.HasZapChoice(currentSet.GetName(), name)) {
-						bool zapChoice = buildSelection.GetZapChoice(currentSet.GetName(), name);
-						vbig = zapChoice ? 1.0f : 0.0f;
-					}
-				}
-
-				// Apply zap toggles if zap is not in default state
-				if (vbig != currentSet[s].defBigValue / 100.0f) {
-					for (auto& zapToggle : currentSet[s].zapToggles) {
-						// Toggled zap default values are read in later code if no preset overwrites it
-						auto& slider = currentSet[zapToggle];
-						slider.defBigValue = 100.0f - slider.defBigValue;
-						slider.defSmallValue = 100.0f - slider.defSmallValue;
-					}
-				}
-			}
-		}
-
-		for (auto it = currentSet.ShapesBegin(); it != currentSet.ShapesEnd(); ++it) {
-			auto shape = nifBig.FindBlockByName<NiShape>(it->first);
-			if (!nifBig.GetVertsForShape(shape, vertsHigh))
-				continue;
-
-			nifBig.GetUvsForShape(shape, uvsHigh);
-
-			if (currentSet.GenWeights()) {
-				auto shapeSmall = nifSmall.FindBlockByName<NiShape>(it->first);
-				if (!nifSmall.GetVertsForShape(shapeSmall, vertsLow))
-					continue;
-
-				nifSmall.GetUvsForShape(shapeSmall, uvsLow);
-			}
-
-			float vbig = 0.0f;
-			float vsmall = 0.0f;
-			zapIdxAll.emplace(it->first, std::vector<uint16_t>());
-
-			for (size_t s = 0; s < currentSet.size(); s++) {
-				std::string name = currentSet[s].name;
-				std::string target = it->second.targetShape;
-				std::string dn = currentSet[s].TargetDataName(target);
-				if (dn.empty())
-					continue;
-
-				vbig = sliderManager.GetBigPresetValue(activePreset, name, currentSet[s].defBigValue / 100.0f);
-				for (auto& sliderBig : sliderManager.slidersBig) {
-					if (sliderBig.name == name && sliderBig.changed && !sliderBig.clamp) {
-						vbig = sliderBig.value;
-						break;
-					}
-				}
-
-				if (currentSet.GenWeights()) {
-					vsmall = sliderManager.GetSmallPresetValue(activePreset, name, currentSet[s].defSmallValue / 100.0f);
-					for (auto& sliderSmall : sliderManager.slidersSmall) {
-						if (sliderSmall.name == name && sliderSmall.changed && !sliderSmall.clamp) {
-							vsmall = sliderSmall.value;
-							break;
-						}
-					}
-				}
-
-				if (currentSet[s].bInvert) {
-					vbig = 1.0f - vbig;
-					if (currentSet.GenWeights())
-						vsmall = 1.0f - vsmall;
-				}
-
-				if (currentSet[s].bZap && !currentSet[s].bUV) {
-					if (!currentSet[s].bHidden) {
-						// Apply stored zap choice for zaps visible to the user
-						if (buildSelection.HasZapChoice(currentSet.GetName(), name)) {
-							bool zapChoice = buildSelection.GetZapChoice(currentSet.GetName(), name);
-							vbig = zapChoice ? 1.0f : 0.0f;
-						}
-					}
-
-					if (vbig > 0.0f) {
-						currentDiffs.GetDiffIndices(dn, target, zapIdx);
-						zapIdxAll[it->first] = zapIdx;
-					}
-					continue;
-				}
-
-				if (currentSet[s].bUV)
-					currentDiffs.ApplyUVDiff(dn, target, vbig, &uvsHigh);
-				else
-					currentDiffs.ApplyDiff(dn, target, vbig, &vertsHigh);
-
-				if (currentSet.GenWeights()) {
-					if (currentSet[s].bUV)
-						currentDiffs.ApplyUVDiff(dn, target, vsmall, &uvsLow);
-					else
-						currentDiffs.ApplyDiff(dn, target, vsmall, &vertsLow);
-				}
-			}
-
-			if (!clamps.empty()) {
-				for (auto& c : clamps) {
-					std::string dn = currentSet[c].TargetDataName(it->second.targetShape);
-					std::string target = it->second.targetShape;
-					if (currentSet[c].defBigValue > 0)
-						currentDiffs.ApplyClamp(dn, target, &vertsHigh);
-
-					if (currentSet.GenWeights())
-						if (currentSet[c].defSmallValue > 0)
-							currentDiffs.ApplyClamp(dn, target, &vertsLow);
-				}
-			}
-
-			nifBig.SetVertsForShape(shape, vertsHigh);
-			nifBig.SetUvsForShape(shape, uvsHigh);
-
-			if (!it->second.lockNormals) {
-				nifBig.CalcNormalsForShape(shape, forceNormals, it->second.smoothSeamNormals);
-
-				if (forceNormals)
-					ApplyReferenceNormals(nifBig);
-			}
-
-			nifBig.CalcTangentsForShape(shape);
-			if (nifBig.DeleteVertsForShape(shape, zapIdx))
-				nifBig.DeleteShape(shape);
-
-			if (currentSet.GenWeights()) {
-				auto shapeSmall = nifSmall.FindBlockByName<NiShape>(it->first);
-				nifSmall.SetVertsForShape(shapeSmall, vertsLow);
-				nifSmall.SetUvsForShape(shapeSmall, uvsLow);
-
-				if (!it->second.lockNormals) {
-					nifSmall.CalcNormalsForShape(shapeSmall, forceNormals, it->second.smoothSeamNormals);
-
-					if (forceNormals)
-						ApplyReferenceNormals(nifSmall);
-				}
-
-				nifSmall.CalcTangentsForShape(shapeSmall);
-				if (nifSmall.DeleteVertsForShape(shapeSmall, zapIdx))
-					nifSmall.DeleteShape(shapeSmall);
-			}
+	auto outfitFinished = [&](const OutfitBuildResult& result) {
+		std::string name = resultName(result.outfit, result.target);
+		wxString outfitMsg = wxString::Format(_("Processed '%s' (%d of %d)..."), name, ++count, totalCount);
+		wxLogMessage(outfitMsg);
 
-			zapIdx.clear();
+		{
+			std::lock_guard<std::mutex> lock(progMutex);
+			progMsg = outfitMsg;
 		}
 
-		currentDiffs.Clear();
-
-		/* Create directory for the outfit */
-		wxString dir = wxString::FromUTF8(datapath + currentSet.GetOutputPath());
-		bool success = wxFileName::Mkdir(dir, wxS_DIR_DEFAULT, wxPATH_MKDIR_FULL);
-
-		if (!success) {
-			failedOutfitsCon[outfit] = _("Unable to create destination directory: ") + dir.ToUTF8().data();
-			return;
+		if (result.status == OutfitBuildStatus::UpToDate) {
+			wxLogMessage("'%s' is up to date.", name);
+			upToDateCount++;
 		}
 
-		std::string outFileNameSmall = datapath + currentSet.GetOutputFilePath();
-		std::string outFileNameBig = outFileNameSmall;
-
-		bool triKeep = currentSet.PreventMorphFile();
+		if (result.status == OutfitBuildStatus::Built)
+			statsReport.Add(result.outfit, buildTargets[result.target].preset, result.seconds, result.stats);
 
-		if (tri && !triKeep) {
-			std::string triFilePath = outFileNameBig + ".tri";
-
-			// TRI file already exists but isn't a body TRI file, don't overwrite!
-			if (wxFileName::FileExists(wxString::FromUTF8(triFilePath)) && !IsBodyTriFile(triFilePath))
-				triKeep = true;
+		if (result.status == OutfitBuildStatus::Failed) {
+			std::lock_guard<std::mutex> lock(failedMutex);
+			failedOutfitsCon[name] = result.error;
 		}
+	};
 
-		/* Add TRI path for in-game morphs */
-		if (tri && !triKeep) {
-			bool triEnd = tri;
-			std::string triPath = currentSet.GetOutputFilePath() + ".tri";
-			std::string triPathTrimmed = triPath;
-			triPathTrimmed = std::regex_replace(triPathTrimmed, std::regex("/+|\\\\+"),
-												"\\"); // Replace multiple backslashes or forward slashes with one backslash
-			triPathTrimmed = std::regex_replace(triPathTrimmed,
-												std::regex(".*meshes\\\\", std::regex_constants::icase),
-												""); // Remove everything before and including the meshes path
-
-			if (!WriteMorphTRI(outFileNameBig, currentSet, nifBig, zapIdxAll))
-				wxLogError("Failed to create TRI file to '%s'!", triPath);
-
-			if (targetGame != FO4 && targetGame != FO4VR && targetGame != FO76) {
-				for (auto targetShape = currentSet.ShapesBegin(); targetShape != currentSet.ShapesEnd(); ++targetShape) {
-					auto shape = nifBig.FindBlockByName<NiShape>(targetShape->first);
-					if (!shape)
-						continue;
-
-					if (triEnd && shape->GetNumVertices() > 0) {
-						AddTriData(nifBig, targetShape->first, triPathTrimmed);
-						if (currentSet.GenWeights())
-							AddTriData(nifSmall, targetShape->first, triPathTrimmed);
-
-						triEnd = false;
-					}
-				}
-			}
-			else {
-				AddTriData(nifBig, "", triPathTrimmed, true);
-				if (currentSet.GenWeights())
-					AddTriData(nifSmall, "", triPathTrimmed, true);
-			}
-
-			// Set all shapes to dynamic/mutable
-			for (auto it = currentSet.ShapesBegin(); it != currentSet.ShapesEnd(); ++it) {
-				nifBig.SetShapeDynamic(it->first);
-				if (currentSet.GenWeights())
-					nifSmall.SetShapeDynamic(it->first);
+	// Build pipeline is run on a separate thread
+	std::atomic<bool> buildDone = false;
+	std::thread buildThread([&] {
+		builder.BuildAll(buildList, outfitFinished);
+		buildDone = true;
+	});
+
+	// Yield and update progress outside of the build thread
+	while (!buildDone) {
+		{
+			std::lock_guard<std::mutex> lock(progMutex);
+			if (!progMsg.IsEmpty()) {
+				progWnd.Update((int)(count * progstep) - 1, progMsg);
+				progWnd.Fit();
 			}
 		}
-		else if (!triKeep) {
-			std::string triPath = outFileNameBig + ".tri";
-			if (IsBodyTriFile(triPath))
-				wxRemoveFile(triPath);
-		}
 
-		NifSaveOptions nifOptions;
-		nifOptions.optimize = false;
+		Yield();
+		wxMilliSleep(100);
+	}
 
-		/* Set filenames for the outfit */
-		if (currentSet.GenWeights()) {
-			outFileNameSmall += "_0.nif";
-			outFileNameBig += "_1.nif";
+	buildThread.join();
 
-			std::fstream fileBig;
-			PlatformUtil::OpenFileStream(fileBig, outFileNameBig, std::ios::out | std::ios::binary);
+	if (!manifest.Save())
+		wxLogWarning("Failed to save build manifest.");
 
-			if (nifBig.Save(fileBig, nifOptions)) {
-				failedOutfitsCon[outfit] = _("Unable to save nif file: ") + outFileNameBig;
-				return;
-			}
+	if (upToDateCount > 0)
+		wxLogMessage("%d of %d sets were up to date and skipped.", (int)upToDateCount, totalCount);
 
-			std::fstream fileSmall;
-			PlatformUtil::OpenFileStream(fileSmall, outFileNameSmall, std::ios::out | std::ios::binary);
+	statsReport.LogSummary();
+	DiffDataCache::DedupStats dedupStats = DiffDataCache::Get().GetDedupStats();
+	if (dedupStats.duplicates > 0)
+		wxLogMessage("Diff data deduplication: %zu of %zu sets shared, %zu KB saved.", dedupStats.duplicates, dedupStats.sets, dedupStats.bytesSaved / 1024);
 
-			if (nifSmall.Save(fileSmall, nifOptions)) {
-				failedOutfitsCon[outfit] = _("Unable to save nif file: ") + outFileNameSmall;
-				return;
-			}
-		}
-		else {
-			outFileNameBig += ".nif";
+	MorphCache::Stats morphStats = MorphCache::Get().GetStats();
+	if (morphStats.hits > 0)
+		wxLogMessage("Baked morphs: %zu of %zu shapes reused combined slider diffs.", morphStats.hits, morphStats.hits + morphStats.misses);
 
-			std::fstream fileBig;
-			PlatformUtil::OpenFileStream(fileBig, outFileNameBig, std::ios::out | std::ios::binary);
+	std::string statsFile = Config["BuildStatsFile"];
+	if (!statsFile.empty()) {
+		if (wxFileName(wxString::FromUTF8(statsFile)).IsRelative())
+			statsFile = Config["AppDir"] + PathSepStr + statsFile;
 
-			if (nifBig.Save(fileBig, nifOptions)) {
-				failedOutfitsCon[outfit] = _("Unable to save nif file: ") + outFileNameBig;
-				return;
-			}
-		}
-	};
-
-	// Multi-threading for 64-bit only due to memory limits of 32-bit builds
-#ifdef _PPL_H
-	// Parallel loop is run inside a task
-	auto buildTask = concurrency::create_task([&] { concurrency::parallel_for_each(outfitList.begin(), outfitList.end(), buildOutfit); });
-
-	// Yield outside of task
-	while (!buildTask.is_done()) {
-		Yield();
-		wxMilliSleep(100);
+		if (!statsReport.Write(statsFile))
+			wxLogWarning("Failed to write build statistics to '%s'.", statsFile);
 	}
-#else
-	for (auto& outfit : outfitList) {
-		buildOutfit(outfit);
-	}
-#endif
 
 	progWnd.Update(1000);
 
@@ -2906,20 +2606,39 @@ void BodySlideApp::GroupBuild(const std::vector<std::string>& groupNames) {
 		}
 	}
 
-	std::string preset;
-	if (!cmdPreset.empty()) {
-		preset = BodySlideConfig["SelectedPreset"];
-		BodySlideConfig.SetValue("SelectedPreset", cmdPreset);
-	}
-
 	std::vector<std::string> groups;
 	sliderManager.LoadPresets(GetProjectPath() + "/SliderPresets", "", groups, true);
 
 	std::map<std::string, std::string> failedOutfits;
-	int ret = BuildListBodies(outfits, failedOutfits, false, cmdTri, false, cmdTargetDir);
+	int ret = 0;
 
-	if (!cmdPreset.empty())
-		BodySlideConfig.SetValue("SelectedPreset", preset);
+	if (cmdPresets.size() > 1) {
+		// Each outfit is read once and built with every preset into the target directory of the preset
+		if (cmdTargetDirs.size() == cmdPresets.size()) {
+			std::vector<OutfitBuildTarget> targets;
+			for (size_t i = 0; i < cmdPresets.size(); i++)
+				targets.push_back({cmdPresets[i], cmdTargetDirs[i]});
+
+			ret = BuildListBodies(outfits, failedOutfits, false, cmdTri, false, "", targets);
+		}
+		else {
+			wxLogError("Building %zu presets requires as many target directories, %zu were specified.", cmdPresets.size(), cmdTargetDirs.size());
+			ret = 1;
+		}
+	}
+	else {
+		std::string preset;
+		if (!cmdPresets.empty()) {
+			preset = BodySlideConfig["SelectedPreset"];
+			BodySlideConfig.SetValue("SelectedPreset", cmdPresets.front());
+		}
+
+		std::string targetDir = cmdTargetDirs.empty() ? "" : cmdTargetDirs.front();
+		ret = BuildListBodies(outfits, failedOutfits, false, cmdTri, false, targetDir);
+
+		if (!cmdPresets.empty())
+			BodySlideConfig.SetValue("SelectedPreset", preset);
+	}
 
 	wxLog::FlushActive();
 
@@ -2941,22 +2660,6 @@ void BodySlideApp::GroupBuild(const std::vector<std::string>& groupNames) {
 	sliderView->Close(true);
 }
 
-void BodySlideApp::AddTriData(NifFile& nif, const std::string& shapeName, const std::string& triPath, bool toRoot) {
-	NiAVObject* target = nullptr;
-
-	if (toRoot)
-		target = nif.GetRootNode();
-	else
-		target = nif.FindBlockByName<NiShape>(shapeName);
-
-	if (target) {
-		auto triExtraData = std::make_unique<NiStringExtraData>();
-		triExtraData->name.get() = "BODYTRI";
-		triExtraData->stringData.get() = triPath;
-		nif.AssignExtraData(target, std::move(triExtraData));
-	}
-}
-
 float BodySlideApp::GetSliderValue(const wxString& sliderName, bool isLo) {
 	std::string sstr{sliderName.ToUTF8()};
 	return sliderManager.GetSlider(sstr, isLo);
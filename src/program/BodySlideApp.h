@@ -18,13 +18,16 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #pragma once
 
 #include "../components/BuildSelection.h"
+#include "../components/OutfitBuilder.h"
 #include "../components/SliderCategories.h"
 #include "../components/SliderData.h"
 #include "../components/SliderGroup.h"
 #include "../components/SliderManager.h"
+#include "../components/SliderSetIndex.h"
 #include "../files/TriFile.h"
 #include "../utils/ConfigurationManager.h"
 #include "../utils/Log.h"
+#include "../utils/TargetGame.h"
 #include "GroupManager.h"
 #include "PresetSaveDialog.h"
 #include "PreviewWindow.h"
@@ -50,8 +53,6 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <wx/xrc/xmlres.h>
 
 
-enum TargetGame { FO3, FONV, SKYRIM, FO4, SKYRIMSE, FO4VR, SKYRIMVR, FO76, OB, SF };
-
 class BodySlideFrame;
 
 class BodySlideApp : public wxApp {
@@ -61,8 +62,8 @@ class BodySlideApp : public wxApp {
 
 	/* Command-Line Arguments */
 	std::vector<std::string> cmdGroupBuild;
-	std::string cmdTargetDir;
-	std::string cmdPreset;
+	std::vector<std::string> cmdTargetDirs;
+	std::vector<std::string> cmdPresets;
 	bool cmdTri = false;
 
 	/* Localization */
@@ -72,7 +73,9 @@ class BodySlideApp : public wxApp {
 	/* Data Managers */
 	SliderManager sliderManager;
 	DiffDataSets dataSets;
+	std::map<std::string, std::vector<DiffHandle>> sliderHandles; // Per target shape, handles of the data sets linked to the sliders in order
 	SliderSet activeSet;
+	SliderSetIndex sliderSetIndex;
 	Log logger;
 
 	/* Data Items */
@@ -88,7 +91,7 @@ class BodySlideApp : public wxApp {
 	SliderSetGroupCollection gCollection;
 
 	/* Cache */
-	std::map<std::string, nifly::NifFile, case_insensitive_compare> refNormalsCache; // Cache for reference normals files
+	RefNormalsCache refNormals; // Cache for reference normals files
 
 	std::string previewBaseName;
 	std::string previewSetName;
@@ -168,12 +171,14 @@ public:
 	void EditProject(const std::string& projectName);
 	void LaunchOutfitStudio(const wxString& args = "");
 
+	// Applies the big sliders to verts and uvs and, if vertsLow is set, the small sliders to vertsLow and uvsLow in the same pass.
+	// zapidx is set to the vertices zapped by either in ascending order.
 	void ApplySliders(const std::string& targetShape,
-					  std::vector<Slider>& sliderSet,
 					  std::vector<nifly::Vector3>& verts,
 					  std::vector<uint16_t>& zapidx,
-					  std::vector<nifly::Vector2>* uvs = nullptr);
-	bool WriteMorphTRI(const std::string& triPath, SliderSet& sliderSet, nifly::NifFile& nif, std::unordered_map<std::string, std::vector<uint16_t>>& zapIndices);
+					  std::vector<nifly::Vector2>* uvs = nullptr,
+					  std::vector<nifly::Vector3>* vertsLow = nullptr,
+					  std::vector<nifly::Vector2>* uvsLow = nullptr);
 
 	void CopySliderValues(bool toHigh);
 	void ShowPreview();
@@ -198,11 +203,10 @@ public:
 						bool remove = false,
 						bool tri = false,
 						bool forceNormals = false,
-						const std::string& custPath = "");
+						const std::string& custPath = "",
+						const std::vector<OutfitBuildTarget>& targets = {});
 	void GroupBuild(const std::vector<std::string>& groupNames);
 
-	void AddTriData(nifly::NifFile& nif, const std::string& shapeName, const std::string& triPath, bool toRoot = false);
-
 	float GetSliderValue(const wxString& sliderName, bool isLo);
 	bool IsUVSlider(const wxString& sliderName);
 	std::vector<std::string> GetSliderZapToggles(const wxString& sliderName);
@@ -214,8 +218,8 @@ public:
 };
 
 static const wxCmdLineEntryDesc g_cmdLineDesc[] = {{wxCMD_LINE_OPTION, "gbuild", "groupbuild", "builds the specified group on launch", wxCMD_LINE_VAL_STRING},
-												   {wxCMD_LINE_OPTION, "t", "targetdir", "build target directory, defaults to game data path", wxCMD_LINE_VAL_STRING},
-												   {wxCMD_LINE_OPTION, "p", "preset", "preset used for the build, defaults to last used preset", wxCMD_LINE_VAL_STRING},
+												   {wxCMD_LINE_OPTION, "t", "targetdir", "build target directory, defaults to game data path. One per preset, separated by commas, if several presets are built", wxCMD_LINE_VAL_STRING},
+												   {wxCMD_LINE_OPTION, "p", "preset", "preset used for the build, defaults to last used preset. Several presets separated by commas are built in one pass", wxCMD_LINE_VAL_STRING},
 												   {wxCMD_LINE_SWITCH, "tri", "trimorphs", "enables tri morph output for the specified build"},
 												   wxCMD_LINE_DESC_END};
 
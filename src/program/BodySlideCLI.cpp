@@ -0,0 +1,500 @@
+/*
+BodySlide and Outfit Studio
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "BodySlideCLI.h"
+#include "../components/DiffDataCache.h"
+#include "../components/MorphCache.h"
+#include "../utils/PlatformUtil.h"
+#include "../utils/StringStuff.h"
+#include "../utils/ThreadPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <wx/dir.h>
+#include <wx/stdpaths.h>
+#include <wx/tokenzr.h>
+#include <wx/utils.h>
+
+ConfigurationManager Config;
+ConfigurationManager BodySlideConfig;
+
+wxIMPLEMENT_APP_CONSOLE(BodySlideCLI);
+
+namespace {
+const char* StatusName(OutfitBuildStatus status) {
+	switch (status) {
+		case OutfitBuildStatus::Built: return "built";
+		case OutfitBuildStatus::UpToDate: return "up-to-date";
+		case OutfitBuildStatus::Cleaned: return "cleaned";
+		case OutfitBuildStatus::Skipped: return "skipped";
+		default: return "failed";
+	}
+}
+
+void SplitList(const wxString& list, std::vector<std::string>& outItems) {
+	wxStringTokenizer tokenizer(list, ",");
+	while (tokenizer.HasMoreTokens()) {
+		wxString token = tokenizer.GetNextToken().Trim().Trim(false);
+		if (!token.IsEmpty())
+			outItems.push_back(token.ToUTF8().data());
+	}
+}
+} // namespace
+
+void BodySlideCLI::OnInitCmdLine(wxCmdLineParser& parser) {
+	parser.SetDesc(g_cmdLineDesc);
+}
+
+bool BodySlideCLI::OnCmdLineParsed(wxCmdLineParser& parser) {
+	wxString gbuild;
+	if (parser.Found("gbuild", &gbuild))
+		SplitList(gbuild, cmdGroupBuild);
+
+	wxString outfits;
+	if (parser.Found("o", &outfits))
+		SplitList(outfits, cmdOutfits);
+
+	if (cmdGroupBuild.empty() && cmdOutfits.empty()) {
+		parser.Usage();
+		return false;
+	}
+
+	wxString targetDirs;
+	if (parser.Found("t", &targetDirs))
+		SplitList(targetDirs, cmdTargetDirs);
+
+	for (auto& targetDir : cmdTargetDirs)
+		if (targetDir.back() != PathSepChar)
+			targetDir += PathSepChar;
+
+	wxString presets;
+	if (parser.Found("p", &presets))
+		SplitList(presets, cmdPresets);
+
+	wxString report;
+	parser.Found("r", &report);
+	cmdReport = report.ToUTF8().data();
+
+	wxString stats;
+	parser.Found("s", &stats);
+	cmdStats = stats.ToUTF8().data();
+
+	wxString appDir;
+	parser.Found("a", &appDir);
+	cmdAppDir = appDir.ToUTF8().data();
+
+	parser.Found("j", &cmdThreads);
+
+	cmdTri = parser.Found("tri");
+	cmdForceNormals = parser.Found("n");
+	cmdForce = parser.Found("f");
+	return true;
+}
+
+bool BodySlideCLI::OnInit() {
+	if (!wxAppConsole::OnInit())
+		return false;
+
+	std::string dataDir = cmdAppDir;
+	if (dataDir.empty()) {
+#ifdef _DEBUG
+		dataDir = wxGetCwd().ToUTF8();
+#else
+		dataDir = wxStandardPaths::Get().GetDataDir().ToUTF8();
+#endif
+	}
+
+	if (Config.LoadConfig(dataDir + "/Config.xml")) {
+		wxLogError("Failed to load '%s/Config.xml'.", dataDir);
+		return false;
+	}
+
+	BodySlideConfig.LoadConfig(dataDir + "/BodySlide.xml", "BodySlideConfig");
+
+	Config.SetDefaultValue("AppDir", dataDir);
+	OutfitBuilder::SetDefaultConfig(Config);
+
+	int logLevel = Config.GetIntValue("LogLevel", 3);
+	if (logLevel >= 0)
+		wxLog::SetLogLevel(logLevel);
+	else
+		wxLog::EnableLogging(false);
+
+	OutfitBuilder::ApplyConfig(Config, cmdThreads);
+
+	// The command line doesn't write slider data, so cached data can reference the mapped files
+	DiffDataCache::Get().SetKeepMapped(true);
+	return true;
+}
+
+std::string BodySlideCLI::GetOutputDataPath() const {
+	std::string res = Config["OutputDataPath"];
+	return res.empty() ? Config["GameDataPath"] : res;
+}
+
+std::string BodySlideCLI::GetProjectPath() const {
+	std::string res = Config["ProjectPath"];
+	return res.empty() ? Config["AppDir"] : res;
+}
+
+void BodySlideCLI::LoadSliderSets() {
+	wxLogMessage("Loading all slider sets...");
+	outfitNameSource.clear();
+	outfitNameOrder.clear();
+	outFileCount.clear();
+
+	wxArrayString files;
+	wxDir::GetAllFiles(wxString::FromUTF8(GetProjectPath()) + "/SliderSets", &files, "*.osp");
+	wxDir::GetAllFiles(wxString::FromUTF8(GetProjectPath()) + "/SliderSets", &files, "*.xml");
+
+	// Only files that changed since the last run are parsed
+	std::vector<std::string> fileNames(files.size());
+	std::vector<std::vector<SliderSetIndex::SetInfo>> fileSets(files.size());
+	std::vector<char> fileRead(files.size(), false);
+
+	for (size_t i = 0; i < files.size(); i++)
+		fileNames[i] = files[i].ToUTF8();
+
+	sliderSetIndex.Load(Config["AppDir"] + PathSepStr + "SliderSetIndex.bin");
+	ThreadPool::Get().ParallelFor(files.size(), [&](size_t i) { fileRead[i] = sliderSetIndex.GetFileSets(fileNames[i], fileSets[i]); });
+
+	for (size_t i = 0; i < files.size(); i++) {
+		if (!fileRead[i])
+			continue;
+
+		for (auto& setInfo : fileSets[i]) {
+			const std::string& o = setInfo.name;
+			if (outfitNameSource.find(o) != outfitNameSource.end())
+				continue;
+
+			outfitNameSource[o] = fileNames[i];
+			outfitNameOrder.push_back(o);
+
+			if (!setInfo.outputFilePath.empty())
+				outFileCount[setInfo.outputFilePath].push_back(o);
+		}
+	}
+
+	if (!sliderSetIndex.Save())
+		wxLogWarning("Failed to save slider set index.");
+}
+
+void BodySlideCLI::GetBuildList(std::vector<std::string>& outfits, std::vector<OutfitBuildResult>& report) {
+	auto addOutfit = [&](const std::string& outfit) {
+		if (std::find(outfits.begin(), outfits.end(), outfit) == outfits.end())
+			outfits.push_back(outfit);
+	};
+
+	for (auto& o : outfitNameOrder) {
+		std::vector<std::string> groups;
+		gCollection.GetOutfitGroups(o, groups);
+
+		for (auto& g : groups) {
+			if (std::find(cmdGroupBuild.begin(), cmdGroupBuild.end(), g) != cmdGroupBuild.end()) {
+				addOutfit(o);
+				break;
+			}
+		}
+	}
+
+	for (auto& o : cmdOutfits) {
+		auto source = outfitNameSource.find(o);
+		if (source != outfitNameSource.end()) {
+			addOutfit(source->first);
+		}
+		else {
+			OutfitBuildResult result;
+			result.outfit = o;
+			result.error = "No recorded outfit name source";
+			report.push_back(result);
+		}
+	}
+
+	// Without a user to ask, sets writing the same file use the stored output choice or the first set
+	BuildSelectionFile buildSelFile;
+	BuildSelection buildSelection;
+	buildSelFile.Open(Config["AppDir"] + PathSepStr + "BuildSelection.xml");
+	if (!buildSelFile.fail())
+		buildSelFile.Get(buildSelection);
+
+	for (auto& outFile : outFileCount) {
+		if (outFile.second.size() <= 1)
+			continue;
+
+		std::vector<std::string> selOutfits;
+		for (auto& outfit : outFile.second)
+			if (std::find(outfits.begin(), outfits.end(), outfit) != outfits.end())
+				selOutfits.push_back(outfit);
+
+		if (selOutfits.size() <= 1)
+			continue;
+
+		std::string choice = buildSelection.GetOutputChoice(outFile.first);
+		if (std::find(selOutfits.begin(), selOutfits.end(), choice) == selOutfits.end()) {
+			choice = selOutfits.front();
+			wxLogWarning("No output choice stored for '%s', building '%s'.", outFile.first, choice);
+		}
+
+		for (auto& outfit : selOutfits) {
+			if (outfit == choice)
+				continue;
+
+			outfits.erase(std::find(outfits.begin(), outfits.end(), outfit));
+
+			OutfitBuildResult result;
+			result.outfit = outfit;
+			result.status = OutfitBuildStatus::Skipped;
+			result.error = "Output file is written by '" + choice + "'";
+			report.push_back(result);
+		}
+	}
+}
+
+bool BodySlideCLI::WriteReport(const std::vector<OutfitBuildResult>& report, const std::vector<OutfitBuildTarget>& targets, double seconds) {
+	std::fstream file;
+	PlatformUtil::OpenFileStream(file, cmdReport, std::ios::out | std::ios::trunc);
+	if (!file.is_open())
+		return false;
+
+	int built = 0;
+	int incomplete = 0;
+	int upToDate = 0;
+	int cleaned = 0;
+	int failed = 0;
+	int skipped = 0;
+	for (auto& r : report) {
+		switch (r.status) {
+			case OutfitBuildStatus::Built:
+				built++;
+				if (r.IsIncomplete())
+					incomplete++;
+				break;
+			case OutfitBuildStatus::UpToDate: upToDate++; break;
+			case OutfitBuildStatus::Cleaned: cleaned++; break;
+			case OutfitBuildStatus::Skipped: skipped++; break;
+			default: failed++; break;
+		}
+	}
+
+	std::string presets;
+	std::string targetDirs;
+	for (auto& target : targets) {
+		presets += (presets.empty() ? "" : ",") + target.preset;
+		targetDirs += (targetDirs.empty() ? "" : ",") + target.dataPath;
+	}
+
+	file << "{\n";
+	file << "\t\"preset\": " << JsonString(presets) << ",\n";
+	file << "\t\"targetDir\": " << JsonString(targetDirs) << ",\n";
+	file << "\t\"threads\": " << ThreadPool::Get().GetThreadCount() << ",\n";
+	file << "\t\"seconds\": " << seconds << ",\n";
+	file << "\t\"built\": " << built << ",\n";
+	file << "\t\"incomplete\": " << incomplete << ",\n";
+	file << "\t\"upToDate\": " << upToDate << ",\n";
+	file << "\t\"cleaned\": " << cleaned << ",\n";
+	file << "\t\"failed\": " << failed << ",\n";
+	file << "\t\"skipped\": " << skipped << ",\n";
+	file << "\t\"outfits\": [";
+
+	for (size_t i = 0; i < report.size(); i++) {
+		auto& r = report[i];
+		file << (i > 0 ? ",\n" : "\n");
+		file << "\t\t{\n";
+		file << "\t\t\t\"name\": " << JsonString(r.outfit) << ",\n";
+		file << "\t\t\t\"preset\": " << JsonString(targets[r.target].preset) << ",\n";
+		file << "\t\t\t\"status\": " << JsonString(StatusName(r.status)) << ",\n";
+		if (!r.error.empty())
+			file << "\t\t\t\"error\": " << JsonString(r.error) << ",\n";
+
+		file << "\t\t\t\"seconds\": " << r.seconds << ",\n";
+		file << "\t\t\t\"outputs\": [";
+		for (size_t j = 0; j < r.outputFiles.size(); j++)
+			file << (j > 0 ? ", " : "") << JsonString(r.outputFiles[j]);
+
+		file << "]\n";
+		file << "\t\t}";
+	}
+
+	file << (report.empty() ? "]\n" : "\n\t]\n");
+	file << "}\n";
+	return !file.fail();
+}
+
+int BodySlideCLI::OnRun() {
+	auto startTime = std::chrono::steady_clock::now();
+
+	if (cmdPresets.empty())
+		cmdPresets.push_back(BodySlideConfig["SelectedPreset"]);
+
+	if (cmdTargetDirs.empty()) {
+		if (cmdPresets.size() > 1) {
+			wxLogError("Building %zu presets requires one target directory per preset.", cmdPresets.size());
+			return 1;
+		}
+
+		std::string datapath = GetOutputDataPath();
+		if (datapath.empty()) {
+			wxLogError("Game data path not configured and no target directory specified.");
+			return 1;
+		}
+
+		cmdTargetDirs.push_back(datapath);
+	}
+
+	if (cmdTargetDirs.size() != cmdPresets.size()) {
+		wxLogError("Building %zu presets requires as many target directories, %zu were specified.", cmdPresets.size(), cmdTargetDirs.size());
+		return 1;
+	}
+
+	// Each outfit is read once and built with every preset into the target directory of the preset
+	std::vector<OutfitBuildTarget> targets;
+	for (size_t i = 0; i < cmdPresets.size(); i++) {
+		for (auto& target : targets) {
+			if (StringsEqualInsens(target.dataPath.c_str(), cmdTargetDirs[i].c_str())) {
+				wxLogError("Target directory '%s' is used by more than one preset.", cmdTargetDirs[i]);
+				return 1;
+			}
+		}
+
+		targets.push_back({cmdPresets[i], cmdTargetDirs[i]});
+	}
+
+	gCollection.LoadGroups(GetProjectPath() + "/SliderGroups");
+	LoadSliderSets();
+
+	std::vector<std::string> groups;
+	sliderManager.LoadPresets(GetProjectPath() + "/SliderPresets", "", groups, true);
+
+	std::vector<std::string> presetNames;
+	sliderManager.GetPresetNames(presetNames);
+	for (auto& target : targets) {
+		if (!target.preset.empty() && std::find(presetNames.begin(), presetNames.end(), target.preset) == presetNames.end()) {
+			wxLogError("Preset '%s' not found.", target.preset);
+			return 1;
+		}
+	}
+
+	std::vector<std::string> outfits;
+	std::vector<OutfitBuildResult> report;
+	GetBuildList(outfits, report);
+
+	for (auto& target : targets)
+		wxLogMessage("Started batch build of %zu sets with preset '%s' to '%s' using %zu threads.", outfits.size(), target.preset, target.dataPath, ThreadPool::Get().GetThreadCount());
+
+	TargetGame targetGame = (TargetGame)Config.GetIntValue("TargetGame");
+
+	OutfitBuildOptions buildOptions;
+	buildOptions.projectPath = GetProjectPath();
+	buildOptions.appDir = Config["AppDir"];
+	buildOptions.targets = targets;
+	buildOptions.tri = cmdTri;
+	buildOptions.forceNormals = cmdForceNormals;
+	buildOptions.triOnRoot = targetGame == FO4 || targetGame == FO4VR || targetGame == FO76;
+
+	BuildManifest manifest;
+	manifest.Load(Config["AppDir"] + PathSepStr + "BuildManifest.xml");
+	buildOptions.manifest = &manifest;
+	buildOptions.rebuildAll = cmdForce || !Config.MatchValue("IncrementalBuilds", "true");
+	buildOptions.sliderSetIndex = &sliderSetIndex;
+	buildOptions.memoryLimit = OutfitBuilder::GetMemoryLimit(Config.GetIntValue("BuildMemoryLimit"));
+
+	OutfitBuilder builder(sliderManager, buildOptions);
+
+	std::vector<std::pair<std::string, std::string>> buildList;
+	std::map<std::string, size_t> resultIndex;
+	for (size_t i = 0; i < outfits.size(); i++) {
+		buildList.emplace_back(outfits[i], outfitNameSource.at(outfits[i]));
+		resultIndex[outfits[i]] = i;
+	}
+
+	// Results are ordered by outfit, then by target
+	std::vector<OutfitBuildResult> results(outfits.size() * targets.size());
+	int totalCount = (int)results.size();
+	std::atomic<int> count = 0;
+
+	BuildStatsReport statsReport;
+
+	auto outfitFinished = [&](const OutfitBuildResult& r) {
+		results[resultIndex.at(r.outfit) * targets.size() + r.target] = r;
+
+		if (r.status == OutfitBuildStatus::Built)
+			statsReport.Add(r.outfit, targets[r.target].preset, r.seconds, r.stats);
+
+		const std::string& preset = targets[r.target].preset;
+		if (r.status == OutfitBuildStatus::Failed)
+			wxLogError("Failed to build '%s' with preset '%s': %s (%d of %d)", r.outfit, preset, r.error, ++count, totalCount);
+		else if (r.status == OutfitBuildStatus::UpToDate)
+			wxLogMessage("'%s' is up to date with preset '%s' (%d of %d)", r.outfit, preset, ++count, totalCount);
+		else if (r.status == OutfitBuildStatus::Cleaned)
+			wxLogMessage("Cleaned '%s' (%d of %d)", r.outfit, ++count, totalCount);
+		else if (r.IsIncomplete())
+			wxLogError("Built '%s' with preset '%s' with missing files: %s (%d of %d)", r.outfit, preset, r.error, ++count, totalCount);
+		else
+			wxLogMessage("Built '%s' with preset '%s' in %.2f s (%d of %d)", r.outfit, preset, r.seconds, ++count, totalCount);
+	};
+
+	// Log messages of worker threads are flushed by the main thread
+	std::atomic<bool> buildDone = false;
+	std::thread buildThread([&] {
+		builder.BuildAll(buildList, outfitFinished);
+		buildDone = true;
+	});
+
+	while (!buildDone) {
+		wxLog::FlushActive();
+		wxMilliSleep(100);
+	}
+
+	buildThread.join();
+	wxLog::FlushActive();
+
+	if (!manifest.Save())
+		wxLogWarning("Failed to save build manifest.");
+
+	statsReport.LogSummary();
+	DiffDataCache::DedupStats dedupStats = DiffDataCache::Get().GetDedupStats();
+	if (dedupStats.duplicates > 0)
+		wxLogMessage("Diff data deduplication: %zu of %zu sets shared, %zu KB saved.", dedupStats.duplicates, dedupStats.sets, dedupStats.bytesSaved / 1024);
+
+	MorphCache::Stats morphStats = MorphCache::Get().GetStats();
+	if (morphStats.hits > 0)
+		wxLogMessage("Baked morphs: %zu of %zu shapes reused combined slider diffs.", morphStats.hits, morphStats.hits + morphStats.misses);
+
+	wxLog::FlushActive();
+
+	if (!cmdStats.empty() && !statsReport.Write(cmdStats))
+		wxLogError("Failed to write build statistics to '%s'.", cmdStats);
+
+	report.insert(report.end(), results.begin(), results.end());
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+	if (!cmdReport.empty() && !WriteReport(report, targets, seconds))
+		wxLogError("Failed to write build report to '%s'.", cmdReport);
+
+	size_t failedCount = std::count_if(report.begin(), report.end(), [](const OutfitBuildResult& r) { return r.status == OutfitBuildStatus::Failed; });
+	size_t incompleteCount = std::count_if(report.begin(), report.end(), [](const OutfitBuildResult& r) { return r.IsIncomplete(); });
+	if (failedCount > 0 || incompleteCount > 0) {
+		wxLogMessage("Batch build finished in %.1f s, %zu sets failed, %zu sets built with missing files.", seconds, failedCount, incompleteCount);
+		return 3;
+	}
+
+	wxLogMessage("All sets processed successfully in %.1f s!", seconds);
+	return 0;
+}
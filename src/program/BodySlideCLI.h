@@ -0,0 +1,79 @@
+/*
+BodySlide and Outfit Studio
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "../components/OutfitBuilder.h"
+#include "../components/SliderGroup.h"
+#include "../utils/ConfigurationManager.h"
+#include "../utils/TargetGame.h"
+
+#include <wx/app.h>
+#include <wx/cmdline.h>
+
+// Console application running group and outfit builds without any display.
+// Only depends on the wxWidgets base library.
+class BodySlideCLI : public wxAppConsole {
+	/* Command-Line Arguments */
+	std::vector<std::string> cmdGroupBuild;
+	std::vector<std::string> cmdOutfits;
+	std::vector<std::string> cmdTargetDirs;
+	std::vector<std::string> cmdPresets;
+	std::string cmdReport;
+	std::string cmdStats;
+	std::string cmdAppDir;
+	bool cmdTri = false;
+	bool cmdForceNormals = false;
+	bool cmdForce = false;
+	long cmdThreads = -1;
+
+	/* Data Managers */
+	SliderManager sliderManager;
+	SliderSetGroupCollection gCollection;
+	SliderSetIndex sliderSetIndex;
+
+	/* Data Items */
+	std::map<std::string, std::string, case_insensitive_compare> outfitNameSource; // All currently defined outfits.
+	std::vector<std::string> outfitNameOrder;									   // All currently defined outfits, in their order of appearance.
+	std::map<std::string, std::vector<std::string>, case_insensitive_compare> outFileCount; // Counts how many sets write to the same output file
+
+	std::string GetOutputDataPath() const;
+	std::string GetProjectPath() const;
+
+	void LoadSliderSets();
+	void GetBuildList(std::vector<std::string>& outfits, std::vector<OutfitBuildResult>& report);
+	bool WriteReport(const std::vector<OutfitBuildResult>& report, const std::vector<OutfitBuildTarget>& targets, double seconds);
+
+public:
+	virtual bool OnInit();
+	virtual int OnRun();
+	virtual void OnInitCmdLine(wxCmdLineParser& parser);
+	virtual bool OnCmdLineParsed(wxCmdLineParser& parser);
+};
+
+static const wxCmdLineEntryDesc g_cmdLineDesc[] = {{wxCMD_LINE_OPTION, "gbuild", "groupbuild", "builds the specified groups, separated by commas", wxCMD_LINE_VAL_STRING},
+												   {wxCMD_LINE_OPTION, "o", "outfits", "builds the specified outfits, separated by commas", wxCMD_LINE_VAL_STRING},
+												   {wxCMD_LINE_OPTION, "t", "targetdir", "build target directories, one per preset separated by commas, defaults to game data path", wxCMD_LINE_VAL_STRING},
+												   {wxCMD_LINE_OPTION, "p", "preset", "presets used for the build, separated by commas, defaults to last used preset", wxCMD_LINE_VAL_STRING},
+												   {wxCMD_LINE_OPTION, "r", "report", "writes a JSON report of the build to the specified file", wxCMD_LINE_VAL_STRING},
+												   {wxCMD_LINE_OPTION, "s", "stats", "writes build statistics per set to the specified file, as JSON if it ends with .json and CSV otherwise", wxCMD_LINE_VAL_STRING},
+												   {wxCMD_LINE_OPTION, "a", "appdir", "folder containing Config.xml, defaults to the program folder", wxCMD_LINE_VAL_STRING},
+												   {wxCMD_LINE_OPTION, "j", "threads", "number of build threads, 0 = number of CPU cores", wxCMD_LINE_VAL_NUMBER},
+												   {wxCMD_LINE_SWITCH, "tri", "trimorphs", "enables tri morph output for the specified build"},
+												   {wxCMD_LINE_SWITCH, "n", "forcenormals", "uses reference normals from the RefNormals folder"},
+												   {wxCMD_LINE_SWITCH, "f", "force", "rebuilds all sets, including those that are up to date"},
+												   wxCMD_LINE_DESC_END};
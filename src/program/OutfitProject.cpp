@@ -4,6 +4,7 @@ See the included LICENSE file
 */
 
 #include "OutfitProject.h"
+#include "../components/VertexRemap.h"
 #include "../components/WeightNorm.h"
 #include "../files/FBXWrangler.h"
 #include "../files/ObjFile.h"
@@ -11,6 +12,7 @@ See the included LICENSE file
 #include "../program/FBXImportDialog.h"
 #include "../program/ObjImportDialog.h"
 #include "../utils/PlatformUtil.h"
+#include "../utils/ThreadPool.h"
 #include "NifUtil.hpp"
 
 #include "../FSEngine/FSEngine.h"
@@ -36,6 +38,8 @@ OutfitProject::OutfitProject(OutfitStudioFrame* inOwner) {
 	auto targetGame = (TargetGame)Config.GetIntValue("TargetGame");
 	if (targetGame == SKYRIM || targetGame == SKYRIMSE || targetGame == SKYRIMVR)
 		mGenWeights = true;
+
+	baseDiffData.SetHalfPrecision(Config.GetBoolValue("HalfPrecisionDiffs"));
 }
 
 OutfitProject::~OutfitProject() {}
@@ -305,7 +309,12 @@ bool OutfitProject::SaveSliderData(const std::string& fileName, bool copyRef) {
 			}
 		}
 
-		if (!osdDiffs.SaveData(osdNames))
+		// Diffs kept in half precision are saved with the precision they were stored with
+		float precisionLoss = baseDiffData.GetPrecisionLoss();
+		if (precisionLoss > 0.0f)
+			wxLogWarning("Slider data of the reference was stored in half precision, saved diffs differ by up to %g.", precisionLoss);
+
+		if (!osdDiffs.SaveData(osdNames, Config.GetBoolValue("IndexedOSD")))
 			return false;
 	}
 
@@ -1596,22 +1605,6 @@ void OutfitProject::CopyBoneWeights(NiShape* shape,
 		return;
 	}
 
-	DiffDataSets dds;
-	for (int bi = 0; bi < nCopyBones; ++bi) {
-		const std::string& bone = boneList[bi];
-		std::string wtSet = bone + "_WT_";
-		dds.AddEmptySet(wtSet, "Weight");
-
-		auto weights = workAnim.GetWeightsPtr(baseShapeName, bone);
-		if (weights) {
-			for (auto& w : *weights) {
-				Vector3 tmp;
-				tmp.y = w.second;
-				dds.UpdateDiff(wtSet, "Weight", w.first, tmp);
-			}
-		}
-	}
-
 	BoneWeightAutoNormalizer nzer;
 	nzer.SetUp(&uss, &workAnim, shapeName, boneList, lockedBones, nCopyBones, bSpreadWeight);
 	std::unordered_set<int> vertList;
@@ -1619,10 +1612,17 @@ void OutfitProject::CopyBoneWeights(NiShape* shape,
 	owner->UpdateProgress(10, _("Initializing proximity data..."));
 
 	InitConform();
-	morpher.LinkRefDiffData(&dds);
-	morpher.BuildProximityCache(shapeName, proximityRadius);
+	morpher.BuildProximityCache(shapeName, proximityRadius, nullptr, maxResults);
 	CreateSkinning(shape);
 
+	// Calculate new values for all copied bones' weights in one pass over the proximity data
+	std::vector<const std::unordered_map<uint16_t, float>*> refWeights(nCopyBones);
+	for (int bi = 0; bi < nCopyBones; ++bi)
+		refWeights[bi] = workAnim.GetWeightsPtr(baseShapeName, boneList[bi]);
+
+	std::vector<std::unordered_map<uint16_t, float>> newWeights;
+	morpher.InterpolateValues(shapeName, refWeights, maxResults, newWeights);
+
 	int step = 40 / nCopyBones;
 	int prog = 40;
 	owner->UpdateProgress(prog);
@@ -1644,27 +1644,19 @@ void OutfitProject::CopyBoneWeights(NiShape* shape,
 			}
 		}
 
-		// Calculate new values for bone's weights
-		std::string wtSet = boneName + "_WT_";
-		morpher.GenerateResultDiff(shapeName, wtSet, wtSet, false, maxResults);
-
-		std::unordered_map<uint16_t, Vector3> diffResult;
-		morpher.GetRawResultDiff(shapeName, wtSet, diffResult);
-
-		// Copy unmasked weights from diffResult into uss
-		for (auto& dr : diffResult) {
-			if (mask[dr.first] > 0.0f)
+		// Copy unmasked new weights into uss
+		for (auto& nw : newWeights[bi]) {
+			if (mask[nw.first] > 0.0f)
 				continue;
-			if (vertList.find(dr.first) == vertList.end()) {
-				vertList.insert(dr.first);
-				nzer.GrabOneVertexStartingWeights(dr.first);
+			if (vertList.find(nw.first) == vertList.end()) {
+				vertList.insert(nw.first);
+				nzer.GrabOneVertexStartingWeights(nw.first);
 			}
-			ubw[dr.first].endVal = dr.second.y;
+			ubw[nw.first].endVal = nw.second;
 		}
 
 		owner->UpdateProgress(prog += step, _("Copying bone weights..."));
 	}
-	morpher.UnlinkRefDiffData();
 
 	// Normalize
 	for (auto vInd : vertList)
@@ -2302,6 +2294,11 @@ int OutfitProject::AddFromSliderSet(const std::string& fileName, const std::stri
 }
 
 void OutfitProject::InitConform() {
+	if (Config.GetBoolValue("ProximityCacheFiles"))
+		morpher.SetProximityCacheDir(GetProjectPath() + PathSepStr + "ShapeData" + PathSepStr + "ProximityCache");
+	else
+		morpher.SetProximityCacheDir("");
+
 	if (baseShape) {
 		morpher.SetRef(workNif, baseShape, &workAnim);
 		morpher.LinkRefDiffData(&baseDiffData);
@@ -2320,21 +2317,28 @@ void OutfitProject::ConformShape(NiShape* shape, const ConformOptions& options)
 	for (auto& m : mask)
 		maskIndices.insert(m.first);
 
-	morpher.BuildProximityCache(shape->name.get(), options.proximityRadius, &maskIndices);
+	morpher.BuildProximityCache(shape->name.get(), options.proximityRadius, &maskIndices, options.maxResults);
 
 	std::string refTarget = ShapeToTarget(baseShape->name.get());
-	for (size_t i = 0; i < activeSet.size(); i++)
-		if (SliderShow(i) && !SliderZap(i) && !SliderUV(i))
-			morpher.GenerateResultDiff(shape->name.get(),
-									   activeSet[i].name,
-									   activeSet[i].TargetDataName(refTarget),
-									   true,
-									   options.maxResults,
-									   options.noSqueeze,
-									   options.solidMode,
-									   options.axisX,
-									   options.axisY,
-									   options.axisZ);
+	std::vector<Automorph::ResultDiffSource> sliders;
+	for (size_t i = 0; i < activeSet.size(); i++) {
+		if (SliderShow(i) && !SliderZap(i) && !SliderUV(i)) {
+			Automorph::ResultDiffSource slider;
+			slider.sliderName = activeSet[i].name;
+			slider.refDataName = activeSet[i].TargetDataName(refTarget);
+			sliders.push_back(slider);
+		}
+	}
+
+	morpher.GenerateResultDiffs(shape->name.get(),
+								sliders,
+								true,
+								options.maxResults,
+								options.noSqueeze,
+								options.solidMode,
+								options.axisX,
+								options.axisY,
+								options.axisZ);
 }
 
 std::unordered_map<uint16_t, Vector3>* OutfitProject::GetDiffSet(SliderData& sliderData, NiShape* shape) {
@@ -2560,82 +2564,48 @@ void OutfitProject::ApplyShapeMeshUndo(NiShape* shape, std::vector<float>& mask,
 			EraseVectorIndices(triParts, delTriInds);
 	}
 
+	// Applies one remap to all per-vertex data of the shape, the arrays and sets are processed in parallel
+	auto remapVerts = [&](const VertexRemap& remap) {
+		std::vector<std::function<void()>> tasks;
+		tasks.push_back([&] { remap.ApplyToTriangles(tris); });
+		tasks.push_back([&] { skin.RemapVerts(remap); });
+		tasks.push_back([&] {
+			if (IsBaseShape(shape))
+				baseDiffData.RemapVerts(target, remap);
+			else
+				morpher.RemapVerts(target, remap);
+		});
+		tasks.push_back([&] { remap.ApplyToVector(verts); });
+		tasks.push_back([&] { remap.ApplyToVector(mask); });
+		tasks.push_back([&] { remap.ApplyToVector(uvs); });
+		tasks.push_back([&] { remap.ApplyToVector(colors); });
+		tasks.push_back([&] { remap.ApplyToVector(normals); });
+		tasks.push_back([&] { remap.ApplyToVector(tangents); });
+		tasks.push_back([&] { remap.ApplyToVector(bitangents); });
+		tasks.push_back([&] { remap.ApplyToVector(eyeData); });
+
+		ThreadPool::Get().ParallelFor(tasks.size(), [&](size_t i) { tasks[i](); });
+	};
+
 	bool makeLocal = false;
 
 	if (!delVerts.empty()) {
-		// Delete vertices...
+		// Delete vertices from triangles, workAnim, diff data and nif arrays
 		std::vector<uint16_t> delVertInds(delVerts.size());
 		for (uint16_t di = 0; di < static_cast<uint16_t>(delVerts.size()); ++di)
 			delVertInds[di] = delVerts[di].index;
 
-		std::vector<int> vertCollapseMap = GenerateIndexCollapseMap(delVertInds, verts.size());
-
-		// ...from triangles
-		ApplyMapToTriangles(tris, vertCollapseMap);
-
-		// ...from workAnim
-		workAnim.DeleteVertsForShape(shape->name.get(), delVertInds);
-
-		// ...from diff data
-		if (IsBaseShape(shape))
-			baseDiffData.DeleteVerts(target, delVertInds);
-		else
-			morpher.DeleteVerts(target, delVertInds);
-
-		// ...from nif arrays
-		EraseVectorIndices(verts, delVertInds);
-		EraseVectorIndices(mask, delVertInds);
-		if (uvsp)
-			EraseVectorIndices(uvs, delVertInds);
-		if (colorsp)
-			EraseVectorIndices(colors, delVertInds);
-		if (normalsp)
-			EraseVectorIndices(normals, delVertInds);
-		if (tangentsp)
-			EraseVectorIndices(tangents, delVertInds);
-		if (bitangentsp)
-			EraseVectorIndices(bitangents, delVertInds);
-		if (eyeDatap)
-			EraseVectorIndices(eyeData, delVertInds);
-
+		remapVerts(VertexRemap::Deletion(delVertInds));
 		makeLocal = true;
 	}
 
 	if (!addVerts.empty()) {
-		// Insert new vertex indices...
+		// Insert new vertex indices into triangles, workAnim, diff data and nif arrays
 		std::vector<uint16_t> insVertInds(addVerts.size());
 		for (uint16_t di = 0; di < static_cast<uint16_t>(addVerts.size()); ++di)
 			insVertInds[di] = addVerts[di].index;
 
-		std::vector<int> vertExpandMap = GenerateIndexExpandMap(insVertInds, verts.size());
-
-		// ...into triangles
-		ApplyMapToTriangles(tris, vertExpandMap);
-
-		// ...into workAnim
-		skin.InsertVertexIndices(insVertInds);
-
-		// ...into diff data
-		if (IsBaseShape(shape))
-			baseDiffData.InsertVertexIndices(target, insVertInds);
-		else
-			morpher.InsertVertexIndices(target, insVertInds);
-
-		// ...into nif arrays
-		InsertVectorIndices(verts, insVertInds);
-		InsertVectorIndices(mask, insVertInds);
-		if (uvsp)
-			InsertVectorIndices(uvs, insVertInds);
-		if (colorsp)
-			InsertVectorIndices(colors, insVertInds);
-		if (normalsp)
-			InsertVectorIndices(normals, insVertInds);
-		if (tangentsp)
-			InsertVectorIndices(tangents, insVertInds);
-		if (bitangentsp)
-			InsertVectorIndices(bitangents, insVertInds);
-		if (eyeDatap)
-			InsertVectorIndices(eyeData, insVertInds);
+		remapVerts(VertexRemap::Insertion(insVertInds));
 
 		// Store vertex data...
 		for (const UndoStateVertex& usv : addVerts) {
@@ -7256,6 +7256,9 @@ void OutfitStudioFrame::OnSliderImportOSD(wxCommandEvent& WXUNUSED(event)) {
 		return;
 	}
 
+	if (osd.GetDroppedCount() > 0)
+		wxLogWarning("Skipped %u diffs of OSD file '%s' with vertex indices above 65535.", osd.GetDroppedCount(), fn);
+
 	std::unordered_map<std::string, std::unordered_map<std::string, std::string>> shapeToSliders;
 	auto diffs = osd.GetDataDiffs();
 	const auto& shapes = project->GetWorkNif()->GetShapes();
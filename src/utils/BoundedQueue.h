@@ -0,0 +1,64 @@
+/*
+BodySlide and Outfit Studio
+See the included LICENSE file
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+// Blocking FIFO queue with a maximum size, connecting the stages of a pipeline.
+// Push waits while the queue is full, Pop waits while the queue is empty and not closed.
+template<typename T>
+class BoundedQueue {
+	std::deque<T> items;
+	size_t capacity = 1;
+	bool closed = false;
+
+	std::mutex queueMutex;
+	std::condition_variable notFull;
+	std::condition_variable notEmpty;
+
+public:
+	BoundedQueue(size_t capacity)
+		: capacity(std::max<size_t>(capacity, 1)) {}
+
+	BoundedQueue(const BoundedQueue&) = delete;
+	BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+	// Returns false if the queue was closed, the item is dropped then.
+	bool Push(T item) {
+		std::unique_lock<std::mutex> lock(queueMutex);
+		notFull.wait(lock, [&] { return items.size() < capacity || closed; });
+		if (closed)
+			return false;
+
+		items.push_back(std::move(item));
+		notEmpty.notify_one();
+		return true;
+	}
+
+	// Returns false once the queue is closed and empty.
+	bool Pop(T& outItem) {
+		std::unique_lock<std::mutex> lock(queueMutex);
+		notEmpty.wait(lock, [&] { return !items.empty() || closed; });
+		if (items.empty())
+			return false;
+
+		outItem = std::move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	// No more items will be pushed. Remaining items can still be popped.
+	void Close() {
+		std::lock_guard<std::mutex> lock(queueMutex);
+		closed = true;
+		notFull.notify_all();
+		notEmpty.notify_all();
+	}
+};
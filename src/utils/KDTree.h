@@ -0,0 +1,206 @@
+/*
+BodySlide and Outfit Studio
+See the included LICENSE file
+*/
+
+#pragma once
+
+#include "KDMatcher.hpp"
+#include "Object3d.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Balanced kd-tree over a point array for radius and nearest point queries.
+// Unlike nifly::kd_tree, the tree isn't modified by queries and results go to caller-provided buffers,
+// so several threads can query the same tree at once. The points are referenced, not copied, and must outlive the tree.
+template<typename IndexT>
+class KDTree {
+	struct Node {
+		uint32_t begin = 0; // Range of order covered by the node
+		uint32_t end = 0;
+		uint32_t left = 0; // Child nodes, 0 for leaves since the root is never a child
+		uint32_t right = 0;
+		int axis = 0;
+		float split = 0.0f;
+	};
+
+	static constexpr uint32_t LeafSize = 8;
+
+	nifly::Vector3* points = nullptr;
+	std::vector<IndexT> order;
+	std::vector<Node> nodes;
+
+	static float Coord(const nifly::Vector3& p, int axis) { return axis == 0 ? p.x : (axis == 1 ? p.y : p.z); }
+
+	static float DistanceSq(const nifly::Vector3& a, const nifly::Vector3& b) {
+		const float dx = a.x - b.x;
+		const float dy = a.y - b.y;
+		const float dz = a.z - b.z;
+		return dx * dx + dy * dy + dz * dz;
+	}
+
+	uint32_t Build(uint32_t begin, uint32_t end) {
+		const uint32_t nodeIndex = static_cast<uint32_t>(nodes.size());
+		nodes.emplace_back();
+		nodes[nodeIndex].begin = begin;
+		nodes[nodeIndex].end = end;
+
+		if (end - begin <= LeafSize)
+			return nodeIndex;
+
+		// Split at the median of the axis with the largest extent
+		nifly::Vector3 lo = points[order[begin]];
+		nifly::Vector3 hi = lo;
+		for (uint32_t i = begin + 1; i < end; i++) {
+			const nifly::Vector3& p = points[order[i]];
+			lo.x = std::min(lo.x, p.x);
+			lo.y = std::min(lo.y, p.y);
+			lo.z = std::min(lo.z, p.z);
+			hi.x = std::max(hi.x, p.x);
+			hi.y = std::max(hi.y, p.y);
+			hi.z = std::max(hi.z, p.z);
+		}
+
+		const nifly::Vector3 extent = hi - lo;
+		int axis = 0;
+		if (extent.y > extent.x && extent.y >= extent.z)
+			axis = 1;
+		else if (extent.z > extent.x && extent.z > extent.y)
+			axis = 2;
+
+		const uint32_t mid = begin + (end - begin) / 2;
+		std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](IndexT a, IndexT b) {
+			return Coord(points[a], axis) < Coord(points[b], axis);
+		});
+
+		const float split = Coord(points[order[mid]], axis);
+		const uint32_t left = Build(begin, mid);
+		const uint32_t right = Build(mid, end);
+
+		Node& node = nodes[nodeIndex];
+		node.axis = axis;
+		node.split = split;
+		node.left = left;
+		node.right = right;
+		return nodeIndex;
+	}
+
+	static bool ResultLess(const nifly::kd_query_result<IndexT>& a, const nifly::kd_query_result<IndexT>& b) {
+		if (a.distance != b.distance)
+			return a.distance < b.distance;
+
+		return a.vertex_index < b.vertex_index;
+	}
+
+public:
+	KDTree(nifly::Vector3* points, IndexT count)
+		: points(points) {
+		if (!points || count == 0)
+			return;
+
+		order.resize(count);
+		for (size_t i = 0; i < order.size(); i++)
+			order[i] = static_cast<IndexT>(i);
+
+		nodes.reserve(2 * (count / LeafSize + 1));
+		Build(0, static_cast<uint32_t>(count));
+	}
+
+	// Replaces the results with all points within the radius, sorted by distance and then index. Returns the result count.
+	// A radius of 0 finds the nearest point only, the same as nifly::kd_tree::kd_nn.
+	// stack is scratch memory, pass the same vector for repeated queries to avoid allocations.
+	size_t Query(const nifly::Vector3& point, float radius, std::vector<nifly::kd_query_result<IndexT>>& outResults, std::vector<uint32_t>& stack) const {
+		outResults.clear();
+		if (nodes.empty())
+			return 0;
+
+		if (radius <= 0.0f) {
+			nifly::kd_query_result<IndexT> nearest;
+			if (Nearest(point, nearest, stack))
+				outResults.push_back(nearest);
+
+			return outResults.size();
+		}
+
+		const float radiusSq = radius * radius;
+		stack.clear();
+		stack.push_back(0);
+
+		while (!stack.empty()) {
+			const Node& node = nodes[stack.back()];
+			stack.pop_back();
+
+			if (node.left == 0) {
+				for (uint32_t i = node.begin; i < node.end; i++) {
+					const IndexT index = order[i];
+					const float distSq = DistanceSq(points[index], point);
+					if (distSq <= radiusSq) {
+						nifly::kd_query_result<IndexT> result;
+						result.v = &points[index];
+						result.vertex_index = index;
+						result.distance = std::sqrt(distSq);
+						outResults.push_back(result);
+					}
+				}
+				continue;
+			}
+
+			const float delta = Coord(point, node.axis) - node.split;
+			if (delta - radius <= 0.0f)
+				stack.push_back(node.left);
+			if (delta + radius >= 0.0f)
+				stack.push_back(node.right);
+		}
+
+		std::sort(outResults.begin(), outResults.end(), ResultLess);
+		return outResults.size();
+	}
+
+	// Finds the point nearest to the query point, the one with the lowest index among equally near ones
+	bool Nearest(const nifly::Vector3& point, nifly::kd_query_result<IndexT>& outResult, std::vector<uint32_t>& stack) const {
+		if (nodes.empty())
+			return false;
+
+		float bestSq = std::numeric_limits<float>::max();
+		IndexT bestIndex = 0;
+		bool found = false;
+
+		stack.clear();
+		stack.push_back(0);
+
+		while (!stack.empty()) {
+			const Node& node = nodes[stack.back()];
+			stack.pop_back();
+
+			if (node.left == 0) {
+				for (uint32_t i = node.begin; i < node.end; i++) {
+					const IndexT index = order[i];
+					const float distSq = DistanceSq(points[index], point);
+					if (!found || distSq < bestSq || (distSq == bestSq && index < bestIndex)) {
+						bestSq = distSq;
+						bestIndex = index;
+						found = true;
+					}
+				}
+				continue;
+			}
+
+			// Visits the near side first by pushing it last, skips the far side if it can't be nearer
+			const float delta = Coord(point, node.axis) - node.split;
+			const uint32_t nearNode = delta < 0.0f ? node.left : node.right;
+			const uint32_t farNode = delta < 0.0f ? node.right : node.left;
+			if (!found || delta * delta <= bestSq)
+				stack.push_back(farNode);
+			stack.push_back(nearNode);
+		}
+
+		outResult.v = &points[bestIndex];
+		outResult.vertex_index = bestIndex;
+		outResult.distance = std::sqrt(bestSq);
+		return true;
+	}
+};
@@ -0,0 +1,143 @@
+/*
+BodySlide and Outfit Studio
+See the included LICENSE file
+*/
+
+#include "MappedFile.h"
+#include "PlatformUtil.h"
+
+#ifndef _WINDOWS
+#if defined(__unix__) || defined(__APPLE__)
+#define MAPPEDFILE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#endif
+
+MappedFile::~MappedFile() {
+	Close();
+}
+
+bool MappedFile::Open(const std::string& fileName) {
+	Close();
+
+	if (Map(fileName))
+		return true;
+
+	// Fallback for platforms or files that can't be mapped
+	std::fstream file;
+	PlatformUtil::OpenFileStream(file, fileName, std::ios::in | std::ios::binary);
+	if (!file)
+		return false;
+
+	file.seekg(0, std::ios::end);
+	std::streamoff fileSize = file.tellg();
+	file.seekg(0, std::ios::beg);
+	if (fileSize < 0)
+		return false;
+
+	buffer.resize(static_cast<size_t>(fileSize));
+	file.read(buffer.data(), fileSize);
+	if (!file)
+		return false;
+
+	data = buffer.data();
+	size = buffer.size();
+	return true;
+}
+
+#ifdef _WINDOWS
+bool MappedFile::Map(const std::string& fileName) {
+	HANDLE file = CreateFileW(PlatformUtil::MultiByteToWideUTF8(fileName).c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart <= 0 || static_cast<uint64_t>(fileSize.QuadPart) > SIZE_MAX) {
+		CloseHandle(file);
+		return false;
+	}
+
+	// The mapping keeps the file open
+	HANDLE fileMapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (!fileMapping)
+		return false;
+
+	void* view = MapViewOfFile(fileMapping, FILE_MAP_READ, 0, 0, 0);
+	if (!view) {
+		CloseHandle(fileMapping);
+		return false;
+	}
+
+	mapping = fileMapping;
+	mapped = view;
+	data = static_cast<const char*>(view);
+	size = static_cast<size_t>(fileSize.QuadPart);
+	return true;
+}
+
+void MappedFile::Close() {
+	if (mapped)
+		UnmapViewOfFile(mapped);
+
+	if (mapping)
+		CloseHandle(mapping);
+
+	mapped = nullptr;
+	mapping = nullptr;
+	buffer.clear();
+	data = nullptr;
+	size = 0;
+}
+#elif defined(MAPPEDFILE_MMAP)
+bool MappedFile::Map(const std::string& fileName) {
+	std::string path = fileName;
+	for (auto& c : path)
+		if (c == '\\')
+			c = '/';
+
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat fileStat;
+	if (fstat(fd, &fileStat) != 0 || fileStat.st_size <= 0) {
+		close(fd);
+		return false;
+	}
+
+	// The mapping stays valid after closing the file
+	void* view = mmap(nullptr, static_cast<size_t>(fileStat.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (view == MAP_FAILED)
+		return false;
+
+	mapped = view;
+	data = static_cast<const char*>(view);
+	size = static_cast<size_t>(fileStat.st_size);
+	return true;
+}
+
+void MappedFile::Close() {
+	if (mapped)
+		munmap(mapped, size);
+
+	mapped = nullptr;
+	buffer.clear();
+	data = nullptr;
+	size = 0;
+}
+#else
+bool MappedFile::Map(const std::string&) {
+	return false;
+}
+
+void MappedFile::Close() {
+	buffer.clear();
+	data = nullptr;
+	size = 0;
+}
+#endif
@@ -0,0 +1,37 @@
+/*
+BodySlide and Outfit Studio
+See the included LICENSE file
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Read-only view of the contents of a file.
+// The file is memory-mapped where supported and read into memory otherwise, so the data is always available.
+class MappedFile {
+	const char* data = nullptr;
+	size_t size = 0;
+
+	void* mapped = nullptr;	   // Start of the mapping, null if not mapped
+	void* mapping = nullptr;   // Mapping object handle (Windows)
+	std::vector<char> buffer; // Contents if the file couldn't be mapped
+
+	bool Map(const std::string& fileName);
+
+public:
+	MappedFile() = default;
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	// Returns false if the file couldn't be opened
+	bool Open(const std::string& fileName);
+	void Close();
+
+	bool IsMapped() const { return mapped != nullptr; }
+	const char* GetData() const { return data; }
+	size_t GetSize() const { return size; }
+};
@@ -0,0 +1,67 @@
+/*
+BodySlide and Outfit Studio
+See the included LICENSE file
+*/
+
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+// Admission control for work with an estimated memory usage.
+// Acquire waits until the estimate fits within the limit. Work is always admitted while nothing else holds memory,
+// so estimates above the limit still run, just not alongside anything else.
+class MemoryBudget {
+public:
+	// Returns its memory to the budget once destroyed
+	class Reservation {
+		MemoryBudget& budget;
+		size_t bytes;
+
+	public:
+		Reservation(MemoryBudget& budget, size_t bytes)
+			: budget(budget)
+			, bytes(bytes) {}
+
+		Reservation(const Reservation&) = delete;
+		Reservation& operator=(const Reservation&) = delete;
+
+		~Reservation() { budget.Release(bytes); }
+	};
+
+private:
+	size_t limit = 0;
+	size_t used = 0;
+
+	std::mutex budgetMutex;
+	std::condition_variable released;
+
+	void Release(size_t bytes) {
+		std::lock_guard<std::mutex> lock(budgetMutex);
+		used -= bytes;
+		released.notify_all();
+	}
+
+public:
+	// Limit in bytes, 0 = unlimited
+	MemoryBudget(size_t limit = 0)
+		: limit(limit) {}
+
+	MemoryBudget(const MemoryBudget&) = delete;
+	MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+	// Waits until the bytes fit within the limit and reserves them. The reservation may be shared by several owners.
+	std::shared_ptr<Reservation> Acquire(size_t bytes) {
+		std::unique_lock<std::mutex> lock(budgetMutex);
+		released.wait(lock, [&] { return limit == 0 || used == 0 || used + bytes <= limit; });
+
+		used += bytes;
+		return std::make_shared<Reservation>(*this, bytes);
+	}
+
+	size_t GetUsed() {
+		std::lock_guard<std::mutex> lock(budgetMutex);
+		return used;
+	}
+};
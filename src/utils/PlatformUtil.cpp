@@ -5,6 +5,8 @@ See the included LICENSE file
 
 #include "PlatformUtil.h"
 
+#include <filesystem>
+
 namespace {
 std::string backslash_to_slash(const std::string& s) {
 	std::string sc(s);
@@ -57,4 +59,21 @@ void OpenFileStream(std::fstream& file, const std::wstring& fileName, unsigned i
 	file.open(fileName.c_str(), mode);
 }
 #endif
+
+bool GetFileStamp(const std::string& fileName, int64_t& outSize, int64_t& outTime) {
+	std::error_code ec;
+	auto path = std::filesystem::u8path(fileName);
+
+	auto size = std::filesystem::file_size(path, ec);
+	if (ec)
+		return false;
+
+	auto time = std::filesystem::last_write_time(path, ec);
+	if (ec)
+		return false;
+
+	outSize = static_cast<int64_t>(size);
+	outTime = static_cast<int64_t>(time.time_since_epoch().count());
+	return true;
+}
 } // namespace PlatformUtil
@@ -9,6 +9,7 @@ See the included LICENSE file
 #include <Windows.h>
 #endif
 
+#include <cstdint>
 #include <fstream>
 #include <string>
 
@@ -23,6 +24,9 @@ std::wstring MultiByteToWideUTF8(const std::string& str);
 
 void OpenFileStream(std::fstream& file, const std::string& fileName, std::ios_base::openmode mode);
 
+// Size and last modification time of a file. Returns false if the file doesn't exist.
+bool GetFileStamp(const std::string& fileName, int64_t& outSize, int64_t& outTime);
+
 // Provide std::wstring function for Windows
 #ifdef _WINDOWS
 void OpenFileStream(std::fstream& file, const std::wstring& fileName, unsigned int mode);
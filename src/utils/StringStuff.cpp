@@ -1,5 +1,6 @@
 #include "StringStuff.h"
 #include <cctype>
+#include <iomanip>
 #include <sstream>
 
 bool StringsEqualNInsens(const char* a, const char* b, int len) {
@@ -69,3 +70,29 @@ std::string JoinStrings(const std::vector<std::string>& elements, const char* co
 			return os.str();
 	}
 }
+
+std::string JsonString(const std::string& s) {
+	std::ostringstream out;
+	out << '"';
+
+	for (char c : s) {
+		switch (c) {
+			case '"': out << "\\\""; break;
+			case '\\': out << "\\\\"; break;
+			case '\b': out << "\\b"; break;
+			case '\f': out << "\\f"; break;
+			case '\n': out << "\\n"; break;
+			case '\r': out << "\\r"; break;
+			case '\t': out << "\\t"; break;
+			default:
+				if ((unsigned char)c < 0x20)
+					out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)c << std::dec;
+				else
+					out << c;
+				break;
+		}
+	}
+
+	out << '"';
+	return out.str();
+}
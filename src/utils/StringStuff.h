@@ -30,6 +30,9 @@ std::vector<std::string> SplitString(const std::string& s, const char delim);
 /* JoinStrings: joins a vector of strings into one string with separators */
 std::string JoinStrings(const std::vector<std::string>& elements, const char* const separator);
 
+/* JsonString: returns s as a quoted JSON string with special characters escaped */
+std::string JsonString(const std::string& s);
+
 /* case_insensitive_compare: can be used for maps and more */
 struct case_insensitive_compare {
 	struct nocase_compare {
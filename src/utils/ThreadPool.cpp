@@ -0,0 +1,211 @@
+/*
+BodySlide and Outfit Studio
+See the included LICENSE file
+*/
+
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+
+namespace {
+thread_local const ThreadPool* currentPool = nullptr;
+thread_local size_t currentQueue = 0;
+} // namespace
+
+ThreadPool::ThreadPool(size_t threadCount) {
+	Start(threadCount);
+}
+
+ThreadPool::~ThreadPool() {
+	Stop();
+}
+
+ThreadPool& ThreadPool::Get() {
+	static ThreadPool pool;
+	return pool;
+}
+
+void ThreadPool::SetThreadCount(size_t threadCount) {
+	Stop();
+	Start(threadCount);
+}
+
+void ThreadPool::Start(size_t threadCount) {
+	if (threadCount == 0)
+		threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+
+	// The calling thread takes part in the work, so one less worker is needed
+	size_t workerCount = threadCount - 1;
+
+	queues.clear();
+	for (size_t i = 0; i < workerCount; i++)
+		queues.push_back(std::make_unique<TaskQueue>());
+
+	for (size_t i = 0; i < workerCount; i++)
+		workers.emplace_back(&ThreadPool::WorkerLoop, this, i);
+}
+
+void ThreadPool::Stop() {
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		stopping = true;
+	}
+	sleepCondition.notify_all();
+
+	for (auto& worker : workers)
+		worker.join();
+
+	workers.clear();
+	queues.clear();
+
+	stopping = false;
+	pending = 0;
+}
+
+void ThreadPool::Submit(Task task) {
+	if (workers.empty()) {
+		task();
+		return;
+	}
+
+	size_t queueIndex = 0;
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		if (currentPool == this)
+			queueIndex = currentQueue;
+		else
+			queueIndex = nextQueue++ % queues.size();
+	}
+
+	// Counted before it can be popped, so a worker running it can't decrement pending below zero
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		pending++;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(queues[queueIndex]->mutex);
+		queues[queueIndex]->tasks.push_back(std::move(task));
+	}
+	sleepCondition.notify_one();
+}
+
+bool ThreadPool::RunPendingTask(size_t preferredQueue) {
+	size_t queueCount = queues.size();
+	if (queueCount == 0)
+		return false;
+
+	Task task;
+	for (size_t n = 0; n < queueCount && !task; n++) {
+		size_t queueIndex = (preferredQueue + n) % queueCount;
+
+		std::lock_guard<std::mutex> lock(queues[queueIndex]->mutex);
+		auto& tasks = queues[queueIndex]->tasks;
+		if (tasks.empty())
+			continue;
+
+		if (n == 0) {
+			// Own queue: newest task first, its data is most likely still in cache
+			task = std::move(tasks.back());
+			tasks.pop_back();
+		}
+		else {
+			// Steal the oldest task from another queue
+			task = std::move(tasks.front());
+			tasks.pop_front();
+		}
+	}
+
+	if (!task)
+		return false;
+
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		pending--;
+	}
+
+	task();
+	return true;
+}
+
+void ThreadPool::WorkerLoop(size_t index) {
+	currentPool = this;
+	currentQueue = index;
+
+	for (;;) {
+		if (RunPendingTask(index))
+			continue;
+
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		sleepCondition.wait(lock, [this] { return stopping || pending > 0; });
+
+		if (stopping && pending == 0)
+			return;
+	}
+}
+
+void ThreadPool::ParallelFor(size_t count, const std::function<void(size_t)>& func) {
+	if (count == 0)
+		return;
+
+	if (workers.empty() || count == 1) {
+		for (size_t i = 0; i < count; i++)
+			func(i);
+		return;
+	}
+
+	struct LoopState {
+		std::atomic<size_t> next = 0;
+		std::atomic<size_t> active = 0;
+		std::mutex mutex;
+		std::condition_variable done;
+		std::exception_ptr error;
+	};
+
+	auto state = std::make_shared<LoopState>();
+
+	auto runIndices = [state, count, &func]() {
+		for (size_t i = state->next++; i < count; i = state->next++) {
+			try {
+				func(i);
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> lock(state->mutex);
+				if (!state->error)
+					state->error = std::current_exception();
+			}
+		}
+	};
+
+	size_t helperCount = std::min(count - 1, workers.size());
+	state->active = helperCount;
+
+	for (size_t h = 0; h < helperCount; h++) {
+		Submit([state, runIndices]() {
+			runIndices();
+
+			if (--state->active == 0) {
+				std::lock_guard<std::mutex> lock(state->mutex);
+				state->done.notify_all();
+			}
+		});
+	}
+
+	runIndices();
+
+	// Keep helping with queued work until every helper has returned
+	size_t preferredQueue = currentPool == this ? currentQueue : 0;
+	while (state->active > 0) {
+		if (RunPendingTask(preferredQueue))
+			continue;
+
+		std::unique_lock<std::mutex> lock(state->mutex);
+		state->done.wait_for(lock, std::chrono::milliseconds(1), [&state] { return state->active == 0; });
+	}
+
+	if (state->error)
+		std::rethrow_exception(state->error);
+}
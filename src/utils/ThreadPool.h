@@ -0,0 +1,77 @@
+/*
+BodySlide and Outfit Studio
+See the included LICENSE file
+*/
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing pool of std::thread workers.
+// Every worker owns a task queue. Workers pop their own queue from the back and steal from the front of other queues when they run dry.
+class ThreadPool {
+public:
+	typedef std::function<void()> Task;
+
+	// Thread count includes the calling thread, which always helps with the work. 0 uses the number of hardware threads.
+	ThreadPool(size_t threadCount = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// Process-wide pool shared by batch builds and data loading.
+	static ThreadPool& Get();
+
+	// Stops and recreates the workers. Must not be called while parallel work is running.
+	void SetThreadCount(size_t threadCount);
+	size_t GetThreadCount() const { return workers.size() + 1; }
+
+	// Calls func for every index in [0, count) and returns once all calls are done.
+	// Indices are handed out dynamically, so calls of very different cost balance out across threads.
+	// While waiting, the calling thread runs queued tasks as well. Nested calls from inside a task don't deadlock.
+	// The first exception thrown by func is rethrown after all other calls have finished.
+	void ParallelFor(size_t count, const std::function<void(size_t)>& func);
+
+	// Calls func for every element in [first, last).
+	template<typename Iter, typename Func>
+	void ForEach(Iter first, Iter last, Func&& func) {
+		std::vector<Iter> items;
+		for (Iter it = first; it != last; ++it)
+			items.push_back(it);
+
+		ParallelFor(items.size(), [&](size_t i) { func(*items[i]); });
+	}
+
+	// Queues a single task without waiting for it.
+	// Tasks must not wait for work outside of the pool: any thread waiting in ParallelFor may pick them up and block with them.
+	void Submit(Task task);
+
+private:
+	struct TaskQueue {
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	std::vector<std::unique_ptr<TaskQueue>> queues;
+	std::vector<std::thread> workers;
+
+	std::mutex sleepMutex;
+	std::condition_variable sleepCondition;
+	size_t pending = 0;
+	bool stopping = false;
+	size_t nextQueue = 0;
+
+	void Start(size_t threadCount);
+	void Stop();
+
+	// Pops a task from the preferred queue or steals one from another queue, then runs it.
+	bool RunPendingTask(size_t preferredQueue);
+	void WorkerLoop(size_t index);
+};